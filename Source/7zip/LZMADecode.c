@@ -146,6 +146,321 @@ void LZMACALL lzmaInit(lzma_stream *s)
   s->range = (0xFFFFFFFF);
 }
 
+/* lzmaDecodeMem() is not resumable, so the range coder state is
+   kept in locals and the output buffer doubles as the dictionary. */
+
+#define F_NORMALIZE \
+  if (range < kTopValue) \
+  { \
+    if (in == in_end) \
+      return LZMA_DATA_ERROR; \
+    range <<= 8; \
+    code = (code << 8) | *in++; \
+  }
+
+#define F_IF_BIT0(prob) F_NORMALIZE; bound = (range >> kNumBitModelTotalBits) * *(prob); if (code < bound)
+#define F_UPDATE_0(prob) range = bound; *(prob) += (kBitModelTotal - *(prob)) >> kNumMoveBits;
+#define F_UPDATE_1(prob) range -= bound; code -= bound; *(prob) -= *(prob) >> kNumMoveBits;
+
+#define F_GET_BIT(prob, mi) \
+  F_IF_BIT0(prob) { F_UPDATE_0(prob); mi <<= 1; } \
+  else { F_UPDATE_1(prob); mi = (mi + mi) + 1; }
+
+#define F_BIT_TREE(probs, numLevels, res) \
+  { \
+    int mi_ = 1, i_; \
+    for (i_ = (numLevels); i_ > 0; i_--) \
+    { \
+      CProb *prob_ = (probs) + mi_; \
+      F_GET_BIT(prob_, mi_) \
+    } \
+    res = mi_ - (1 << (numLevels)); \
+  }
+
+#define F_LEN(probs, posState, res) \
+  { \
+    CProb *lp_ = (probs); \
+    F_IF_BIT0(lp_ + LenChoice) \
+    { \
+      F_UPDATE_0(lp_ + LenChoice) \
+      F_BIT_TREE(lp_ + LenLow + ((posState) << kLenNumLowBits), kLenNumLowBits, res) \
+    } \
+    else \
+    { \
+      F_UPDATE_1(lp_ + LenChoice) \
+      F_IF_BIT0(lp_ + LenChoice2) \
+      { \
+        F_UPDATE_0(lp_ + LenChoice2) \
+        F_BIT_TREE(lp_ + LenMid + ((posState) << kLenNumMidBits), kLenNumMidBits, res) \
+        res += kLenNumLowSymbols; \
+      } \
+      else \
+      { \
+        F_UPDATE_1(lp_ + LenChoice2) \
+        F_BIT_TREE(lp_ + LenHigh, kLenNumHighBits, res) \
+        res += kLenNumLowSymbols + kLenNumMidSymbols; \
+      } \
+    } \
+  }
+
+int LZMACALL lzmaDecodeMem(lzma_stream *s)
+{
+  const Byte *in = s->next_in, *in_end = s->next_in + s->avail_in;
+  Byte *out_start = s->next_out, *out = s->next_out, *out_end = s->next_out + s->avail_out;
+  UInt32 range = 0xFFFFFFFF, code = 0, bound;
+  UInt32 rep0 = 1, rep1 = 1, rep2 = 1, rep3 = 1;
+  UInt32 posStateMask, literalPosMask;
+  UInt32 numProbs, dataSize;
+  CProb *p, *prob, *probs;
+  int lc, lp, pb, i;
+  int state = 0;
+  Byte previousByte = 0;
+
+  /* properties, dictionary size and the first 5 bytes of the range coder */
+  if (s->avail_in < 10 || *in > (9*5*5))
+    return LZMA_DATA_ERROR;
+
+  pb = *in / (9*5);
+  lp = (*in % (9*5)) / 9;
+  lc = *in % 9;
+  in += 5;
+
+  posStateMask = (1 << pb) - 1;
+  literalPosMask = (1 << lp) - 1;
+
+  numProbs = Literal + (LZMA_LIT_SIZE << (lc + pb));
+  dataSize = numProbs * sizeof(CProb);
+  if (dataSize != s->dynamicDataSize)
+  {
+    if (s->dynamicData)
+      lzmafree(s->dynamicData);
+    s->dynamicData = (Byte *) lzmaalloc(dataSize);
+    if (!s->dynamicData)
+    {
+      s->dynamicDataSize = 0;
+      return LZMA_NOT_ENOUGH_MEM;
+    }
+    s->dynamicDataSize = dataSize;
+  }
+  p = (CProb *) s->dynamicData;
+  while (numProbs--)
+    p[numProbs] = kBitModelTotal >> 1;
+
+  for (i = 0; i < 5; i++)
+    code = (code << 8) | *in++;
+
+  for (;;)
+  {
+    UInt32 nowPos = (UInt32) (out - out_start);
+    int posState = (int) (nowPos & posStateMask);
+    UInt32 len;
+
+    prob = p + IsMatch + (state << kNumPosBitsMax) + posState;
+    F_IF_BIT0(prob)
+    {
+      int symbol = 1;
+      F_UPDATE_0(prob)
+      probs = p + Literal + (LZMA_LIT_SIZE *
+        (((nowPos & literalPosMask) << lc) + (previousByte >> (8 - lc))));
+
+      if (state >= 7)
+      {
+        /* the previous packet was a match */
+        int matchByte = out[-(int) rep0];
+        do
+        {
+          int matchBit = (matchByte >> 7) & 1;
+          matchByte <<= 1;
+          prob = probs + ((1 + matchBit) << 8) + symbol;
+          F_IF_BIT0(prob)
+          {
+            F_UPDATE_0(prob)
+            symbol <<= 1;
+            if (matchBit)
+              break;
+          }
+          else
+          {
+            F_UPDATE_1(prob)
+            symbol = (symbol << 1) | 1;
+            if (!matchBit)
+              break;
+          }
+        }
+        while (symbol < 0x100);
+      }
+      while (symbol < 0x100)
+      {
+        prob = probs + symbol;
+        F_GET_BIT(prob, symbol)
+      }
+
+      if (out == out_end)
+        goto out_full;
+      previousByte = (Byte) symbol;
+      *out++ = previousByte;
+
+      if (state < 4) state = 0;
+      else if (state < 10) state -= 3;
+      else state -= 6;
+      continue;
+    }
+
+    F_UPDATE_1(prob)
+    prob = p + IsRep + state;
+    F_IF_BIT0(prob)
+    {
+      int posSlot;
+      F_UPDATE_0(prob)
+      rep3 = rep2;
+      rep2 = rep1;
+      rep1 = rep0;
+      state = state < 7 ? 7 : 10;
+      F_LEN(p + LenCoder, posState, len)
+      F_BIT_TREE(p + PosSlot + ((len < kNumLenToPosStates ? len : kNumLenToPosStates - 1) << kNumPosSlotBits),
+        kNumPosSlotBits, posSlot)
+      if (posSlot >= kStartPosModelIndex)
+      {
+        int numDirectBits = ((posSlot >> 1) - 1);
+        rep0 = (2 | ((UInt32) posSlot & 1));
+        if (posSlot < kEndPosModelIndex)
+        {
+          rep0 <<= numDirectBits;
+          probs = p + SpecPos + rep0 - posSlot - 1;
+        }
+        else
+        {
+          numDirectBits -= kNumAlignBits;
+          do
+          {
+            F_NORMALIZE
+            range >>= 1;
+            rep0 <<= 1;
+            if (code >= range)
+            {
+              code -= range;
+              rep0 |= 1;
+            }
+          }
+          while (--numDirectBits != 0);
+          probs = p + Align;
+          rep0 <<= kNumAlignBits;
+          numDirectBits = kNumAlignBits;
+        }
+        {
+          int mi = 1, bit = 1;
+          do
+          {
+            prob = probs + mi;
+            F_IF_BIT0(prob)
+            {
+              F_UPDATE_0(prob)
+              mi <<= 1;
+            }
+            else
+            {
+              F_UPDATE_1(prob)
+              mi = (mi + mi) + 1;
+              rep0 |= bit;
+            }
+            bit <<= 1;
+          }
+          while (--numDirectBits != 0);
+        }
+      }
+      else
+        rep0 = posSlot;
+      if (++rep0 == (UInt32) 0)
+        break; /* end marker */
+    }
+    else
+    {
+      F_UPDATE_1(prob)
+      prob = p + IsRepG0 + state;
+      F_IF_BIT0(prob)
+      {
+        F_UPDATE_0(prob)
+        prob = p + IsRep0Long + (state << kNumPosBitsMax) + posState;
+        F_IF_BIT0(prob)
+        {
+          F_UPDATE_0(prob)
+          if (nowPos == 0)
+            return LZMA_DATA_ERROR;
+          state = state < 7 ? 9 : 11;
+          if (out == out_end)
+            goto out_full;
+          previousByte = out[-(int) rep0];
+          *out++ = previousByte;
+          continue;
+        }
+        F_UPDATE_1(prob)
+      }
+      else
+      {
+        UInt32 distance;
+        F_UPDATE_1(prob)
+        prob = p + IsRepG1 + state;
+        F_IF_BIT0(prob)
+        {
+          F_UPDATE_0(prob)
+          distance = rep1;
+        }
+        else
+        {
+          F_UPDATE_1(prob)
+          prob = p + IsRepG2 + state;
+          F_IF_BIT0(prob)
+          {
+            F_UPDATE_0(prob)
+            distance = rep2;
+          }
+          else
+          {
+            F_UPDATE_1(prob)
+            distance = rep3;
+            rep3 = rep2;
+          }
+          rep2 = rep1;
+        }
+        rep1 = rep0;
+        rep0 = distance;
+      }
+      F_LEN(p + RepLenCoder, posState, len)
+      state = state < 7 ? 8 : 11;
+    }
+
+    if (rep0 > nowPos)
+      return LZMA_DATA_ERROR;
+
+    len += kMatchMinLen;
+    {
+      const Byte *src = out - rep0;
+      int full = (UInt32) (out_end - out) < len;
+      if (full)
+        len = (UInt32) (out_end - out);
+      while (len--)
+        *out++ = *src++;
+      if (full)
+        goto out_full;
+    }
+    previousByte = out[-1];
+  }
+
+  i = LZMA_STREAM_END;
+  goto done;
+
+out_full:
+  i = LZMA_OK;
+
+done:
+  s->avail_in = (UInt32) (in_end - in);
+  s->next_in = (Byte *) in;
+  s->avail_out = (UInt32) (out_end - out);
+  s->totalOut += (UInt32) (out - out_start);
+  s->next_out = out;
+  return i;
+}
+
 int LZMACALL lzmaDecode(lzma_stream *s)
 {
   /* restore decoder state */
@@ -133,6 +133,14 @@ typedef struct
 void LZMACALL lzmaInit(lzma_stream *);
 int LZMACALL lzmaDecode(lzma_stream *);
 
+/* decodes a whole stream at once. next_in must hold all of the input and
+   next_out must have room for all of the output, which is also used as the
+   dictionary. the call can't be resumed: it returns LZMA_STREAM_END once
+   the end marker is reached, LZMA_OK once the output buffer is full and
+   LZMA_DATA_ERROR if the input is corrupted or too short. only the
+   dynamicData of the stream is used, it doesn't need lzmaInit(). */
+int LZMACALL lzmaDecodeMem(lzma_stream *);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,260 @@
+/*
+ * blockcomp.cpp
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include "Platform.h"
+#include "blockcomp.h"
+#include "clzma.h"
+#include "growbuf.h"
+#include "fileform.h"
+
+#include <vector>
+
+#ifndef _WIN32
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+using namespace std;
+
+struct block_job
+{
+  GrowBuf in;
+  GrowBuf out;
+  int level;
+  unsigned int dict_size;
+  int res;
+};
+
+static int compress_block(block_job *job)
+{
+  CLZMA lzma;
+  char obuf[65536];
+  char a;
+  bool flush = false;
+
+  int res = lzma.Init(job->level, job->dict_size);
+  if (res != C_OK)
+    return res;
+
+  lzma.SetNextIn((char *) job->in.get(), job->in.getlen());
+  for (;;)
+  {
+    if (!flush && !lzma.GetAvailIn())
+    {
+      lzma.SetNextIn(&a, 0);
+      flush = true;
+    }
+
+    lzma.SetNextOut(obuf, sizeof(obuf));
+    res = lzma.Compress(flush);
+    if (res < 0 && (res != -1 || !flush))
+    {
+      lzma.End();
+      return res;
+    }
+
+    int l = lzma.GetNextOut() - obuf;
+    if (l)
+      job->out.add(obuf, l);
+    else if (flush)
+      break;
+  }
+
+  lzma.End();
+  return C_OK;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI block_thread(LPVOID lpParameter)
+#else
+static void* block_thread(void *lpParameter)
+#endif
+{
+  block_job *job = (block_job *) lpParameter;
+  job->res = compress_block(job);
+  return 0;
+}
+
+static int get_processor_count()
+{
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int n = (int) si.dwNumberOfProcessors;
+#else
+  int n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1)
+    n = 1;
+  if (n > 32)
+    n = 32;
+  return n;
+}
+
+// copies size bytes of the stream at offset into buf. the stream is data
+// followed by db.
+static void fill_block(GrowBuf *buf, const void *data, int len, IMMap *db, __int64 offset, int size)
+{
+  buf->resize(0);
+
+  if (offset < len)
+  {
+    int l = min(len - (int) offset, size);
+    buf->add((const char *) data + offset, l);
+    offset += l;
+    size -= l;
+  }
+
+  offset -= len;
+  while (size > 0)
+  {
+    int l = min(size, 1 << 20);
+    buf->add(db->get(offset, l), l);
+    db->release();
+    offset += l;
+    size -= l;
+  }
+}
+
+CBlockCompressor::CBlockCompressor(int level, unsigned int dict_size, int block_size)
+{
+  m_level = level;
+  m_block_size = block_size;
+  // a dictionary larger than a block is only a waste of memory
+  m_dict_size = min(dict_size, (unsigned int) block_size);
+  m_num_threads = get_processor_count();
+  m_num_blocks = 0;
+  m_compressed_size = 0;
+}
+
+int CBlockCompressor::compress(const void *data, int len, IMMap *db, __int64 db_len, writer_sink *sink)
+{
+  __int64 total = len + db_len;
+
+  m_num_blocks = (int) ((total + m_block_size - 1) / m_block_size);
+  m_compressed_size = 0;
+
+  solidheader sh;
+  sh.block_size = m_block_size;
+  sh.num_blocks = m_num_blocks;
+  sh.length = total;
+
+  solidheader_writer w(sink);
+  w.write(&sh);
+  m_compressed_size += sizeof(solidheader);
+
+  vector<solidblock> table;
+  __int64 compressed_offset = 0;
+  block_job *jobs = new block_job[m_num_threads];
+  int res = C_OK;
+
+  try
+  {
+    for (int b = 0; b < m_num_blocks && res == C_OK; b += m_num_threads)
+    {
+      int n = min(m_num_threads, m_num_blocks - b);
+      int i;
+
+#ifdef _WIN32
+      vector<HANDLE> threads(n, (HANDLE) NULL);
+#else
+      vector<pthread_t> threads(n);
+      vector<char> started(n, 0);
+#endif
+
+      for (i = 0; i < n; i++)
+      {
+        __int64 offset = (__int64) (b + i) * m_block_size;
+        int size = (int) min((__int64) m_block_size, total - offset);
+
+        fill_block(&jobs[i].in, data, len, db, offset, size);
+        jobs[i].out.resize(0);
+        jobs[i].level = m_level;
+        jobs[i].dict_size = m_dict_size;
+        jobs[i].res = C_OK;
+
+        // if no thread can be created, the block is compressed right here
+#ifdef _WIN32
+        DWORD dwThreadId;
+        threads[i] = CreateThread(0, 0, block_thread, (LPVOID) &jobs[i], 0, &dwThreadId);
+        if (!threads[i])
+#else
+        started[i] = !pthread_create(&threads[i], NULL, block_thread, (LPVOID) &jobs[i]);
+        if (!started[i])
+#endif
+          block_thread(&jobs[i]);
+      }
+
+      for (i = 0; i < n; i++)
+      {
+#ifdef _WIN32
+        if (threads[i])
+        {
+          WaitForSingleObject(threads[i], INFINITE);
+          CloseHandle(threads[i]);
+        }
+#else
+        if (started[i])
+          pthread_join(threads[i], NULL);
+#endif
+      }
+
+      // blocks are written in order, once all of the batch is done
+      for (i = 0; i < n; i++)
+      {
+        if (jobs[i].res != C_OK)
+        {
+          res = jobs[i].res;
+          break;
+        }
+
+        solidblock sb;
+        sb.offset = (__int64) (b + i) * m_block_size;
+        sb.compressed_offset = compressed_offset;
+        table.push_back(sb);
+
+        int l = jobs[i].out.getlen();
+        sink->write_data(jobs[i].out.get(), l);
+        compressed_offset += l;
+      }
+    }
+  }
+  catch (...)
+  {
+    delete [] jobs;
+    throw;
+  }
+
+  delete [] jobs;
+
+  if (res != C_OK)
+    return res;
+
+  // the seek table, with an extra entry that marks the end of the last block
+  solidblock end;
+  end.offset = total;
+  end.compressed_offset = compressed_offset;
+  table.push_back(end);
+
+  solidblock_writer sbw(sink);
+  for (size_t i = 0; i < table.size(); i++)
+  {
+    sbw.write(&table[i]);
+  }
+  m_compressed_size += compressed_offset + table.size() * sizeof(solidblock);
+
+  return C_OK;
+}
@@ -0,0 +1,70 @@
+/*
+ * blockcomp.h
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef ___BLOCKCOMP__H___
+#define ___BLOCKCOMP__H___
+
+#include "Platform.h"
+#include "mmap.h"
+#include "writer.h"
+
+/**
+ * Compresses a stream for compress whole mode (SetCompressor /SOLID).
+ *
+ * The stream is split into blocks of a fixed size that are compressed with
+ * LZMA independently of each other, several blocks at a time on as many
+ * threads as there are processors. The result is written in the layout
+ * described next to solidheader in Source/exehead/fileform.h.
+ */
+class CBlockCompressor
+{
+  private: // don't copy instances
+    CBlockCompressor(const CBlockCompressor&);
+    void operator=(const CBlockCompressor&);
+
+  public:
+    /**
+     * @param level Compression level, as for ICompressor::Init().
+     * @param dict_size Dictionary size, limited to block_size.
+     * @param block_size Uncompressed size of each block.
+     */
+    CBlockCompressor(int level, unsigned int dict_size, int block_size);
+
+    /**
+     * Compresses data followed by the first db_len bytes of db and writes
+     * the solidheader, the blocks and their seek table to sink. The sink
+     * throws on write errors, just like it does for the header writers.
+     *
+     * @return C_OK or the first error returned by a compressor.
+     */
+    int compress(const void *data, int len, IMMap *db, __int64 db_len, writer_sink *sink);
+
+    /** Amount of data written to the sink by compress(). */
+    __int64 get_compressed_size() const { return m_compressed_size; }
+
+    int get_num_blocks() const { return m_num_blocks; }
+    int get_num_threads() const { return m_num_threads; }
+
+  private:
+    int m_level;
+    unsigned int m_dict_size;
+    int m_block_size;
+    int m_num_threads;
+    int m_num_blocks;
+    __int64 m_compressed_size;
+};
+
+#endif//!___BLOCKCOMP__H___
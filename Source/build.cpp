@@ -121,6 +121,8 @@ CEXEBuild::CEXEBuild() :
   multiple_entries_instruction=0;
 
   build_include_depth=0;
+  m_include_record=NULL;
+  m_include_guard.state=GUARD_NONE;
 #ifndef _UNICODE
   build_include_isutf8=false;
 #endif
@@ -166,8 +168,10 @@ CEXEBuild::CEXEBuild() :
   build_compress=1;
   build_compress_level=9;
   build_compress_dict_size=1<<23;
+  build_compress_block_size=1<<23;
   build_data_file = 1;
   build_file_length = 0;
+  build_write_toc = false;
 
   cur_entries=&build_entries;
   cur_instruction_entry_map=&build_instruction_entry_map;
@@ -180,6 +184,7 @@ CEXEBuild::CEXEBuild() :
   cur_strlist=&build_strlist;
   cur_langtables=&build_langtables;
   cur_ctlcolors=&build_ctlcolors;
+  cur_toc=&build_toc;
   cur_pages=&build_pages;
   cur_page=0;
   cur_page_type=-1;
@@ -341,6 +346,8 @@ CEXEBuild::CEXEBuild() :
   m_UserVarNames.add(_T("_OUTDIR"),1);       // 31
 
   m_iBaseVarsNum = m_UserVarNames.getnum();
+  m_iVarAndConstNamesVars = 0;
+  m_iVarAndConstNamesConsts = 0;
 
   m_ShellConstants.add(_T("WINDIR"),CSIDL_WINDOWS,CSIDL_WINDOWS);
   m_ShellConstants.add(_T("SYSDIR"),CSIDL_SYSTEM,CSIDL_SYSTEM);
@@ -474,7 +481,42 @@ void CEXEBuild::initialize(const TCHAR *makensis_path)
 }
 
 
-__int64 CEXEBuild::getcurdbsize() { return cur_datablock->getlen(); }
+__int64 CEXEBuild::getcurdbsize()
+{
+  __int64 size = cur_datablock->getlen();
+  if (is_datablock_streamed())
+    size += build_datavolumes.getlen();
+  return size;
+}
+
+bool CEXEBuild::is_datablock_streamed() const
+{
+  return cur_datablock == &build_datablock && build_datavolumes.is_open();
+}
+
+__int64 CEXEBuild::get_data_volume_length()
+{
+  if (!build_file_length)
+    return 0;
+  return (__int64)build_file_length * (1<<20) - sizeof(dataheader);
+}
+
+int CEXEBuild::open_data_volumes()
+{
+  if (!build_output_filename[0])
+  {
+    ERROR_MSG(_T("Error: SetDataFile stream requires OutFile before any data is added\n"));
+    return PS_ERROR;
+  }
+
+  if (build_datavolumes.open(build_output_filename, get_data_volume_length()))
+  {
+    ERROR_MSG(_T("Error: can't open data file \"%s\"\n"), build_datavolumes.get_current_filename());
+    return PS_ERROR;
+  }
+
+  return PS_OK;
+}
 
 // returns offset in stringblock
 int CEXEBuild::add_string(const TCHAR *string, int process/*=1*/, WORD codepage/*=CP_ACP*/)
@@ -539,6 +581,13 @@ char* convert_processed_string_to_ansi(char *out, const TCHAR *in, WORD codepage
 // based on Dave Laundon's code
 int CEXEBuild::preprocess_string(TCHAR *out, const TCHAR *in, WORD codepage/*=CP_ACP*/)
 {
+  // variables can be declared at any time, add the new names. constants
+  // first, so they win if a variable is named like one.
+  for (; m_iVarAndConstNamesConsts < m_ShellConstants.getnum(); m_iVarAndConstNamesConsts++)
+    m_VarAndConstNames.add(m_ShellConstants.idx2name(m_iVarAndConstNamesConsts), m_iVarAndConstNamesConsts*2+1);
+  for (; m_iVarAndConstNamesVars < m_UserVarNames.getnum(); m_iVarAndConstNamesVars++)
+    m_VarAndConstNames.add(m_UserVarNames.idx2name(m_iVarAndConstNamesVars), m_iVarAndConstNamesVars*2);
+
   const TCHAR *p=in;
   while (*p)
   {
@@ -581,76 +630,39 @@ int CEXEBuild::preprocess_string(TCHAR *out, const TCHAR *in, WORD codepage/*=CP
         // starts with a $ but not $$.
         { // block - why do we need this extra {?
           bool bProceced=false;
-          if ( *p )
+          int len;
+          // the longest variable or constant name p starts with, a constant
+          // if there are both
+          int name = m_VarAndConstNames.longest(p, &len);
+          if (name >= 0 && !(name & 1))
           {
-            const TCHAR *pUserVarName = p;
-            while (isSimpleChar(*pUserVarName))
-              pUserVarName++;
-
-            while (pUserVarName > p)
-            {
-              if (m_ShellConstants.get((TCHAR*)p, pUserVarName-p) >= 0)
-                break; // Woops it's a shell constant
-
-              // Jim Park: The following line could be a source of bugs for
-              // variables where one variable name is a prefix of another
-              // variable name.  For example, if you are searching for
-              // variable 'UserVar', you can get 'UserVariable' instead.
-              // Suggest that we do:
-              // TCHAR varname[NSIS_MAX_STRLEN];
-              // _tcsncpy(varname, p, pUserVarName-p);
-              // int idxUserVar = m_UserVarNames.get(varname);
-              int idxUserVar = m_UserVarNames.get((TCHAR*)p, pUserVarName-p);
-              if (idxUserVar >= 0)
-              {
-                // Well, using variables inside string formating doens't mean
-                // using the variable, beacuse it will be always an empty string
-                // which is also memory wasting
-                // So the line below must be commented !??
-                //m_UserVarNames.inc_reference(idxUserVar);
-                *out++ = (TCHAR) NS_VAR_CODE; // Named user variable;
-                WORD w = FIX_ENDIAN_INT16(CODE_SHORT(idxUserVar));
-                memcpy(out, &w, sizeof(WORD));
-                out += sizeof(WORD)/sizeof(TCHAR);
-                p += pUserVarName-p; // zip past the user var string.
-                bProceced = true;
-                break;
-              }
-              pUserVarName--;
-            }
-          }// if ( *p )
-          if (!bProceced && *p)
+            int idxUserVar = name >> 1;
+            // Well, using variables inside string formating doens't mean
+            // using the variable, beacuse it will be always an empty string
+            // which is also memory wasting
+            // So the line below must be commented !??
+            //m_UserVarNames.inc_reference(idxUserVar);
+            *out++ = (TCHAR) NS_VAR_CODE; // Named user variable;
+            WORD w = FIX_ENDIAN_INT16(CODE_SHORT(idxUserVar));
+            memcpy(out, &w, sizeof(WORD));
+            out += sizeof(WORD)/sizeof(TCHAR);
+            p += len; // zip past the user var string.
+            bProceced = true;
+          }
+          else if (name >= 0)
           {
-            const TCHAR *pShellConstName = p;
-            while (isSimpleChar(*pShellConstName))
-              pShellConstName++;
-
-            while (pShellConstName > p)
-            {
-              // Look for the identifier in the shell constants list of strings.
-              int idxConst = m_ShellConstants.get((TCHAR*)p, pShellConstName - p);
-
-              // If found...
-              if (idxConst >= 0)
-              {
-                int CSIDL_Value_current = m_ShellConstants.get_value1(idxConst);
-                int CSIDL_Value_all = m_ShellConstants.get_value2(idxConst);
-                *out++=(TCHAR)NS_SHELL_CODE; // Constant code identifier
+            int idxConst = name >> 1;
+            int CSIDL_Value_current = m_ShellConstants.get_value1(idxConst);
+            int CSIDL_Value_all = m_ShellConstants.get_value2(idxConst);
+            *out++=(TCHAR)NS_SHELL_CODE; // Constant code identifier
 #ifdef _UNICODE
-                *out++=MAKEWORD(CSIDL_Value_current, CSIDL_Value_all);
+            *out++=MAKEWORD(CSIDL_Value_current, CSIDL_Value_all);
 #else
-                *out++=(TCHAR)CSIDL_Value_current;
-                *out++=(TCHAR)CSIDL_Value_all;
+            *out++=(TCHAR)CSIDL_Value_current;
+            *out++=(TCHAR)CSIDL_Value_all;
 #endif
-                p = pShellConstName; // zip past the shell constant string.
-                bProceced = true;
-                break;
-              }
-
-              // We are looking from the longest identifier first and work
-              // smaller.
-              pShellConstName--;
-            }
+            p += len; // zip past the shell constant string.
+            bProceced = true;
           }
           if ( !bProceced && *p == _T('(') )
           {
@@ -730,11 +742,16 @@ __int64 CEXEBuild::datablock_optimize(__int64 start_offset, __int64 first_int)
 {
   __int64 this_len = cur_datablock->getlen() - start_offset;
 
-  cached_db_size this_size = {first_int, start_offset};
+  // when streaming, the returned and cached offsets are datablock offsets
+  // while start_offset is relative to what is left in cur_datablock
+  bool streamed = is_datablock_streamed();
+  __int64 base = streamed ? build_datavolumes.getlen() : 0;
+
+  cached_db_size this_size = {first_int, base + start_offset};
   this->cur_datablock_cache->add(&this_size, sizeof(cached_db_size));
 
   if (!this->build_optimize_datablock || this_len < (int) sizeof(int))
-    return start_offset;
+    return base + start_offset;
 
   MMapBuf *db = (MMapBuf *) cur_datablock;
   db->setro(TRUE);
@@ -753,11 +770,21 @@ __int64 CEXEBuild::datablock_optimize(__int64 start_offset, __int64 first_int)
       {
         int l = min(left, build_filebuflen);
         void *newstuff = db->get(start_offset + this_len - left, l);
-        void *oldstuff = db->getmore(pos + this_len - left, l);
+        int res;
+
+        if (streamed)
+        {
+          // everything but the new data is already in the data volumes
+          res = build_datavolumes.compare(pos + this_len - left, newstuff, l);
+        }
+        else
+        {
+          void *oldstuff = db->getmore(pos + this_len - left, l);
 
-        int res = memcmp(newstuff, oldstuff, l);
+          res = memcmp(newstuff, oldstuff, l);
 
-        db->release(oldstuff, l);
+          db->release(oldstuff, l);
+        }
         db->release();
 
         if (res)
@@ -771,7 +798,7 @@ __int64 CEXEBuild::datablock_optimize(__int64 start_offset, __int64 first_int)
       if (!left)
       {
         db_opt_save += this_len;
-        db->resize(max(start_offset, pos + this_len));
+        db->resize(streamed ? start_offset : max(start_offset, pos + this_len));
         db->setro(FALSE);
         this->cur_datablock_cache->resize(cur_datablock_cache->getlen() - sizeof(cached_db_size));
         return pos;
@@ -781,10 +808,10 @@ __int64 CEXEBuild::datablock_optimize(__int64 start_offset, __int64 first_int)
 
   db->setro(FALSE);
 
-  return start_offset;
+  return base + start_offset;
 }
 
-__int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
+__int64 CEXEBuild::add_db_data(IMMap *mmap, toc_entry *toc) // returns offset
 {
   build_compressor_set = true;
 
@@ -808,6 +835,15 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
   // most likely to point to a MMapBuf type right now so it works.
   MMapBuf *db = (MMapBuf *) this->cur_datablock;
 
+  if (build_data_file == 3 && db == &build_datablock && !build_datavolumes.is_open())
+  {
+    if (open_data_volumes() != PS_OK)
+      return -1;
+  }
+
+  // offset of db's first byte in the datablock, non-zero when streaming
+  __int64 base = is_datablock_streamed() ? build_datavolumes.getlen() : 0;
+
   __int64 st = db->getlen();
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
@@ -815,9 +851,9 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
   {
     // grow datablock so that there is room to compress into
     __int64 bufferlen = length + 1024 + length / 4; // give a nice 25% extra space
-    if (st+bufferlen+sizeof(__int64) < 0)          // we've hit a signed integer overflow (file is over 1.6 GB)
-        bufferlen = INT_MAX-st-sizeof(__int64); //  so maximize compressor room and hope the file compresses well
-      db->resize(st + bufferlen + sizeof(__int64));
+    if (st+bufferlen+BLOB_HEADER_SIZE < 0)          // we've hit a signed integer overflow (file is over 1.6 GB)
+        bufferlen = INT_MAX-st-BLOB_HEADER_SIZE; //  so maximize compressor room and hope the file compresses well
+      db->resize(st + bufferlen + BLOB_HEADER_SIZE);
 
     int n = compressor->Init(build_compress_level, build_compress_dict_size);
     if (n != C_OK)
@@ -835,7 +871,7 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
       __int64 out_len = min(this->build_filebuflen, avail_out);
 
       compressor->SetNextIn((char*) mmap->get(length - avail_in, in_len), in_len);
-      compressor->SetNextOut((char*) db->get(st + sizeof(__int64) + bufferlen - avail_out, out_len), out_len);
+      compressor->SetNextOut((char*) db->get(st + BLOB_HEADER_SIZE + bufferlen - avail_out, out_len), out_len);
       if ((ret = compressor->Compress(0)) < 0)
       {
         ERROR_MSG(_T("Error: add_db_data() - compress() failed(%s [%d])\n"), compressor->GetErrStr(ret), ret);
@@ -864,7 +900,7 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
       {
         __int64 out_len = min(build_filebuflen, avail_out);
 
-        out = (char *) db->get(st + sizeof(__int64) + bufferlen - avail_out, out_len);
+        out = (char *) db->get(st + BLOB_HEADER_SIZE + bufferlen - avail_out, out_len);
 
         compressor->SetNextOut(out, out_len);
         if ((ret = compressor->Compress(C_FINISH)) < 0)
@@ -888,14 +924,32 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
       if (avail_out && (build_compress == 2 || used < length))
       {
         done=1;
-        db->resize(st + used + sizeof(__int64));
+        db->resize(st + used + BLOB_HEADER_SIZE);
 
-        *(__int64*)db->get(st, sizeof(__int64)) = /*FIX_ENDIAN_INT32*/(used | /*0x80000000*/COMPRESSED_FLAG_MARK);
+        crc32_t crc = 0;
+        for (__int64 pos = 0; pos < used; )
+        {
+          int l = (int) min((__int64) build_filebuflen, used - pos);
+          crc = CRC32(crc, (unsigned char *) db->get(st + BLOB_HEADER_SIZE + pos, l), l);
+          db->release();
+          pos += l;
+        }
+
+        char *hdr = (char *) db->get(st, BLOB_HEADER_SIZE);
+        *(__int64*)hdr = /*FIX_ENDIAN_INT32*/(used | /*0x80000000*/COMPRESSED_FLAG_MARK);
+        *(crc32_t*)(hdr + sizeof(__int64)) = FIX_ENDIAN_INT32(crc);
         db->release();
 
+        if (toc)
+        {
+          toc->stored_size = used;
+          toc->flags = TOC_FLAGS_COMPRESSED;
+          toc->crc = crc;
+        }
+
         __int64 nst = datablock_optimize(st, used | /*0x80000000*/COMPRESSED_FLAG_MARK); // modified by yew
-        if (nst == st) db_comp_save += length - used;
-        else st = nst;
+        if (nst == base + st) db_comp_save += length - used;
+        st = nst;
       }
     }
     else
@@ -905,27 +959,61 @@ __int64 CEXEBuild::add_db_data(IMMap *mmap) // returns offset
 
   if (!done)
   {
-    db->resize(st + length + sizeof(__int64));
-    __int64 *plen = (__int64 *) db->get(st, sizeof(__int64));
-    *plen = /*FIX_ENDIAN_INT32*/(length);
-    db->release();
+    db->resize(st + length + BLOB_HEADER_SIZE);
 
+    crc32_t crc = 0;
     __int64 left = length;
     while (left > 0)
     {
       int l = min(build_filebuflen, left);
-      int *p = (int *) db->get(st + sizeof(__int64) + length - left, l);
+      int *p = (int *) db->get(st + BLOB_HEADER_SIZE + length - left, l);
       memcpy(p, mmap->get(length - left, l), l);
+      crc = CRC32(crc, (unsigned char *) p, l);
       db->flush(l);
       db->release();
       mmap->release();
       left -= l;
     }
 
+    char *hdr = (char *) db->get(st, BLOB_HEADER_SIZE);
+    *(__int64*)hdr = /*FIX_ENDIAN_INT32*/(length);
+    *(crc32_t*)(hdr + sizeof(__int64)) = FIX_ENDIAN_INT32(crc);
+    db->release();
+
+    if (toc)
+    {
+      toc->stored_size = length;
+      toc->flags = 0;
+      toc->crc = crc;
+    }
+
     st = datablock_optimize(st, length);
   }
 
-  db_full_size += length + sizeof(__int64);
+  db_full_size += length + BLOB_HEADER_SIZE;
+  if (toc) toc->size = length;
+
+  if (is_datablock_streamed())
+  {
+    // move the new data (if it wasn't optimized away) to the data volumes
+    __int64 dbl = db->getlen();
+    __int64 left = dbl;
+    db->setro(TRUE);
+    while (left > 0)
+    {
+      int l = min(build_filebuflen, left);
+      int err = build_datavolumes.write(db->get(dbl - left, l), l);
+      db->release();
+      if (err)
+      {
+        ERROR_MSG(_T("Error: can't write %d bytes to data file \"%s\"\n"), l, build_datavolumes.get_current_filename());
+        return -1;
+      }
+      left -= l;
+    }
+    db->setro(FALSE);
+    db->resize(0);
+  }
 
   return st;
 }
@@ -937,7 +1025,7 @@ __int64 CEXEBuild::add_db_data(const char *data, __int64 length) // returns offs
   return add_db_data(&fakemap);
 }
 
-int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock) // returns offset
+int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock, int lc, int lp, int pb) // returns offset
 {
   build_compressor_set=true;
 
@@ -953,13 +1041,22 @@ int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock) // retur
   assert(st<INT_MAX); // added by yew , the data block can not beyond 2GB
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
-  if (!build_compress_whole && build_compress)
+  // an empty stream can't be decoded, it's stored
+  if (!build_compress_whole && build_compress && length)
   {
     // grow datablock so that there is room to compress into
     int bufferlen=length+1024+length/4; // give a nice 25% extra space
-    dblock->resize(st+bufferlen+sizeof(__int64));
+    dblock->resize(st+bufferlen+BLOB_HEADER_SIZE);
 
-	int n = compressor->Init(build_compress_level, build_compress_dict_size);
+    int n;
+    if (compressor == &lzma_compressor)
+    {
+      // the dictionary never needs to be larger than the data
+      int dict_size = min(build_compress_dict_size, max(length, 4096));
+      n = lzma_compressor.Init(build_compress_level, dict_size, lc, lp, pb);
+    }
+    else
+      n = compressor->Init(build_compress_level, build_compress_dict_size);
     if (n != C_OK)
     {
       ERROR_MSG(_T("Internal compiler error #12345: deflateInit() failed(%s [%d]).\n"), compressor->GetErrStr(n), n);
@@ -967,7 +1064,7 @@ int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock) // retur
     }
 
     compressor->SetNextIn((char*)data, length);
-    compressor->SetNextOut((char*)dblock->get() + st + sizeof(__int64), bufferlen);
+    compressor->SetNextOut((char*)dblock->get() + st + BLOB_HEADER_SIZE, bufferlen);
 
     compressor->Compress(C_FINISH);
 
@@ -977,9 +1074,11 @@ int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock) // retur
     if (compressor->GetAvailOut() && (build_compress == 2 || used < length))
     {
       done=1;
-      dblock->resize(st+used+sizeof(__int64));
+      dblock->resize(st+used+BLOB_HEADER_SIZE);
 
-      *((__int64*)((char *)dblock->get()+st)) = /*FIX_ENDIAN_INT32*/(used|/*0x80000000*/COMPRESSED_FLAG_MARK);
+      char *hdr = (char *)dblock->get()+st;
+      *((__int64*)hdr) = /*FIX_ENDIAN_INT32*/(used|/*0x80000000*/COMPRESSED_FLAG_MARK);
+      *((crc32_t*)(hdr+sizeof(__int64))) = FIX_ENDIAN_INT32(CRC32(0,(unsigned char *)hdr+BLOB_HEADER_SIZE,used));
     }
     compressor->End();
   }
@@ -990,12 +1089,44 @@ int CEXEBuild::add_data(const char *data, int length, IGrowBuf *dblock) // retur
     dblock->resize(st);
     __int64 rl = FIX_ENDIAN_INT32(length);
     dblock->add(&rl,sizeof(__int64));
+    crc32_t crc = FIX_ENDIAN_INT32(CRC32(0,(const unsigned char *)data,length));
+    dblock->add(&crc,sizeof(crc32_t));
     dblock->add(data,length);
   }
 
   return st;
 }
 
+int CEXEBuild::add_header_data(IGrowBuf *hdr, IGrowBuf *dblock) // returns offset
+{
+  // PrepareHeaders() just set the offsets of the blocks the parts end at
+  int ends[HEADER_PARTS] = {
+    cur_header->blocks[NB_ENTRIES].offset,
+    cur_header->blocks[NB_STRINGS].offset,
+    cur_header->blocks[NB_LANGTABLES].offset,
+    hdr->getlen()
+  };
+  const char *data = (const char *)hdr->get();
+  int st = dblock->getlen();
+  int pos = 0;
+
+  for (int i = 0; i < HEADER_PARTS; i++)
+  {
+    int ret;
+    // unicode strings compress better without literal context bits, the
+    // high bytes are mostly zero
+    if (i == 2 && build_unicode)
+      ret = add_data(data + pos, ends[i] - pos, dblock, 0, 0, 1);
+    else
+      ret = add_data(data + pos, ends[i] - pos, dblock);
+    if (ret < 0)
+      return -1;
+    pos = ends[i];
+  }
+
+  return st;
+}
+
 int CEXEBuild::add_label(const TCHAR *name)
 {
   if (!build_cursection)
@@ -2283,6 +2414,9 @@ void CEXEBuild::PrepareHeaders(IGrowBuf *hdrbuf)
 
   cur_header->blocks[NB_ENTRIES].offset = sizeof(header) + blocks_buf.getlen();
   entry_writer::write_block(cur_entries, &sink);
+  // the packed entries leave the blocks that follow unaligned
+  while (blocks_buf.getlen() & 3)
+    sink.write_byte(0);
 
   cur_header->blocks[NB_STRINGS].offset = sizeof(header) + blocks_buf.getlen();
 #ifdef _UNICODE
@@ -2298,6 +2432,10 @@ void CEXEBuild::PrepareHeaders(IGrowBuf *hdrbuf)
   cur_header->blocks[NB_CTLCOLORS].offset = sizeof(header) + blocks_buf.getlen();
   ctlcolors_writer::write_block(cur_ctlcolors, &sink);
 
+  cur_header->blocks[NB_TOC].offset = sizeof(header) + blocks_buf.getlen();
+  cur_header->blocks[NB_TOC].num = cur_toc->getlen() / sizeof(toc_entry);
+  toc_entry_writer::write_block(cur_toc, &sink);
+
 #ifdef NSIS_SUPPORT_BGBG
   if (cur_header->bg_color1 != -1)
   {
@@ -2629,6 +2767,12 @@ int CEXEBuild::write_output(void)
   fh.flags=0;
 #endif
   fh.flags |= FH_FLAGS_NSIS64;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+  // blobs are verified as they are extracted, unless the datablock is only
+  // decompressed as a whole
+  if (build_crcchk && !build_compress_whole) fh.flags |= FH_FLAGS_BLOB_CRC;
+#endif
+  if (build_compress_whole) fh.flags |= FH_FLAGS_SOLID;
 #ifdef NSIS_CONFIG_SILENT_SUPPORT
   if (build_header.flags&(CH_FLAGS_SILENT|CH_FLAGS_SILENT_LOG)) fh.flags |= FH_FLAGS_SILENT;
 #endif
@@ -2639,14 +2783,12 @@ int CEXEBuild::write_output(void)
   int build_data_file_final=build_data_file;
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
-  if (build_compress_whole)
+  if (build_compress_whole && build_data_file_final)
   {
-    int n = compressor->Init(build_compress_level, build_compress_dict_size);
-    if (n != C_OK)
-    {
-      ERROR_MSG(_T("Internal compiler error #12345: deflateInit() failed(%s [%d]).\n"), compressor->GetErrStr(n), n);
-      return PS_ERROR;
-    }
+    // the compress whole stream is always kept in the installer
+    if (build_data_file_final != 1)
+      warning(_T("SetDataFile: data files are not supported in compress whole mode, the data is kept in the installer"));
+    build_data_file_final = 0;
   }
 #endif
 
@@ -2657,7 +2799,7 @@ int CEXEBuild::write_output(void)
 
       PrepareHeaders(&hdrcomp);
 
-      if (add_data((char*)hdrcomp.get(),hdrcomp.getlen(),&ihd) < 0)
+      if (add_header_data(&hdrcomp,&ihd) < 0)
         return PS_ERROR;
 
       fh.length_of_header=hdrcomp.getlen();
@@ -2707,11 +2849,14 @@ int CEXEBuild::write_output(void)
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
     if (build_compress_whole) {
-      if (deflateToFile(fp,(char*)ihd.get(),ihd.getlen()))
+      // the header and the datablock are compressed together, in blocks
+      file_writer_sink sink(fp);
+      if (compress_whole(ihd.get(),ihd.getlen(),&build_datablock,&sink) != PS_OK)
       {
         fclose(fp);
         return PS_ERROR;
       }
+      build_datablock.clear();
     }
     else
 #endif
@@ -2754,7 +2899,8 @@ int CEXEBuild::write_output(void)
     INFO_MSG(_T(" (%d bytes), "), build_sections.getlen());
   }
   int ne=build_header.blocks[NB_ENTRIES].num;
-  INFO_MSG(_T("%d instruction%s (%d bytes), "),ne,ne==1?_T(""):_T("s"),ne*sizeof(entry));
+  INFO_MSG(_T("%d instruction%s (%d bytes, %d packed), "),ne,ne==1?_T(""):_T("s"),ne*sizeof(entry),
+    build_header.blocks[NB_STRINGS].offset-build_header.blocks[NB_ENTRIES].offset);
   int ns=build_strlist.getnum();
   INFO_MSG(_T("%d string%s (%d bytes), "),ns,ns==1?_T(""):_T("s"),build_strlist.getcount()*(build_unicode ? sizeof(CHAR) : sizeof(TCHAR)));
   int nlt=build_header.blocks[NB_LANGTABLES].num;
@@ -2783,7 +2929,8 @@ int CEXEBuild::write_output(void)
       INFO_MSG(_T(" (%d bytes), "), ubuild_sections.getlen());
     }
     ne=build_uninst.blocks[NB_ENTRIES].num;
-    INFO_MSG(_T("%d instruction%s (%d bytes), "),ne,ne==1?_T(""):_T("s"),ubuild_entries.getlen());
+    INFO_MSG(_T("%d instruction%s (%d bytes, %d packed), "),ne,ne==1?_T(""):_T("s"),ubuild_entries.getlen(),
+      build_uninst.blocks[NB_STRINGS].offset-build_uninst.blocks[NB_ENTRIES].offset);
     ns=ubuild_strlist.getnum();
     INFO_MSG(_T("%d string%s (%d bytes), "),ns,ns==1?_T(""):_T("s"),ubuild_strlist.getcount()*(build_unicode ? sizeof(CHAR) : sizeof(TCHAR)));
     nlt=build_uninst.blocks[NB_LANGTABLES].num;
@@ -2794,7 +2941,7 @@ int CEXEBuild::write_output(void)
   if (db_opt_save)
   {
     __int64 total_out_size_estimate=
-      m_exehead_size+sizeof(fh)+build_datablock.getlen()+(build_crcchk?sizeof(crc32_t):0);
+      m_exehead_size+sizeof(fh)+getcurdbsize()+(build_crcchk?sizeof(crc32_t):0);
     __int64 pc=((INT64)db_opt_save*1000)/(db_opt_save+total_out_size_estimate);
     INFO_MSG(_T("Datablock optimizer saved %I64d bytes (~%I64d.%I64d%%).\n"),db_opt_save,
       pc/10,pc%10);
@@ -2823,7 +2970,7 @@ int CEXEBuild::write_output(void)
 
   {
     __int64 dbsize, dbsizeu;
-    dbsize = build_datablock.getlen();
+    dbsize = getcurdbsize();
     if (uninstall_size>0) dbsize-=uninstall_size;
 
     if (build_compress_whole) {
@@ -2850,132 +2997,87 @@ int CEXEBuild::write_output(void)
     INFO_MSG(_T("Compressed data:          "));
   }
 
-  if (build_datablock.getlen())
+  if (build_data_file_final)
   {
-    FILE* fp2 = fp;
-	crc32_t crc2 = crc;
-	if (build_data_file_final)
-	{
-		static TCHAR build_output_data_filename[1024];
-		_tcscpy(build_output_data_filename,build_output_filename);
-		LPTSTR psz=_tcsrchr(build_output_data_filename,'\\'),psz2;
-		if (psz==NULL) psz=build_output_data_filename;
-		while (psz2=_tcschr(psz+1,'.'))
-		{
-			psz = psz2;
-		}
-		_tcscpy(psz,_T(".1.dat"));
-		fp2 = FOPEN(build_output_data_filename,("w+b"));
-		crc2 = 0;
-		if (fp2) _fseeki64(fp2,sizeof(dataheader),SEEK_SET);// reserve room for total length & crc
-	}
-	if (!fp2) return PS_ERROR;
-
-    build_datablock.setro(TRUE);
-    __int64 dbl = build_datablock.getlen();
-    __int64 left = dbl;
-	__int64 cur_length=0;
-	int cur_index = 1;
-	dataheader dh;
-	dh.total_length = build_datablock.getlen();
-	if (build_file_length)
-		dh.length_per_volume = (__int64)build_file_length * (1<<20) - sizeof(dataheader);
-	else
-		dh.length_per_volume = dh.total_length;
-	dh.total_volume = (dh.total_length+dh.length_per_volume - 1)/dh.length_per_volume;
-	while (left > 0)
+    if (build_datavolumes.is_open())
     {
-      int l = min(build_filebuflen, left);
-	  // check whether need to start a new data file
-	  if (build_data_file_final && build_file_length)
-	  {
-		  if (cur_length >= dh.length_per_volume)
-		  {
-			  // close the current file
-			  total_data_size += _ftelli64(fp2);
-			  _fseeki64(fp2,0,SEEK_SET);
-			  dh.volume_index = cur_index;
-			  dh.length = cur_length;
-			  dh.crc = crc2;
-			  fwrite(&dh,1,sizeof(dh),fp2);
-			  fclose(fp2);
-
-			  // start a new one
-			  static TCHAR build_output_data_filename[1024];
-			  _tcscpy(build_output_data_filename,build_output_filename);
-			  LPTSTR psz=_tcsrchr(build_output_data_filename,'\\'),psz2;
-			  if (psz==NULL) psz=build_output_data_filename;
-			  while (psz2=_tcschr(psz+1,'.'))
-			  {
-				  psz = psz2;
-			  }
-			  wsprintf(psz,_T(".%u.dat"),cur_index+1);
-			  fp2 = FOPEN(build_output_data_filename,("w+b"));
-			  crc2 = 0;
-			  if (fp2) _fseeki64(fp2,sizeof(dataheader),SEEK_SET);
-			  cur_length=0;
-			  cur_index++;
-		  }
-		  l = min(l, (dh.length_per_volume - cur_length)); // limit the file size
-	  }
-	  cur_length += l;
-
-      char *dbptr = (char *) build_datablock.get(dbl - left, l);
-#ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
-      if (build_compress_whole)
+      // SetDataFile stream, most of the datablock is already in the .N.dat
+      // volumes and build_datablock only holds the rest.
+      build_datablock.setro(TRUE);
+      __int64 dbl = build_datablock.getlen();
+      __int64 left = dbl;
+      while (left > 0)
       {
-        if (deflateToFile(fp2,dbptr,l))
+        int l = min(build_filebuflen, left);
+        int err = build_datavolumes.write(build_datablock.get(dbl - left, l), l);
+        build_datablock.release();
+        if (err)
         {
+          ERROR_MSG(_T("Error: can't write %d bytes to data file \"%s\"\n"),l,build_datavolumes.get_current_filename());
           fclose(fp);
-		  if (fp2!=fp) fclose(fp2);
           return PS_ERROR;
         }
+        left -= l;
       }
-      else
-#endif
+      build_datablock.setro(FALSE);
+
+      if (build_datavolumes.close())
+      {
+        ERROR_MSG(_T("Error: can't finalize data files\n"));
+        fclose(fp);
+        return PS_ERROR;
+      }
+    }
+    else
+    {
+      // volumes left by a previous build are only rewritten if their data changed
+      build_datablock.setro(TRUE);
+      int err = build_datavolumes.update(build_output_filename, get_data_volume_length(), &build_datablock, build_datablock.getlen());
+      build_datablock.setro(FALSE);
+      if (err)
+      {
+        ERROR_MSG(_T("Error: can't write data file \"%s\"\n"),build_datavolumes.get_current_filename());
+        fclose(fp);
+        return PS_ERROR;
+      }
+    }
+    build_datablock.clear();
+
+    int nv = build_datavolumes.get_volume_count();
+    total_data_size = build_datavolumes.get_output_size();
+    INFO_MSG(_T("Data files:               %10d volume%s (%I64d bytes), %d rewritten, %d removed\n"),nv,nv==1?_T(""):_T("s"),total_data_size,build_datavolumes.get_rewritten_count(),build_datavolumes.get_removed_count());
+  }
+  else if (build_datablock.getlen())
+  {
+    build_datablock.setro(TRUE);
+    __int64 dbl = build_datablock.getlen();
+    __int64 left = dbl;
+    while (left > 0)
+    {
+      int l = min(build_filebuflen, left);
+      char *dbptr = (char *) build_datablock.get(dbl - left, l);
       {
 #ifdef NSIS_CONFIG_CRC_SUPPORT
-        crc2=CRC32(crc2,(unsigned char *)dbptr,l);
+        crc=CRC32(crc,(unsigned char *)dbptr,l);
 #endif
-        if ((int)fwrite(dbptr,1,l,fp2) != l)
+        if ((int)fwrite(dbptr,1,l,fp) != l)
         {
           ERROR_MSG(_T("Error: can't write %d bytes to output\n"),l);
           fclose(fp);
-		  if (fp2!=fp) fclose(fp2);
-         return PS_ERROR;
+          return PS_ERROR;
         }
-        fflush(fp2);
+        fflush(fp);
       }
       build_datablock.release();
       left -= l;
     }
     build_datablock.setro(FALSE);
     build_datablock.clear();
-
-	if (fp2!=fp)
-	{
-		total_data_size += _ftelli64(fp2);
-		_fseeki64(fp2,0,SEEK_SET);
-		dh.volume_index = cur_index;
-		dh.length = cur_length;
-		dh.crc = crc2;
-		fwrite(&dh,1,sizeof(dh),fp2);
-		fclose(fp2);
-	}
-	else
-		crc= crc2;
   }
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
   if (build_compress_whole)
   {
-    if (deflateToFile(fp,NULL,0))
-    {
-      fclose(fp);
-      return PS_ERROR;
-    }
-    compressor->End();
-
     unsigned __int64 fend = _ftelli64(fp);
 
     fh.length_of_all_following_data=_ftelli64(fp)-fd_start+(build_crcchk?sizeof(crc32_t):0);
@@ -3077,41 +3179,33 @@ int CEXEBuild::write_output(void)
 }
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
-int CEXEBuild::deflateToFile(FILE *fp, char *buf, int len) // len==0 to flush
+int CEXEBuild::compress_whole(const void *data, int len, MMapBuf *db, writer_sink *sink)
 {
   build_compressor_set=true;
 
-  char obuf[65536];
-  bool flush=false;
-  compressor->SetNextIn(buf,len);
-  if (!buf||!len)
+  CBlockCompressor bc(build_compress_level, build_compress_dict_size, build_compress_block_size);
+  int ret;
+
+  db->setro(TRUE);
+  try
   {
-    char a;
-    compressor->SetNextIn(&a,0);
-    flush=C_FINISH;
+    ret = bc.compress(data, len, db, db->getlen(), sink);
   }
-  for (;;)
+  catch (...)
   {
-    compressor->SetNextOut(obuf,sizeof(obuf));
-    int ret=compressor->Compress(flush);
-    if (ret<0 && (ret!=-1 || !flush))
-    {
-      ERROR_MSG(_T("Error: deflateToFile: deflate() failed(%s [%d])\n"), compressor->GetErrStr(ret), ret);
-      return 1;
-    }
-    int l=compressor->GetNextOut()-obuf;
-    if (l)
-    {
-      if (fwrite(obuf,1,l,fp) != (unsigned)l)
-      {
-        ERROR_MSG(_T("Error: deflateToFile fwrite(%d) failed\n"),l);
-        return 1;
-      }
-      fflush(fp);
-    }
-    if (!compressor->GetAvailIn() && (!flush || !l)) break;
+    db->setro(FALSE);
+    ERROR_MSG(_T("Error: can't write compressed data to output\n"));
+    return PS_ERROR;
   }
-  return 0;
+  db->setro(FALSE);
+
+  if (ret != C_OK)
+  {
+    ERROR_MSG(_T("Error: compress whole: compression failed(%s [%d])\n"), compressor->GetErrStr(ret), ret);
+    return PS_ERROR;
+  }
+
+  return PS_OK;
 }
 #endif
 
@@ -3133,7 +3227,7 @@ int CEXEBuild::uninstall_generate()
       PrepareHeaders(&udata);
 
       fh.length_of_header=udata.getlen();
-      int err=add_data((char*)udata.get(),udata.getlen(),&uhd);
+      int err=add_header_data(&udata,&uhd);
       set_uninstall_mode(0);
       if (err < 0) return PS_ERROR;
     }
@@ -3158,7 +3252,7 @@ int CEXEBuild::uninstall_generate()
 
     int ents = build_header.blocks[NB_ENTRIES].num;
     int uns = uninstaller_writes_used;
-    __int64 uninstdata_offset = build_datablock.getlen();
+    __int64 uninstdata_offset = getcurdbsize();
     while (ents--)
     {
       if (ent->which == EW_WRITEUNINSTALLER)
@@ -3217,7 +3311,9 @@ int CEXEBuild::uninstall_generate()
     fh.flags=FH_FLAGS_UNINSTALL;
 #ifdef NSIS_CONFIG_CRC_SUPPORT
     fh.flags|=(build_crcchk?(build_crcchk==2?FH_FLAGS_FORCE_CRC:0):FH_FLAGS_NO_CRC);
+    if (build_crcchk && !build_compress_whole) fh.flags|=FH_FLAGS_BLOB_CRC;
 #endif
+    if (build_compress_whole) fh.flags|=FH_FLAGS_SOLID;
 #ifdef NSIS_CONFIG_SILENT_SUPPORT
     if (build_uninst.flags&(CH_FLAGS_SILENT|CH_FLAGS_SILENT_LOG)) fh.flags |= FH_FLAGS_SILENT;
 #endif
@@ -3238,58 +3334,9 @@ int CEXEBuild::uninstall_generate()
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
     if (build_compress_whole) {
       // compress uninstaller too
-      {
-        char obuf[65536];
-        int n = compressor->Init(build_compress_level, build_compress_dict_size);
-        if (n != C_OK)
-        {
-          ERROR_MSG(_T("Internal compiler error #12345: deflateInit() failed(%s [%d]).\n"), compressor->GetErrStr(n), n);
-          extern void quit(); quit();
-        }
-
-        compressor->SetNextIn((char*)uhd.get(), uhd.getlen());
-        while (compressor->GetAvailIn())
-        {
-          compressor->SetNextOut(obuf, sizeof(obuf));
-          compressor->Compress(0);
-          if (compressor->GetNextOut() - obuf > 0)
-          {
-            udata.add(obuf, compressor->GetNextOut() - obuf);
-          }
-        }
-
-        int avail_in = ubuild_datablock.getlen();
-        int in_pos = 0;
-        while (avail_in > 0) {
-          int l = min(avail_in, build_filebuflen);
-
-          char *p = (char*)ubuild_datablock.get(in_pos, l);
-          compressor->SetNextIn(p, l);
-
-          while (compressor->GetAvailIn())
-          {
-            compressor->SetNextOut(obuf, sizeof(obuf));
-            compressor->Compress(0);
-            if (compressor->GetNextOut() - obuf > 0)
-              udata.add(obuf, compressor->GetNextOut() - obuf);
-          }
-
-          ubuild_datablock.release();
-
-          avail_in -= l;
-          in_pos += l;
-        }
-
-        for (;;)
-        {
-          compressor->SetNextOut(obuf, sizeof(obuf));
-          compressor->Compress(C_FINISH);
-          if (compressor->GetNextOut() - obuf > 0)
-            udata.add(obuf, compressor->GetNextOut() - obuf);
-          else break;
-        }
-        compressor->End();
-      }
+      growbuf_writer_sink sink(&udata, build_unicode);
+      if (compress_whole(uhd.get(), uhd.getlen(), &ubuild_datablock, &sink) != PS_OK)
+        return PS_ERROR;
 
       firstheader *_fh=(firstheader *)udata.get(0, sizeof(firstheader));
       _fh->length_of_all_following_data=FIX_ENDIAN_INT32(udata.getlen()+(build_crcchk?sizeof(crc32_t):0));
@@ -3349,7 +3396,7 @@ int CEXEBuild::uninstall_generate()
     uninstall_size_full=fh.length_of_all_following_data+m_unicon_size;
 
     // compressed size
-    uninstall_size=build_datablock.getlen()-uninstdata_offset;
+    uninstall_size=getcurdbsize()-uninstdata_offset;
 
     SCRIPT_MSG(_T("Done!\n"));
   }
@@ -3378,6 +3425,7 @@ void CEXEBuild::set_uninstall_mode(int un)
       cur_strlist=&ubuild_strlist;
       cur_langtables=&ubuild_langtables;
       cur_ctlcolors=&ubuild_ctlcolors;
+      cur_toc=&ubuild_toc;
 
       definedlist.add(_T("__UNINSTALL__"));
     }
@@ -3395,6 +3443,7 @@ void CEXEBuild::set_uninstall_mode(int un)
       cur_strlist=&build_strlist;
       cur_langtables=&build_langtables;
       cur_ctlcolors=&build_ctlcolors;
+      cur_toc=&build_toc;
 
       definedlist.del(_T("__UNINSTALL__"));
     }
@@ -3428,6 +3477,8 @@ void CEXEBuild::warning(const TCHAR *s, ...)
 #endif
   va_end(val);
 
+  // the cache can't replay the warning
+  include_not_cacheable();
   m_warnings.add(buf,0);
   notify(MAKENSIS_NOTIFY_WARNING,buf);
   if (display_warnings)
@@ -3449,6 +3500,8 @@ void CEXEBuild::warning_fl(const TCHAR *s, ...)
   va_end(val);
   _stprintf(buf+_tcslen(buf),_T(" (%s:%d)"),curfilename,linecnt);
 
+  // the cache can't replay the warning
+  include_not_cacheable();
   m_warnings.add(buf,0);
   notify(MAKENSIS_NOTIFY_WARNING,buf);
   if (display_warnings)
@@ -3767,8 +3820,8 @@ int CEXEBuild::set_target_minimal_OS(int major, int minor)
 
 int CEXEBuild::set_compressor(const tstring& compressor, const bool solid) {
   stub_filename = stubs_dir + PLATFORM_PATH_SEPARATOR_STR + _T("stub")/*compressor*/; // modified by yew
-//   if (solid) // modified by yew
-//     stub_filename += _T("_solid");
+  if (solid)
+    stub_filename += _T("_solid");
   return load_stub();
 }
 
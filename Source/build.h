@@ -27,6 +27,8 @@
 #include "uservars.h"
 #include "ShConstants.h"
 #include "mmap.h"
+#include "datavolume.h"
+#include "blockcomp.h"
 #include "manifest.h"
 #include "icon.h"
 
@@ -110,15 +112,26 @@ class CEXEBuild {
     // process a script (you can process as many scripts as you want,
     // it is as if they are concatenated)
     int process_script(FILE *filepointer, const TCHAR *filename, BOOL unicode);
-    int process_oneline(TCHAR *line, const TCHAR *curfilename, int lineptr);
+    int process_oneline(TCHAR *line, const TCHAR *curfilename, int lineptr, int plain=0); // plain TCHARs of line have nothing to replace
     
     // you only get to call write_output once, so use it wisely.
     int write_output(void);
 
     void print_help(TCHAR *commandname=NULL);
 
+    // where !include keeps what included files define, empty if it doesn't
+    tstring include_cache_dir;
+
     DefineList definedlist; // List of identifiers marked as "defined" like
                             // C++ macro definitions such as _UNICODE.
+#ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
+    // __LINE__ isn't kept in definedlist, find_define() works it out from
+    // the line numbers of the file and the macros inserted in it
+    TinyGrowBuf m_line_predefines; // struct line_predefine
+    GrowBuf m_line_predefine_value;
+#endif
+    // names of the ${defines} and $%envvars% ps_addtoline() is replacing
+    TinyGrowBuf m_ps_names;
 
     int display_errors;
     int display_script;
@@ -164,23 +177,46 @@ class CEXEBuild {
     void restore_file_predefine(TCHAR *);
     TCHAR* set_timestamp_predefine(const TCHAR *);
     void restore_timestamp_predefine(TCHAR *);
-    TCHAR* set_line_predefine(int, BOOL);
-    void restore_line_predefine(TCHAR *);
+    void set_line_predefine(int, BOOL);
+    void restore_line_predefine();
     void set_date_time_predefines();
     void del_date_time_predefines();
 #endif
+    TCHAR *find_define(const TCHAR *name);
     int parseScript();
     int includeScript(TCHAR *f);
+    void find_include_files(const TCHAR *f, std::vector<tstring> &files);
     int MacroExists(const TCHAR *macroname);
     int LoadLicenseFile(TCHAR *file, TCHAR** pdata, LineParser &line, BOOL* unicode);
-#ifdef NSIS_FIX_DEFINES_IN_STRINGS
-    void ps_addtoline(const TCHAR *str, GrowBuf &linedata, StringList &hist, bool bIgnoreDefines = false);
-#else
-    void ps_addtoline(const TCHAR *str, GrowBuf &linedata, StringList &hist);
-#endif
+    void ps_addtoline(const TCHAR *str, GrowBuf &linedata);
+    void ps_addtoline(const TCHAR *in, const TCHAR *end, GrowBuf &linedata, bool bIgnoreDefines);
+    int ps_addvalue(const TCHAR *name, const TCHAR *end, BOOL env, GrowBuf &linedata);
     int doParse(const TCHAR *str);
     int doCommand(int which_token, LineParser &line);
 
+    // the include cache, the file being recorded for it, if any
+    struct include_record *m_include_record;
+    bool include_cache_load(const TCHAR *f, const tstring &cachefile, tstring &guard);
+    void include_cache_save(const tstring &cachefile, int parse_ms, const tstring &guard);
+    void include_record_start();
+    void include_record_define(const TCHAR *name, const TCHAR *value);
+    bool include_record_macro(const TCHAR *name);
+    void include_record_include(const TCHAR *spec, const std::vector<tstring> &files);
+    void include_record_langstring(const TCHAR *name, LANGID lang, const TCHAR *str);
+    void include_not_cacheable();
+
+    // multiple include optimization, the files that are all inside one
+    // !ifndef GUARD ... !endif by full path, with the GUARD that skips them
+    DefineList include_guards;
+    enum include_guard_state { GUARD_NONE, GUARD_FIRST_LINE, GUARD_OPEN, GUARD_CLOSED };
+    struct include_guard
+    {
+      include_guard_state state; // how far the file being included matches
+      int ifblocks;              // num_ifblock() outside the guard
+      tstring name;
+    } m_include_guard;
+    void include_guard_line(int which_token, LineParser &line);
+
     int do_add_file(const TCHAR *lgss, int attrib, int recurse, int *total_files, const TCHAR 
       *name_override=0, int generatecode=1, __int64 *data_handle=0, 
       const std::set<tstring>& excluded=std::set<tstring>(), 
@@ -235,9 +271,13 @@ class CEXEBuild {
     int add_label(const TCHAR *name);
     int add_entry(const entry *ent);
     int add_entry_direct(int which, int o0=0, int o1=0, int o2=0, int o3=0, int o4=0, int o5=0);
-    __int64 add_db_data(IMMap *map); // returns offset
+    __int64 add_db_data(IMMap *map, toc_entry *toc = NULL); // returns offset, fills in all of toc but offset and names
     __int64 add_db_data(const char *data, __int64 length); // returns offset
-    int add_data(const char *data, int length, IGrowBuf *dblock); // returns offset
+    int open_data_volumes();
+    __int64 get_data_volume_length();
+    bool is_datablock_streamed() const;
+    int add_data(const char *data, int length, IGrowBuf *dblock, int lc=3, int lp=0, int pb=2); // returns offset, lc, lp and pb tune lzma
+    int add_header_data(IGrowBuf *hdr, IGrowBuf *dblock); // adds the HEADER_PARTS blobs, returns offset
     int add_string(const TCHAR *string, int process=1, WORD codepage=CP_ACP); // returns offset (in string table)
     int add_intstring(const int i); // returns offset in stringblock
 
@@ -384,6 +424,12 @@ class CEXEBuild {
 
     ConstantsStringList m_ShellConstants;
 
+    // the names of m_ShellConstants and m_UserVarNames for preprocess_string(),
+    // value index*2+1 for a constant, index*2 for a variable
+    NameTrie m_VarAndConstNames;
+    int m_iVarAndConstNamesVars;
+    int m_iVarAndConstNamesConsts;
+
     // a whole bunch O data.
 
     tstring stubs_dir;
@@ -401,8 +447,10 @@ class CEXEBuild {
     int build_compress;
     int build_compress_level;
     int build_compress_dict_size;
-	int build_data_file;
+    int build_compress_block_size; // compress whole block size
+	int build_data_file; // 0=off, 1=auto, 2=force, 3=stream
 	int build_file_length;
+    bool build_write_toc; // SetTOC, list the files added in cur_toc
 
     bool no_space_texts;
     LONG target_minimal_OS;
@@ -442,7 +490,7 @@ class CEXEBuild {
     int sectiongroup_open_cnt;
     FastStringList m_warnings;
     const TCHAR* m_currentmacroname;
-    GrowBuf m_macros;
+    MacroList m_macros;
 
     StringList m_macro_entry;
 
@@ -471,11 +519,15 @@ class CEXEBuild {
     GrowBuf build_langtables, ubuild_langtables, *cur_langtables;
     TinyGrowBuf build_pages, ubuild_pages, *cur_pages;
     TinyGrowBuf build_ctlcolors, ubuild_ctlcolors, *cur_ctlcolors;
+    GrowBuf build_toc, ubuild_toc, *cur_toc;
 
     // don't forget to update the cache after updating the datablock
     // see datablock_optimize for an example
     MMapBuf build_datablock, ubuild_datablock;
     TinyGrowBuf build_datablock_cache, ubuild_datablock_cache;
+    // with SetDataFile stream, build_datablock only holds the data being
+    // added and everything before it already went into the data volumes
+    CDataVolumeWriter build_datavolumes;
     IGrowBuf *cur_datablock, *cur_datablock_cache;
     struct cached_db_size
     {
@@ -504,7 +556,7 @@ class CEXEBuild {
 #endif
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
-    int deflateToFile(FILE *fp, char *buf, int len); // len==0 to flush
+    int compress_whole(const void *data, int len, MMapBuf *db, writer_sink *sink);
 #endif
 
     manifest::comctl manifest_comctl;
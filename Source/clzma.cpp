@@ -176,6 +176,11 @@ CLZMA::~CLZMA()
 }
 
 int CLZMA::Init(int level, unsigned int dicSize)
+{
+  return Init(level, dicSize, 3, 0, 2);
+}
+
+int CLZMA::Init(int level, unsigned int dicSize, int lc, int lp, int pb)
 {
   End();
 
@@ -197,7 +202,10 @@ int CLZMA::Init(int level, unsigned int dicSize)
   {
     NCoderPropID::kAlgorithm,
     NCoderPropID::kDictionarySize,
-    NCoderPropID::kNumFastBytes
+    NCoderPropID::kNumFastBytes,
+    NCoderPropID::kLitContextBits,
+    NCoderPropID::kLitPosBits,
+    NCoderPropID::kPosStateBits
   };
   const int kNumProps = COUNTOF(propdIDs);
   PROPVARIANT props[kNumProps];
@@ -210,6 +218,15 @@ int CLZMA::Init(int level, unsigned int dicSize)
   // NCoderPropID::kNumFastBytes
   props[2].vt = VT_UI4;
   props[2].ulVal = 64;
+  // NCoderPropID::kLitContextBits
+  props[3].vt = VT_UI4;
+  props[3].ulVal = lc;
+  // NCoderPropID::kLitPosBits
+  props[4].vt = VT_UI4;
+  props[4].ulVal = lp;
+  // NCoderPropID::kPosStateBits
+  props[5].vt = VT_UI4;
+  props[5].ulVal = pb;
   if (_encoder->SetCoderProperties(propdIDs, props, kNumProps) != 0)
     return LZMA_INIT_ERROR;
   return _encoder->SetStreams(this, this, 0, 0) == S_OK ? C_OK : LZMA_INIT_ERROR;
@@ -83,6 +83,9 @@ public:
   virtual ~CLZMA();
 
   virtual int Init(int level, unsigned int dicSize);
+  // lc, lp and pb are the literal context, literal position and position
+  // state bits, Init(level, dicSize) uses 3, 0 and 2
+  int Init(int level, unsigned int dicSize, int lc, int lp, int pb);
   virtual int End();
   virtual int Compress(bool flush);
 
@@ -0,0 +1,379 @@
+/*
+ * datavolume.cpp
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include "Platform.h"
+#include "datavolume.h"
+#include "util.h"
+#include "tchar.h"
+#include <string.h>
+
+using namespace std;
+
+// 64 bit FNV-1a, stored in dataheader.hash
+#define DATAVOLUME_HASH_INIT ((unsigned __int64) 0xcbf29ce484222325)
+
+static unsigned __int64 datavolume_hash(unsigned __int64 hash, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  while (len--)
+  {
+    hash ^= *p++;
+    hash *= (unsigned __int64) 0x100000001b3;
+  }
+  return hash;
+}
+
+tstring get_data_volume_filename(const TCHAR *output_filename, int index)
+{
+  TCHAR buf[1024];
+  _tcsnccpy(buf, output_filename, 1024-16);
+  buf[1024-16] = 0;
+
+  // must match the lookup in Source/exehead/fileform.c
+  TCHAR *psz = _tcsrchr(buf, _T('\\')), *psz2;
+  if (psz == NULL) psz = buf;
+  while ((psz2 = _tcschr(psz + 1, _T('.'))) != NULL)
+  {
+    psz = psz2;
+  }
+  wsprintf(psz, _T(".%u.dat"), index);
+  return buf;
+}
+
+CDataVolumeWriter::CDataVolumeWriter()
+{
+  m_length_per_volume = 0;
+  m_total_length = 0;
+  m_fp = NULL;
+  m_rewritten = 0;
+  m_removed = 0;
+}
+
+CDataVolumeWriter::~CDataVolumeWriter()
+{
+  if (m_fp)
+    fclose(m_fp);
+}
+
+int CDataVolumeWriter::open(const TCHAR *output_filename, __int64 length_per_volume)
+{
+  if (m_fp)
+    return 1;
+
+  m_output_filename = output_filename;
+  m_length_per_volume = length_per_volume;
+  m_total_length = 0;
+  m_volumes.clear();
+  m_rewritten = 0;
+  m_removed = 0;
+
+  return open_volume();
+}
+
+int CDataVolumeWriter::open_volume()
+{
+  dataheader dh;
+  memset(&dh, 0, sizeof(dh));
+  dh.volume_index = (int) m_volumes.size() + 1;
+  dh.hash = DATAVOLUME_HASH_INIT;
+
+  m_cur_filename = get_data_volume_filename(m_output_filename.c_str(), dh.volume_index);
+  m_fp = FOPEN(m_cur_filename.c_str(), ("w+b"));
+  if (!m_fp)
+    return 1;
+
+  m_volumes.push_back(dh);
+  m_rewritten++;
+
+  // reserve room for the dataheader, close() writes the real one
+  if (fwrite(&dh, 1, sizeof(dh), m_fp) != sizeof(dh))
+    return 1;
+
+  return 0;
+}
+
+int CDataVolumeWriter::finish_volume()
+{
+  // the header is finalized by close(), once the totals are known
+  int ret = fclose(m_fp) ? 1 : 0;
+  m_fp = NULL;
+  return ret;
+}
+
+int CDataVolumeWriter::write(const void *data, __int64 len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+
+  if (!m_fp)
+    return 1;
+
+  while (len > 0)
+  {
+    dataheader *dh = &m_volumes.back();
+    __int64 l = min(len, (__int64) (1 << 30));
+
+    if (m_length_per_volume)
+    {
+      if (dh->length >= m_length_per_volume)
+      {
+        if (finish_volume() || open_volume())
+          return 1;
+        continue;
+      }
+      l = min(l, m_length_per_volume - dh->length);
+    }
+
+    if (fwrite(p, 1, (size_t) l, m_fp) != (size_t) l)
+      return 1;
+
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+    dh->crc = CRC32(dh->crc, p, (unsigned int) l);
+#endif
+    dh->hash = datavolume_hash(dh->hash, p, (size_t) l);
+
+    dh->length += l;
+    m_total_length += l;
+    p += l;
+    len -= l;
+  }
+
+  return 0;
+}
+
+int CDataVolumeWriter::compare(__int64 offset, const void *data, int len)
+{
+  const char *p = (const char *) data;
+  char buf[32768];
+
+  while (len > 0)
+  {
+    size_t index = m_length_per_volume ? (size_t) (offset / m_length_per_volume) : 0;
+    if (index >= m_volumes.size())
+      return 1;
+
+    __int64 local = offset - (__int64) index * m_length_per_volume;
+    if (local >= m_volumes[index].length)
+      return 1;
+
+    int vl = (int) min((__int64) len, m_volumes[index].length - local);
+
+    FILE *fp = m_fp;
+    if (index + 1 != m_volumes.size())
+    {
+      tstring fn = get_data_volume_filename(m_output_filename.c_str(), (int) index + 1);
+      fp = FOPEN(fn.c_str(), ("rb"));
+    }
+    if (!fp)
+      return 1;
+
+    int res = _fseeki64(fp, sizeof(dataheader) + local, SEEK_SET) ? 1 : 0;
+    for (int left = vl; !res && left > 0; )
+    {
+      int l = min(left, (int) sizeof(buf));
+      if (fread(buf, 1, l, fp) != (size_t) l || memcmp(buf, p, l))
+        res = 1;
+      p += l;
+      left -= l;
+    }
+
+    if (fp == m_fp)
+    {
+      // back to the end for the next write()
+      if (_fseeki64(fp, 0, SEEK_END))
+        res = 1;
+    }
+    else
+      fclose(fp);
+
+    if (res)
+      return 1;
+
+    offset += vl;
+    len -= vl;
+  }
+
+  return 0;
+}
+
+int CDataVolumeWriter::close()
+{
+  if (!m_fp)
+    return 1;
+
+  int ret = 0;
+  size_t num = m_volumes.size();
+  __int64 length_per_volume = m_length_per_volume ? m_length_per_volume : m_total_length;
+
+  for (size_t i = 0; i < num; i++)
+  {
+    dataheader *dh = &m_volumes[i];
+    dh->total_length = m_total_length;
+    dh->length_per_volume = length_per_volume;
+    dh->total_volume = (int) num;
+
+    FILE *fp = m_fp;
+    if (i + 1 != num)
+    {
+      tstring fn = get_data_volume_filename(m_output_filename.c_str(), (int) i + 1);
+      fp = FOPEN(fn.c_str(), ("r+b"));
+    }
+    if (!fp)
+    {
+      ret = 1;
+      continue;
+    }
+
+    if (_fseeki64(fp, 0, SEEK_SET) || fwrite(dh, 1, sizeof(dataheader), fp) != sizeof(dataheader))
+      ret = 1;
+
+    if (fp != m_fp)
+      fclose(fp);
+  }
+
+  if (fclose(m_fp))
+    ret = 1;
+  m_fp = NULL;
+
+  if (remove_stale_volumes())
+    ret = 1;
+
+  return ret;
+}
+
+int CDataVolumeWriter::remove_stale_volumes()
+{
+  // a previous build may have had more volumes, they follow the last one
+  for (int index = (int) m_volumes.size() + 1; ; index++)
+  {
+    m_cur_filename = get_data_volume_filename(m_output_filename.c_str(), index);
+    FILE *fp = FOPEN(m_cur_filename.c_str(), ("rb"));
+    if (!fp)
+      return 0;
+    fclose(fp);
+
+    if (_tremove(m_cur_filename.c_str()))
+      return 1;
+    m_removed++;
+  }
+}
+
+__int64 CDataVolumeWriter::get_output_size() const
+{
+  __int64 size = 0;
+  for (size_t i = 0; i < m_volumes.size(); i++)
+  {
+    size += m_volumes[i].length + sizeof(dataheader);
+  }
+  return size;
+}
+
+int CDataVolumeWriter::update(const TCHAR *output_filename, __int64 length_per_volume, IMMap *data, __int64 len)
+{
+  if (m_fp)
+    return 1;
+
+  m_output_filename = output_filename;
+  m_length_per_volume = length_per_volume;
+  m_total_length = len;
+  m_volumes.clear();
+  m_rewritten = 0;
+  m_removed = 0;
+
+  __int64 lpv = length_per_volume ? length_per_volume : len;
+  int num = lpv ? (int) ((len + lpv - 1) / lpv) : 1;
+
+  for (int i = 0; i < num; i++)
+  {
+    dataheader dh;
+    memset(&dh, 0, sizeof(dh));
+    dh.total_length = len;
+    dh.length_per_volume = lpv;
+    dh.total_volume = num;
+    dh.volume_index = i + 1;
+    dh.hash = DATAVOLUME_HASH_INIT;
+
+    __int64 offset = (__int64) i * lpv;
+    dh.length = min(lpv, len - offset);
+
+    for (__int64 pos = 0; pos < dh.length; )
+    {
+      int l = (int) min(dh.length - pos, (__int64) (1 << 20));
+      const unsigned char *p = (const unsigned char *) data->get(offset + pos, l);
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+      dh.crc = CRC32(dh.crc, p, l);
+#endif
+      dh.hash = datavolume_hash(dh.hash, p, l);
+      data->release();
+      pos += l;
+    }
+
+    m_volumes.push_back(dh);
+
+    if (update_volume(&dh, data, offset))
+      return 1;
+  }
+
+  return remove_stale_volumes();
+}
+
+int CDataVolumeWriter::update_volume(const dataheader *dh, IMMap *data, __int64 offset)
+{
+  m_cur_filename = get_data_volume_filename(m_output_filename.c_str(), dh->volume_index);
+
+  FILE *fp = FOPEN(m_cur_filename.c_str(), ("r+b"));
+  if (fp)
+  {
+    dataheader old;
+    if (fread(&old, 1, sizeof(old), fp) == sizeof(old)
+      && !_fseeki64(fp, 0, SEEK_END) && _ftelli64(fp) == (__int64) sizeof(old) + dh->length
+      && old.volume_index == dh->volume_index && old.length == dh->length
+      && old.crc == dh->crc && old.hash == dh->hash)
+    {
+      // same data, only the totals in the header can differ
+      int ret = 0;
+      if (memcmp(&old, dh, sizeof(old)))
+      {
+        if (_fseeki64(fp, 0, SEEK_SET) || fwrite(dh, 1, sizeof(dataheader), fp) != sizeof(dataheader))
+          ret = 1;
+      }
+      if (fclose(fp))
+        ret = 1;
+      return ret;
+    }
+    fclose(fp);
+  }
+
+  m_rewritten++;
+
+  fp = FOPEN(m_cur_filename.c_str(), ("wb"));
+  if (!fp)
+    return 1;
+
+  int ret = fwrite(dh, 1, sizeof(dataheader), fp) != sizeof(dataheader) ? 1 : 0;
+  for (__int64 pos = 0; !ret && pos < dh->length; )
+  {
+    int l = (int) min(dh->length - pos, (__int64) (1 << 20));
+    if (fwrite(data->get(offset + pos, l), 1, l, fp) != (size_t) l)
+      ret = 1;
+    data->release();
+    pos += l;
+  }
+
+  if (fclose(fp))
+    ret = 1;
+
+  return ret;
+}
@@ -0,0 +1,136 @@
+/*
+ * datavolume.h
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef ___DATAVOLUME__H___
+#define ___DATAVOLUME__H___
+
+#include "Platform.h"
+#include "exehead/fileform.h"
+#include "crc32.h"
+#include "mmap.h"
+#include "tstring.h"
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Returns the name of the data volume with the (one based) index for the
+ * installer output_filename. The last extension of the installer is
+ * replaced with ".index.dat", the same way the exehead looks for it.
+ */
+tstring get_data_volume_filename(const TCHAR *output_filename, int index);
+
+/**
+ * Writes the datablock of an installer into its .N.dat data volumes.
+ *
+ * Data is appended as it becomes available and a new volume is started
+ * whenever the current one is full. Each volume starts with a dataheader
+ * whose totals can only be known once all of the data was written, so
+ * close() goes back and finalizes the headers of all volumes.
+ */
+class CDataVolumeWriter
+{
+  private: // don't copy instances
+    CDataVolumeWriter(const CDataVolumeWriter&);
+    void operator=(const CDataVolumeWriter&);
+
+  public:
+    CDataVolumeWriter();
+    ~CDataVolumeWriter();
+
+    /**
+     * Creates the first data volume.
+     *
+     * @param output_filename The installer file name volumes are named after.
+     * @param length_per_volume Maximum amount of data per volume, not
+     * counting the dataheader. 0 means a single volume without limit.
+     * @return 0 on success.
+     */
+    int open(const TCHAR *output_filename, __int64 length_per_volume);
+
+    /**
+     * Appends data to the volumes, starting new volumes as needed.
+     * @return 0 on success.
+     */
+    int write(const void *data, __int64 len);
+
+    /**
+     * Compares data already written at offset with the memory at data.
+     * Used by the datablock optimizer when the datablock is streamed.
+     * @return 0 if the data is identical, non-zero if it differs or can't
+     * be read back.
+     */
+    int compare(__int64 offset, const void *data, int len);
+
+    /**
+     * Writes a complete datablock to the volumes at once. Volumes that
+     * already exist with the same data, as told by the length and hashes in
+     * their dataheader, are not rewritten. At most their header is updated.
+     * Volumes after the last one, left by a previous build, are deleted.
+     *
+     * @param output_filename The installer file name volumes are named after.
+     * @param length_per_volume Same as for open().
+     * @param data The datablock.
+     * @param len Length of the datablock.
+     * @return 0 on success.
+     */
+    int update(const TCHAR *output_filename, __int64 length_per_volume, IMMap *data, __int64 len);
+
+    /**
+     * Finalizes the dataheader of every volume and closes the last one.
+     * Volumes after the last one, left by a previous build, are deleted.
+     * @return 0 on success.
+     */
+    int close();
+
+    bool is_open() const { return m_fp != NULL; }
+
+    /** Amount of data written so far, not counting dataheaders. */
+    __int64 getlen() const { return m_total_length; }
+
+    /** Size of all of the volumes on disk, including dataheaders. */
+    __int64 get_output_size() const;
+
+    int get_volume_count() const { return (int) m_volumes.size(); }
+
+    /** Number of volumes whose data was (re)written. */
+    int get_rewritten_count() const { return m_rewritten; }
+
+    /** Number of volumes left by a previous build that were deleted. */
+    int get_removed_count() const { return m_removed; }
+
+    /** Name of the volume being written, for error messages. */
+    const TCHAR *get_current_filename() const { return m_cur_filename.c_str(); }
+
+  private:
+    int open_volume();
+    int finish_volume();
+    int update_volume(const dataheader *dh, IMMap *data, __int64 offset);
+    int remove_stale_volumes();
+
+    tstring m_output_filename;
+    tstring m_cur_filename;
+    __int64 m_length_per_volume;
+    __int64 m_total_length;
+    int m_rewritten;
+    int m_removed;
+
+    FILE *m_fp;
+
+    // one dataheader per volume, the last one is the volume being written
+    std::vector<dataheader> m_volumes;
+};
+
+#endif//!___DATAVOLUME__H___
@@ -346,6 +346,10 @@ end:
 
 void NSISCALL CleanUp()
 {
+#ifdef NSIS_SUPPORT_FILE
+  EndPrefetch();
+#endif
+  CloseVolumes();
   if (g_db_hFile != INVALID_HANDLE_VALUE)
   {
     CloseHandle(g_db_hFile);
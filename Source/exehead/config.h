@@ -126,6 +126,21 @@
   #define NSIS_COMPRESS_BZIP2_LEVEL 9
 #endif
 
+// the largest read and write buffers the exehead decompresses with. they're
+// only allocated as large as the installer data needs, a stub variant can
+// make them smaller still, at the cost of more and smaller reads and writes.
+#ifndef NSIS_IBUFSIZE
+  #define NSIS_IBUFSIZE (16384*32)
+#endif
+
+#ifndef NSIS_OBUFSIZE
+  #define NSIS_OBUFSIZE (32768*32)
+#endif
+
+#if NSIS_IBUFSIZE < 4096 || NSIS_OBUFSIZE < 4096
+  #error NSIS_IBUFSIZE and NSIS_OBUFSIZE must be at least 4096
+#endif
+
 #ifdef NSIS_CONFIG_PLUGIN_SUPPORT
   #ifndef NSIS_SUPPORT_RMDIR
     #error NSIS_CONFIG_PLUGIN_SUPPORT relies on NSIS_SUPPORT_RMDIR, but NSIS_SUPPORT_RMDIR is not defined
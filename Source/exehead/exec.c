@@ -527,7 +527,7 @@ static int NSISCALL ExecuteEntry(entry *entry_)
         update_status_text(LANG_EXTRACT,buf3);
         {
           g_exec_flags.status_update++;
-          ret=GetCompressedDataFromDataBlock(MAKEQWORD(parm2,parm6),hOut);
+          ret=ExtractFileEntry((int)(entry_-g_entries),hOut);
           g_exec_flags.status_update--;
         }
 
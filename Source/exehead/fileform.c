@@ -25,6 +25,7 @@
 #include "ui.h"
 #include "exec.h"
 #include "../crc32.h"
+#include "../pipeline.h"
 #include "../tchar.h"
 #include <assert.h>
 
@@ -67,26 +68,94 @@ HANDLE g_db_hFile=INVALID_HANDLE_VALUE;
 #if defined(NSIS_CONFIG_COMPRESSION_SUPPORT) && defined(NSIS_COMPRESS_WHOLE)
 HANDLE dbd_hFile=INVALID_HANDLE_VALUE;
 static __int64 dbd_size, dbd_pos, dbd_srcpos, dbd_fulllen;
+static solidheader dbd_sh;
+static solidblock *dbd_blocks; // seek table, num_blocks+1 entries
+static __int64 *dbd_cache; // offset of each block in dbd_hFile, -1 until decoded
+static int dbd_num_threads;
+#define DBD_MAX_THREADS 4 // blocks decoded at once, each needs about 3 times block_size of memory
 #endif//NSIS_COMPRESS_WHOLE
 
 static __int64 m_length;
 static __int64 m_pos;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+static int m_blob_crc; // the crc of every blob is checked by _dodecomp()
+#endif
 
-// need a slist to maintain the file offset mapping
-struct  FileMapping
-{
-	struct FileMapping* next;
-	dataheader dh;
-};
+// maintains the file offset mapping. volume i holds the datablock from
+// i*length_per_volume on, so the volume of an offset is a division away.
 struct FileMappingHeader 
 {
-	struct FileMapping* first;
-	struct FileMapping* cur;
+	dataheader* volumes; // total_volume entries
+	int num;
+	int cur; // the volume g_db_hFile reads from
 	BOOL LoadFinished;
 	__int64 cur_offset;
 };
 static struct FileMappingHeader m_file_mapping;
 NSIS_STRING m_data_file_path;
+static LPTSTR m_data_file_ext; // where .N.dat goes in m_data_file_path
+
+// the last few volumes used are kept open, files spread over several
+// volumes don't reopen them on every seek
+#define VOLUME_HANDLES 4
+static struct
+{
+	HANDLE h; // NULL if unused
+	int volume;
+	DWORD used;
+} m_volume_handles[VOLUME_HANDLES];
+static DWORD m_volume_clock;
+
+// makes volume the current one, opening it in place of the least recently
+// used handle unless it is still open
+static BOOL NSISCALL open_volume(int volume)
+{
+	int i, slot = 0;
+	for (i = 0; i < VOLUME_HANDLES; i++)
+	{
+		if (m_volume_handles[i].h && m_volume_handles[i].volume == volume)
+		{
+			slot = i;
+			break;
+		}
+		if (m_volume_handles[i].used < m_volume_handles[slot].used)
+			slot = i;
+	}
+	if (i == VOLUME_HANDLES)
+	{
+		if (m_volume_handles[slot].h)
+			CloseHandle(m_volume_handles[slot].h);
+		wsprintf(m_data_file_ext,_T(".%u.dat"),volume+1);
+		m_volume_handles[slot].h = myOpenFile(m_data_file_path, GENERIC_READ, OPEN_EXISTING);
+		if (m_volume_handles[slot].h == INVALID_HANDLE_VALUE)
+		{
+			m_volume_handles[slot].h = NULL;
+			m_volume_handles[slot].used = 0;
+			g_db_hFile = INVALID_HANDLE_VALUE;
+			return FALSE;
+		}
+		m_volume_handles[slot].volume = volume;
+	}
+	m_volume_handles[slot].used = ++m_volume_clock;
+	g_db_hFile = m_volume_handles[slot].h;
+	m_file_mapping.cur = volume;
+	return TRUE;
+}
+
+void NSISCALL CloseVolumes()
+{
+	int i;
+	for (i = 0; i < VOLUME_HANDLES; i++)
+	{
+		if (m_volume_handles[i].h)
+		{
+			if (m_volume_handles[i].h == g_db_hFile)
+				g_db_hFile = INVALID_HANDLE_VALUE;
+			CloseHandle(m_volume_handles[i].h);
+			m_volume_handles[i].h = NULL;
+		}
+	}
+}
 
 
 #define _calc_percent() (min(m_pos,m_length)*100/m_length)
@@ -177,6 +246,330 @@ void handle_ver_dlg(BOOL kill)
 static z_stream g_inflate_stream;
 #endif
 
+#if defined(NSIS_CONFIG_CRC_SUPPORT) && !defined(NSIS_COMPRESS_WHOLE)
+
+#define VERIFY_THREADS 4 // data files verified at once
+#define VERIFY_BUFSIZE (32768*8)
+
+// a thread checking the crc of data files first, first+step, ... each with
+// its own handle, so they can be read at the same time
+struct verify_job
+{
+  int first;
+  int step;
+  char *buf;
+  volatile LONG done; // VERIFY_BUFSIZE parts read so far
+  int err;
+  NSIS_STRING path;
+};
+static struct verify_job verify_jobs[VERIFY_THREADS];
+
+static DWORD WINAPI verify_thread(LPVOID lpParameter)
+{
+  struct verify_job *job = (struct verify_job *)lpParameter;
+  int v;
+
+  for (v = job->first; v < m_file_mapping.num && !job->err; v += job->step)
+  {
+    dataheader *dh = &m_file_mapping.volumes[v];
+    __int64 left = dh->length;
+    crc32_t crc = 0;
+    HANDLE hFile;
+
+    mystrcpy(job->path, m_data_file_path);
+    wsprintf(job->path + (m_data_file_ext - m_data_file_path), _T(".%u.dat"), v + 1);
+    hFile = myOpenFile(job->path, GENERIC_READ, OPEN_EXISTING);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+      job->err++;
+      break;
+    }
+
+    SetFilePointer(hFile, sizeof(dataheader), NULL, FILE_BEGIN);
+    while (left > 0)
+    {
+      DWORD l = (DWORD)min(left, VERIFY_BUFSIZE);
+      DWORD r;
+      if (!ReadFile(hFile, job->buf, l, &r, NULL) || r != l)
+      {
+        job->err++;
+        break;
+      }
+      crc = CRC32(crc, (unsigned char*)job->buf, l);
+      left -= l;
+      job->done++;
+    }
+
+    CloseHandle(hFile);
+    if (crc != dh->crc)
+      job->err++;
+  }
+  return 0;
+}
+
+// checks the crc of every data file, up to VERIFY_THREADS at once. the crc
+// tables must already be built, CRC32() builds them on its first call.
+static BOOL NSISCALL verify_volumes(int cl_flags)
+{
+  HANDLE threads[VERIFY_THREADS];
+  int num_threads = 0;
+  int n = min(VERIFY_THREADS, m_file_mapping.num);
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    struct verify_job *job = &verify_jobs[i];
+    job->first = i;
+    job->step = n;
+    job->done = 0;
+    job->err = 0;
+    if (!job->buf)
+      job->buf = (char *)GlobalAlloc(GPTR, VERIFY_BUFSIZE);
+    if (!job->buf)
+      return FALSE;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    DWORD tid;
+    // even a single thread leaves this one free for the verify dialog
+    HANDLE hThread = CreateThread(NULL, 0, verify_thread, &verify_jobs[i], 0, &tid);
+    if (hThread)
+      threads[num_threads++] = hThread;
+    else
+      verify_thread(&verify_jobs[i]);
+  }
+
+  if (num_threads)
+  {
+#ifdef NSIS_CONFIG_VISIBLE_SUPPORT
+    while (WaitForMultipleObjects(num_threads, threads, TRUE, 100) == WAIT_TIMEOUT)
+    {
+      // the progress of all threads together
+      m_pos = 0;
+      for (i = 0; i < n; i++)
+        m_pos += (__int64)verify_jobs[i].done * VERIFY_BUFSIZE;
+
+#ifdef NSIS_CONFIG_SILENT_SUPPORT
+      if ((cl_flags & FH_FLAGS_SILENT) == 0)
+#endif//NSIS_CONFIG_SILENT_SUPPORT
+        handle_ver_dlg(FALSE);
+    }
+#else
+    WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+#endif
+    while (num_threads--)
+      CloseHandle(threads[num_threads]);
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if (verify_jobs[i].err)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+#endif//NSIS_CONFIG_CRC_SUPPORT && !NSIS_COMPRESS_WHOLE
+
+#define IBUFSIZE NSIS_IBUFSIZE
+#define OBUFSIZE NSIS_OBUFSIZE
+
+// the read and write buffers of _dodecomp(), also used to check the crc in
+// loadHeaders(), which never run at the same time. they are allocated when
+// first needed and only as large as the data they are used for, up to
+// IBUFSIZE+OBUFSIZE in the same proportion, so small installers and
+// uninstallers don't carry megabytes of buffers.
+static char *iobuf;
+static DWORD iobuf_size, ibufsize, obufsize;
+static __int64 iobuf_need; // the installer data, set by loadHeaders()
+
+// returns NULL if there's no memory for the smallest buffers
+static char * NSISCALL get_iobuf(__int64 need)
+{
+  DWORD size = (DWORD)min(max(need, 16384), (__int64)(IBUFSIZE+OBUFSIZE));
+  if (size > iobuf_size)
+  {
+    char *p = (char *)GlobalAlloc(GPTR, size);
+    if (!p)
+      return iobuf;
+    if (iobuf) GlobalFree(iobuf);
+    iobuf = p;
+    iobuf_size = size;
+    ibufsize = (DWORD)((__int64)size * IBUFSIZE / (IBUFSIZE+OBUFSIZE));
+    obufsize = size - ibufsize;
+  }
+  return iobuf;
+}
+
+// the entries are stored packed, see entry_writer::write() in fileform.cpp.
+// entries must be zeroed.
+static unsigned int NSISCALL read_varint(const unsigned char **p)
+{
+  const unsigned char *q = *p;
+  unsigned int v = 0;
+  int shift = 0;
+  do
+  {
+    v |= (unsigned int)(*q & 0x7f) << shift;
+    shift += 7;
+  } while (*q++ & 0x80);
+  *p = q;
+  return v;
+}
+
+static void NSISCALL unpack_entries(const unsigned char *p, entry *entries, int num)
+{
+  int last[ENTRY_PACK_WHICH]; // 1 + index of the last entry of each which
+  entry *e;
+  int i;
+
+  for (i = 0; i < ENTRY_PACK_WHICH; i++)
+    last[i] = 0;
+
+  for (e = entries; num--; e++)
+  {
+    int mask;
+    e->which = read_varint(&p);
+    if ((unsigned int)e->which < ENTRY_PACK_WHICH)
+    {
+      if (last[e->which])
+        mini_memcpy(e->offsets, entries[last[e->which] - 1].offsets, sizeof(e->offsets));
+      last[e->which] = (int)(e - entries) + 1;
+    }
+    mask = *p++;
+    for (i = 0; i < MAX_ENTRY_OFFSETS; i++)
+    {
+      if (mask & (1 << i))
+      {
+        unsigned int v = read_varint(&p);
+        e->offsets[i] += (int)(v >> 1) ^ -(int)(v & 1);
+      }
+    }
+  }
+}
+
+#if defined(NSIS_CONFIG_COMPRESSION_SUPPORT) && defined(NSIS_COMPRESS_USE_LZMA) && !defined(NSIS_COMPRESS_WHOLE)
+// the compressed parts of the header are decoded on threads, while the
+// parts that follow them are read
+struct header_part
+{
+  char *in; // the stored data, NULL if the part isn't compressed
+  int err;
+  HANDLE hThread;
+  z_stream s;
+};
+
+static DWORD WINAPI header_part_thread(LPVOID lpParameter)
+{
+  struct header_part *part = (struct header_part *)lpParameter;
+  // a part is only good if it fills its space exactly
+  part->err = lzmaDecodeMem(&part->s) < 0 || part->s.avail_out;
+  return 0;
+}
+#endif
+
+// reads the header parts after the first one, which holds the header, into
+// data. returns nonzero on success.
+static int NSISCALL load_header_parts(char *data, int length)
+{
+  header *hdr = (header *)data;
+  int ends[HEADER_PARTS];
+  int i, ok = 1;
+
+  ends[0] = hdr->blocks[NB_ENTRIES].offset;
+  ends[1] = hdr->blocks[NB_STRINGS].offset;
+  ends[2] = hdr->blocks[NB_LANGTABLES].offset;
+  ends[3] = length;
+  if (ends[0] < (int)sizeof(header))
+    return 0;
+  for (i = 1; i < HEADER_PARTS; i++)
+  {
+    if (ends[i] < ends[i-1] || ends[i] > length)
+      return 0;
+  }
+
+#if defined(NSIS_CONFIG_COMPRESSION_SUPPORT) && defined(NSIS_COMPRESS_USE_LZMA) && !defined(NSIS_COMPRESS_WHOLE)
+  {
+    struct header_part parts[HEADER_PARTS] = {0,};
+
+    for (i = 1; i < HEADER_PARTS && ok; i++)
+    {
+      struct header_part *part = &parts[i];
+      char *out = data + ends[i-1];
+      DWORD out_len = ends[i] - ends[i-1];
+      __int64 input_len;
+      crc32_t input_crc;
+      DWORD l, tid;
+
+      if (!ReadSelfFile((LPVOID)&input_len,sizeof(__int64)) ||
+          !ReadSelfFile((LPVOID)&input_crc,sizeof(crc32_t)))
+      {
+        ok = 0;
+        break;
+      }
+      l = (DWORD)(input_len & ~COMPRESSED_FLAG_MARK);
+
+      if (!(input_len & COMPRESSED_FLAG_MARK))
+      {
+        ok = l == out_len && ReadSelfFile((LPVOID)out,l);
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+        if (ok && m_blob_crc && CRC32(0,(unsigned char*)out,l) != input_crc)
+          ok = 0;
+#endif
+        continue;
+      }
+
+      part->in = (char *)GlobalAlloc(GPTR, l);
+      if (!part->in || !ReadSelfFile((LPVOID)part->in,l))
+      {
+        ok = 0;
+        break;
+      }
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+      if (m_blob_crc && CRC32(0,(unsigned char*)part->in,l) != input_crc)
+      {
+        ok = 0;
+        break;
+      }
+#endif
+
+      part->s.next_in = part->in;
+      part->s.avail_in = l;
+      part->s.next_out = out;
+      part->s.avail_out = out_len;
+      part->hThread = CreateThread(NULL, 0, header_part_thread, part, 0, &tid);
+      if (!part->hThread)
+        header_part_thread(part);
+    }
+
+    for (i = 1; i < HEADER_PARTS; i++)
+    {
+      struct header_part *part = &parts[i];
+      if (part->hThread)
+      {
+        WaitForSingleObject(part->hThread, INFINITE);
+        CloseHandle(part->hThread);
+      }
+      if (part->err)
+        ok = 0;
+      if (part->in)
+        GlobalFree(part->in);
+      if (part->s.dynamicData)
+        lzmafree(part->s.dynamicData);
+    }
+  }
+#else
+  for (i = 1; i < HEADER_PARTS && ok; i++)
+  {
+    int l = ends[i] - ends[i-1];
+    ok = GetCompressedDataFromDataBlockToMemory(-1, data + ends[i-1], l) == l;
+  }
+#endif
+
+  return ok;
+}
+
 const TCHAR * NSISCALL loadHeaders(int cl_flags)
 {
   __int64 left;
@@ -186,6 +579,7 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 #endif//NSIS_CONFIG_CRC_SUPPORT
 
   void *data;
+  char *temp;
   firstheader h;
   header *header;
   dataheader dh;
@@ -211,10 +605,12 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 
   GetFileSizeEx(db_hFile, (LARGE_INTEGER*)&m_length);
   left = m_length;
+  temp = get_iobuf(m_length);
+  if (!temp)
+    return _LANG_CANTOPENSELF;
   while (left > 0)
   {
-    static char temp[32768*32]; // modified by yew: for fast crc
-    DWORD l = min(left, (g_filehdrsize ? sizeof(temp) : 512));
+    DWORD l = min(left, (g_filehdrsize ? iobuf_size : 512));
     if (!ReadSelfFile(temp, l))
     {
 #if defined(NSIS_CONFIG_CRC_SUPPORT) && defined(NSIS_CONFIG_VISIBLE_SUPPORT)
@@ -246,6 +642,7 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 
         if (h.length_of_all_following_data > left)
           return _LANG_INVALIDCRC;
+        iobuf_need = h.length_of_all_following_data;
 
 #ifdef NSIS_CONFIG_CRC_SUPPORT
         if ((cl_flags & FH_FLAGS_FORCE_CRC) == 0)
@@ -254,6 +651,17 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
             break;
         }
 
+        if (cl_flags & FH_FLAGS_BLOB_CRC)
+        {
+          // only the headers are checked here, they and the data are
+          // verified as they are read. the lengths were checked above.
+          // CRCCheck force still checks everything, data files included,
+          // before the installer starts.
+          m_blob_crc++;
+          if ((cl_flags & FH_FLAGS_FORCE_CRC) == 0)
+            break;
+        }
+
         do_crc++;
 
 #ifndef NSIS_CONFIG_CRC_ANAL
@@ -313,14 +721,16 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
   data = (void *)GlobalAlloc(GPTR,h.length_of_header);
 
 #ifdef NSIS_COMPRESS_WHOLE
-  inflateReset(&g_inflate_stream);
-
   {
     TCHAR fno[MAX_PATH];
+    SYSTEM_INFO si;
     my_GetTempFileName(fno, state_temp_dir);
     dbd_hFile=CreateFile(fno,GENERIC_WRITE|GENERIC_READ,0,NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,NULL);
     if (dbd_hFile == INVALID_HANDLE_VALUE)
       return _LANG_ERRORWRITINGTEMP;
+
+    GetSystemInfo(&si);
+    dbd_num_threads = min(si.dwNumberOfProcessors, DBD_MAX_THREADS);
   }
   dbd_srcpos = SetSelfFilePointer(g_filehdrsize + sizeof(firstheader));
 #ifdef NSIS_CONFIG_CRC_SUPPORT
@@ -328,11 +738,27 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 #else
   dbd_fulllen = dbd_srcpos - sizeof(h) + h.length_of_all_following_data;
 #endif//NSIS_CONFIG_CRC_SUPPORT
+
+  // the solidheader is followed by the blocks, the seek table comes last
+  if (!ReadSelfFile(&dbd_sh, sizeof(solidheader)))
+    return _LANG_INVALIDCRC;
+  dbd_srcpos += sizeof(solidheader);
+
+  dbd_blocks = (solidblock *)GlobalAlloc(GPTR, (dbd_sh.num_blocks + 1) * sizeof(solidblock));
+  dbd_cache = (__int64 *)GlobalAlloc(GPTR, dbd_sh.num_blocks * sizeof(__int64));
+  SetSelfFilePointer(dbd_fulllen - (dbd_sh.num_blocks + 1) * sizeof(solidblock));
+  if (!dbd_blocks || !dbd_cache || !ReadSelfFile(dbd_blocks, (dbd_sh.num_blocks + 1) * sizeof(solidblock)))
+    return _LANG_INVALIDCRC;
+  for (left = 0; left < dbd_sh.num_blocks; left++)
+    dbd_cache[left] = -1;
 #else
   SetSelfFilePointer(g_filehdrsize + sizeof(firstheader));
 #endif//NSIS_COMPRESS_WHOLE
 
-  if (GetCompressedDataFromDataBlockToMemory(-1, data, h.length_of_header) != h.length_of_header)
+  // the first part holds the header, and with it where the other parts go
+  if (!data ||
+      GetCompressedDataFromDataBlockToMemory(-1, data, h.length_of_header) != ((header *)data)->blocks[NB_ENTRIES].offset ||
+      !load_header_parts((char *)data, h.length_of_header))
   {
     return _LANG_INVALIDCRC;
   }
@@ -351,8 +777,16 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
   while (left--)
     header->blocks[left].offset += (int)data;
 
-  m_file_mapping.first = NULL;
-  m_file_mapping.cur = NULL;
+  {
+    entry *entries = (entry *)GlobalAlloc(GPTR, (header->blocks[NB_ENTRIES].num + 1) * sizeof(entry));
+    if (!entries)
+      return _LANG_INVALIDCRC;
+    unpack_entries((unsigned char *)header->blocks[NB_ENTRIES].offset, entries, header->blocks[NB_ENTRIES].num);
+    header->blocks[NB_ENTRIES].offset = (int)entries;
+  }
+
+  m_file_mapping.volumes = NULL;
+  m_file_mapping.num = 0;
   m_file_mapping.LoadFinished = FALSE;
 
 #ifdef NSIS_COMPRESS_WHOLE
@@ -363,22 +797,26 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 	  LPTSTR psz,psz2;
 	  int cur_index= 1;
 	  __int64 length;
+
+	  // the data files are named after the installer, .N.dat replaces its
+	  // extension
+	  CloseHandle(g_db_hFile);
+	  mystrcpy(m_data_file_path, state_exe_path);
+	  psz =_tcsrchr(m_data_file_path,'\\');
+	  if (psz==NULL) psz=m_data_file_path;
+	  while (psz2=_tcschr(psz+1,'.'))
+	  {
+		  psz = psz2;
+	  }
+	  m_data_file_ext = psz;
+
 	  while(1)
 	  {
-		  CloseHandle(g_db_hFile);
-		  mystrcpy(m_data_file_path, state_exe_path);
-		  psz =_tcsrchr(m_data_file_path,'\\');
-		  if (psz==NULL) psz=m_data_file_path;
-		  while (psz2=_tcschr(psz+1,'.'))
-		  {
-			  psz = psz2;
-		  }
-		  wsprintf(psz,_T(".%u.dat"),cur_index);
-		  g_db_hFile = db_hFile = myOpenFile(m_data_file_path, GENERIC_READ, OPEN_EXISTING);
-		  if (db_hFile == INVALID_HANDLE_VALUE)
+		  if (!open_volume(cur_index-1))
 		  {
 			  return _LANG_CANTOPENSELF;
 		  }
+		  db_hFile = g_db_hFile;
 		  if (!ReadSelfFile(&dh, sizeof(dh)))
 		  {// read out the data file header
 			  return _LANG_INVALIDCRC;
@@ -386,58 +824,20 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 		  if (cur_index==1)
 		  {
 			 m_length = dh.total_length;
+			 iobuf_need += dh.total_length;
+			 if (dh.total_volume < 1 || (dh.total_volume > 1 && dh.length_per_volume <= 0))
+				 return _LANG_INVALIDCRC;
+			 m_file_mapping.volumes = GlobalAlloc(GPTR,dh.total_volume*sizeof(dataheader));
+			 if (!m_file_mapping.volumes)
+				 return _LANG_INVALIDCRC;
+			 m_file_mapping.num = dh.total_volume;
 		  }
-		  if (!GetFileSizeEx(db_hFile,(LARGE_INTEGER*)&length) || length!=dh.length+sizeof(dataheader) || dh.volume_index!=cur_index)
-		  {// check the whole file length
+		  if (!GetFileSizeEx(db_hFile,(LARGE_INTEGER*)&length) || length!=dh.length+sizeof(dataheader) || dh.volume_index!=cur_index ||
+			  dh.total_volume!=m_file_mapping.num || (cur_index!=1 && dh.length_per_volume!=m_file_mapping.volumes[0].length_per_volume))
+		  {// check the whole file length, and that the volumes belong together
 			  return _LANG_INVALIDCRC;
 		  }
-		  if (m_file_mapping.first==NULL)
-		  {// it's the first time to meet a data file
-			  m_file_mapping.cur = GlobalAlloc(GPTR,sizeof(struct FileMapping));
-			  m_file_mapping.first = m_file_mapping.cur;
-		  }
-		  else
-		  {// push the new data file to the end, and replace the current one
-			  m_file_mapping.cur->next = GlobalAlloc(GPTR,sizeof(struct FileMapping));
-			  m_file_mapping.cur = m_file_mapping.cur->next;
-		  }
-		  mini_memcpy(&m_file_mapping.cur->dh,&dh,sizeof(dh));
-		  m_file_mapping.cur->next = NULL;
-#ifdef NSIS_CONFIG_CRC_SUPPORT
-		  if (do_crc)
-		  {
-			  __int64 cur_length= 0;
-			  crc = 0;
-			  while (cur_length<dh.length)
-			  {
-				  static char temp[32768*32]; // modified by yew: for fast crc
-				  DWORD l = min(dh.length-cur_length, sizeof(temp));
-				  if (!ReadSelfFile(temp, l))
-				  {
-#if defined(NSIS_CONFIG_VISIBLE_SUPPORT)
-					  handle_ver_dlg(TRUE);
-#endif
-					  return _LANG_INVALIDCRC;
-				  }
-#ifdef NSIS_CONFIG_VISIBLE_SUPPORT
-
-#ifdef NSIS_CONFIG_SILENT_SUPPORT
-				  if ((cl_flags & FH_FLAGS_SILENT) == 0)
-#endif//NSIS_CONFIG_SILENT_SUPPORT
-				  {
-					  handle_ver_dlg(FALSE);
-				  }
-#endif//NSIS_CONFIG_VISIBLE_SUPPORT
-
-				  crc = CRC32(crc, (unsigned char*)temp, l);
-
-				  m_pos += l;
-				  cur_length += l;
-			  }
-			  if (dh.crc != crc)
-				  return _LANG_INVALIDCRC;
-		  }
-#endif//NSIS_CONFIG_CRC_SUPPORT
+		  mini_memcpy(&m_file_mapping.volumes[cur_index-1],&dh,sizeof(dh));
 		  if (cur_index<dh.total_volume)
 			  cur_index++;// need to check next file
 		  else
@@ -446,26 +846,22 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
 #ifdef NSIS_CONFIG_CRC_SUPPORT
 	  if (do_crc)
 	  {
+		  // the crc of the installer was checked above, so the crc tables
+		  // are built before the threads use them
+		  BOOL ok = verify_volumes(cl_flags);
 #ifdef NSIS_CONFIG_VISIBLE_SUPPORT
 		  handle_ver_dlg(TRUE);
 #endif//NSIS_CONFIG_VISIBLE_SUPPORT
+		  if (!ok)
+			  return _LANG_INVALIDCRC;
 	  }
 #endif//NSIS_CONFIG_CRC_SUPPORT
-	  // re-open the first file
-	  if (cur_index!=1)
+	  // back to the first file
+	  if (!open_volume(0))
 	  {
-		  CloseHandle(g_db_hFile);
-		  mystrcpy(m_data_file_path, state_exe_path);
-		  psz =_tcsrchr(m_data_file_path,'\\');
-		  if (psz==NULL) psz=m_data_file_path;
-		  while (psz2=_tcschr(psz+1,'.'))
-		  {
-			  psz = psz2;
-		  }
-		  wsprintf(psz,_T(".%u.dat"),1);
-		  g_db_hFile = db_hFile = myOpenFile(m_data_file_path, GENERIC_READ, OPEN_EXISTING);
+		  return _LANG_CANTOPENSELF;
 	  }
-	  m_file_mapping.cur = m_file_mapping.first;// reset the current mapping to the first one
+	  db_hFile = g_db_hFile;
 	  m_file_mapping.LoadFinished = TRUE;// if there is no data file, keep it to be FALSE always
 	  header->blocks[NB_DATA].offset = SetFilePointer(db_hFile,0,NULL,FILE_BEGIN);
 	  m_file_mapping.cur_offset = 0;
@@ -478,23 +874,266 @@ const TCHAR * NSISCALL loadHeaders(int cl_flags)
   return 0;
 }
 
-#define IBUFSIZE (16384*32) // modified by yew: for fast crc
-#define OBUFSIZE (32768*32)
-
 // returns -3 if compression error/eof/etc
 
 #if !defined(NSIS_COMPRESS_WHOLE) || !defined(NSIS_CONFIG_COMPRESSION_SUPPORT)
 
+#define PIPE_SLOTS 4 // buffers of each pipeline stage, carved out of iobuf
+
+// blobs written to a file that take more than one read go through a
+// pipeline: a thread reads the stored data, this thread decodes it and
+// another thread writes the output, so disk reads, decoding and writes
+// overlap. stored data is only passed on once its crc is known to match.
+struct dodecomp_pipe
+{
+  pipe_queue in; // stored data, read by dodecomp_read()
+  pipe_queue out; // decoded data, written by dodecomp_write()
+  pipe_queue *write_q; // in for uncompressed data, out otherwise
+  __int64 input_len;
+  crc32_t input_crc;
+  HANDLE hFileOut;
+  int write_err;
+};
+
+static void NSISCALL dodecomp_read(void *ctx)
+{
+  struct dodecomp_pipe *p = (struct dodecomp_pipe *)ctx;
+  __int64 input_len = p->input_len;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+  crc32_t crc=0;
+#endif
+
+  while (input_len > 0)
+  {
+    DWORD l=(DWORD)min(input_len,(__int64)p->in.size);
+    char *buf=pipe_get_free(&p->in);
+    if (!buf) return; // the decoder gave up
+
+    if (!ReadSelfFile((LPVOID)buf,l))
+    {
+      pipe_close(&p->in,-3);
+      return;
+    }
+    input_len-=l;
+
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+    // the last part is held back, so nothing is written from a bad blob
+    // that the serial code wouldn't have written either
+    if (m_blob_crc)
+    {
+      crc=CRC32(crc,(unsigned char*)buf,l);
+      if (!input_len && crc != p->input_crc)
+      {
+        pipe_close(&p->in,-3);
+        return;
+      }
+    }
+#endif
+
+    pipe_put(&p->in,l);
+  }
+  pipe_close(&p->in,0);
+}
+
+static void NSISCALL dodecomp_write(void *ctx)
+{
+  struct dodecomp_pipe *p = (struct dodecomp_pipe *)ctx;
+  unsigned int l;
+  char *buf;
+
+  while ((buf=pipe_get_filled(p->write_q,&l)) != NULL)
+  {
+    DWORD t;
+    if (!WriteFile(p->hFileOut,buf,l,&t,NULL) || l != t)
+    {
+      p->write_err++;
+      pipe_abort(p->write_q);
+      return;
+    }
+    pipe_release(p->write_q);
+  }
+}
+
+// returns 0 if the threads can't be started, before anything is read.
+// otherwise *retval receives what _dodecomp() returns.
+static int NSISCALL dodecomp_pipelined(char *mem, HANDLE hFileOut, __int64 input_len, crc32_t input_crc, __int64 *retval)
+{
+  static struct dodecomp_pipe p;
+  pipe_thread reader, writer;
+  int compressed = (input_len & COMPRESSED_FLAG_MARK) != 0;
+  __int64 ret=0;
+
+  p.input_len=input_len&~COMPRESSED_FLAG_MARK;
+  p.input_crc=input_crc;
+  p.hFileOut=hFileOut;
+  p.write_err=0;
+
+  if (compressed)
+  {
+    if (!pipe_init(&p.in,mem,PIPE_SLOTS,ibufsize/PIPE_SLOTS)) return 0;
+    if (!pipe_init(&p.out,mem+ibufsize,PIPE_SLOTS,obufsize/PIPE_SLOTS))
+    {
+      pipe_free(&p.in);
+      return 0;
+    }
+    p.write_q=&p.out;
+  }
+  else
+  {
+    if (!pipe_init(&p.in,mem,PIPE_SLOTS,iobuf_size/PIPE_SLOTS)) return 0;
+    p.write_q=&p.in;
+  }
+
+  if (!pipe_start(&writer,dodecomp_write,&p))
+  {
+    pipe_free(&p.in);
+    if (compressed) pipe_free(&p.out);
+    return 0;
+  }
+  if (!pipe_start(&reader,dodecomp_read,&p))
+  {
+    pipe_close(p.write_q,0);
+    pipe_join(&writer);
+    pipe_free(&p.in);
+    if (compressed) pipe_free(&p.out);
+    return 0;
+  }
+
+#ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
+  if (compressed)
+  {
+    TCHAR progress[64];
+    __int64 input_left = p.input_len;
+    DWORD ltc = GetTickCount(), tc;
+    char *in, *out = NULL;
+    unsigned int l;
+    int err = Z_OK;
+
+    inflateReset(&g_inflate_stream);
+
+    while (err != Z_STREAM_END && (in=pipe_get_filled(&p.in,&l)) != NULL)
+    {
+      g_inflate_stream.next_in = in;
+      g_inflate_stream.avail_in = l;
+      input_left-=l;
+
+      for (;;)
+      {
+        unsigned int avail;
+
+        // output buffers are only passed on once full, or at the end
+        if (!out)
+        {
+          out=pipe_get_free(&p.out);
+          if (!out)
+          {
+            err=-2;
+            break;
+          }
+          g_inflate_stream.next_out = out;
+          g_inflate_stream.avail_out = p.out.size;
+        }
+        avail=g_inflate_stream.avail_out;
+
+        err=inflate(&g_inflate_stream);
+        if (err<0)
+        {
+          err=-4;
+          break;
+        }
+        ret+=avail-g_inflate_stream.avail_out;
+
+        tc = GetTickCount();
+        if (g_exec_flags.status_update & 1 && (tc - ltc > 200 || !input_left))
+        {
+          wsprintf(progress, _T("... %d%%"), (p.input_len - input_left) * 100/p.input_len);
+          update_status_text(0, progress);
+          ltc = tc;
+        }
+
+        if (!g_inflate_stream.avail_out || err==Z_STREAM_END)
+        {
+          pipe_put(&p.out,p.out.size-g_inflate_stream.avail_out);
+          out=NULL;
+        }
+        if (err==Z_STREAM_END)
+          break;
+
+        // if there's no output, more input is needed
+        if (avail==g_inflate_stream.avail_out)
+          break;
+      }
+      if (err<0)
+        break;
+      pipe_release(&p.in);
+    }
+
+    // a partly filled buffer when the stored data ran out
+    if (out && err>=0 && g_inflate_stream.avail_out != p.out.size)
+      pipe_put(&p.out,p.out.size-g_inflate_stream.avail_out);
+
+    // stored data left after the end of the stream still goes through the
+    // reader, which checks the crc
+    if (err==Z_STREAM_END)
+      while ((in=pipe_get_filled(&p.in,&l)) != NULL)
+        pipe_release(&p.in);
+    pipe_abort(&p.in);
+    pipe_join(&reader);
+    pipe_close(&p.out,0);
+    pipe_join(&writer);
+    pipe_free(&p.out);
+
+    if (err<0)
+      ret=err;
+    else if (p.in.err)
+      ret=p.in.err;
+  }
+  else
+#endif//NSIS_CONFIG_COMPRESSION_SUPPORT
+  {
+    // the writer stops the reader on errors, or the other way around
+    pipe_join(&reader);
+    pipe_join(&writer);
+    ret=p.in.err ? p.in.err : p.input_len;
+  }
+  pipe_free(&p.in);
+
+  *retval=p.write_err ? -2 : ret;
+  return 1;
+}
+
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+// reads the rest of a blob whose data isn't needed, so its crc is still
+// checked. crc is that of the part already read. returns 0, or -3 if the
+// crc doesn't match.
+static int NSISCALL check_blob_rest(char *buf, __int64 left, crc32_t crc, crc32_t input_crc)
+{
+  while (left > 0)
+  {
+    DWORD l=(DWORD)min(left,(__int64)ibufsize);
+    if (!ReadSelfFile((LPVOID)buf,l)) return -3;
+    crc=CRC32(crc,(unsigned char*)buf,l);
+    left-=l;
+  }
+  return crc != input_crc ? -3 : 0;
+}
+#endif
+
 // Decompress data.
 __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbuf, int outbuflen)
 {
-  static char inbuffer[IBUFSIZE+OBUFSIZE];
+  char *inbuffer=get_iobuf(iobuf_need);
   char *outbuffer;
-  __int64 outbuffer_len=outbuf?outbuflen:OBUFSIZE;
+  __int64 outbuffer_len=outbuf?outbuflen:obufsize;
   __int64 retval=0;
   __int64 input_len;
+  crc32_t input_crc;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+  crc32_t crc=0;
+#endif
 
-  outbuffer = outbuf?(char*)outbuf:(inbuffer+IBUFSIZE);
+  if (!inbuffer) return -1;
+  outbuffer = outbuf?(char*)outbuf:(inbuffer+ibufsize);
 
   if (offset>=0)
   {
@@ -502,6 +1141,14 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
   }
 
   if (!ReadSelfFile((LPVOID)&input_len,sizeof(__int64))) return -3;
+  if (!ReadSelfFile((LPVOID)&input_crc,sizeof(crc32_t))) return -3;
+
+  // single reads aren't worth the threads
+  if (!outbuf && (input_len&~COMPRESSED_FLAG_MARK) > ibufsize/PIPE_SLOTS)
+  {
+    if (dodecomp_pipelined(inbuffer,hFileOut,input_len,input_crc,&retval))
+      return retval;
+  }
 
 #ifdef NSIS_CONFIG_COMPRESSION_SUPPORT
   if (input_len & COMPRESSED_FLAG_MARK /* 0x80000000*/) // compressed , modified by yew
@@ -513,9 +1160,37 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
     inflateReset(&g_inflate_stream);
     input_len_total = input_len &= /*0x7fffffff*/~COMPRESSED_FLAG_MARK; // take off top bit.
 
+#ifdef NSIS_COMPRESS_USE_LZMA
+    // blobs read into memory (strings, plug-ins, ...) usually fit in iobuf
+    // whole, decode them in one go instead of ibufsize chunk by chunk. when
+    // outbuf is too small, lzmaDecodeMem() fills it and stops, just like the
+    // streaming loop below would.
+    if (outbuf && input_len <= (__int64)iobuf_size)
+    {
+      int err;
+
+      if (!ReadSelfFile((LPVOID)inbuffer,(DWORD)input_len))
+        return -3;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+      if (m_blob_crc && CRC32(0,(unsigned char*)inbuffer,(unsigned int)input_len) != input_crc)
+        return -3;
+#endif
+
+      g_inflate_stream.next_in = inbuffer;
+      g_inflate_stream.avail_in = (unsigned int)input_len;
+      g_inflate_stream.next_out = outbuf;
+      g_inflate_stream.avail_out = (unsigned int)outbuflen;
+
+      err=lzmaDecodeMem(&g_inflate_stream);
+      if (err<0) return -4;
+
+      return (char*)g_inflate_stream.next_out - (char*)outbuf;
+    }
+#endif//NSIS_COMPRESS_USE_LZMA
+
     while (input_len > 0)
     {
-      __int64 l=min(input_len,(__int64)IBUFSIZE);
+      __int64 l=min(input_len,(__int64)ibufsize);
       int err;
 
       if (!ReadSelfFile((LPVOID)inbuffer,l))
@@ -525,6 +1200,14 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
       g_inflate_stream.avail_in = l;
       input_len-=l;
 
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+      if (m_blob_crc)
+      {
+        crc=CRC32(crc,(unsigned char*)inbuffer,(unsigned int)l);
+        if (!input_len && crc != input_crc) return -3;
+      }
+#endif
+
       for (;;)
       {
         int u;
@@ -562,7 +1245,15 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
           outbuffer_len-=u;
           outbuffer=g_inflate_stream.next_out;
         }
-        if (err==Z_STREAM_END) return retval;
+        if (err==Z_STREAM_END)
+        {
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+          // stored data left after the end of the stream is still checked
+          if (m_blob_crc && input_len > 0 && check_blob_rest(inbuffer,input_len,crc,input_crc))
+            return -3;
+#endif
+          return retval;
+        }
       }
     }
   }
@@ -576,6 +1267,14 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
         DWORD l=min(input_len,outbuffer_len);
         DWORD t;
         if (!ReadSelfFile((LPVOID)inbuffer,l)) return -3;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+        // checked before the last part is written, an earlier one can't be undone
+        if (m_blob_crc)
+        {
+          crc=CRC32(crc,(unsigned char*)inbuffer,l);
+          if (l == input_len && crc != input_crc) return -3;
+        }
+#endif
         if (!WriteFile(hFileOut,inbuffer,l,&t,NULL) || l!=t) return -2;
         retval+=l;
         input_len-=l;
@@ -585,76 +1284,451 @@ __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbu
     {
       int l=min(input_len,outbuflen);
       if (!ReadSelfFile((LPVOID)outbuf,l)) return -3;
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+      // the rest of a blob larger than outbuf is read too, for its crc
+      if (m_blob_crc && check_blob_rest(inbuffer,input_len-l,CRC32(0,outbuf,l),input_crc)) return -3;
+#endif
       retval=l;
     }
   }
   return retval;
 }
+
+#if defined(NSIS_SUPPORT_FILE) && defined(NSIS_CONFIG_COMPRESSION_SUPPORT)
+
+// a run of File instructions, which File /r compiles to, extracts one file
+// after the other. while one is written, the blobs of the files that follow
+// it in the run are read and decoded into memory on threads, so extracting
+// many small files doesn't wait for the decoder after each of them. files
+// are still created, written and reported by EW_EXTRACTFILE in order, and
+// the installer is only read from the execution thread.
+
+#define PREFETCH_JOBS 4 // files decoded ahead at most
+#define PREFETCH_SIZE (1024*1024) // larger files are left to _dodecomp()
+#define PREFETCH_DIRECT 1 // job err of files left to _dodecomp()
+#define PREFETCH_OVERFLOW 2 // job err of files that decode to more than out holds
+
+struct prefetch_job
+{
+  int pos; // of the EW_EXTRACTFILE entry
+  char *in;
+  DWORD in_alloc;
+  DWORD in_len; // of the stored data in in
+  char *out; // PREFETCH_SIZE bytes
+  DWORD len; // of the data in out, or in if stored uncompressed
+  int compressed;
+  int err; // 0, PREFETCH_* or what _dodecomp() would return
+  HANDLE hThread;
+  z_stream s;
+};
+static struct prefetch_job prefetch_jobs[PREFETCH_JOBS];
+static int prefetch_num_jobs; // jobs used, 0 until the first run
+static int prefetch_head, prefetch_queued; // the jobs queued in prefetch_jobs
+static int prefetch_scan; // the next entry to look at for the run
+
+static DWORD WINAPI prefetch_thread(LPVOID lpParameter)
+{
+  struct prefetch_job *job = (struct prefetch_job *)lpParameter;
+  int err;
+
+#ifndef NSIS_COMPRESS_USE_LZMA
+  inflateReset(&job->s);
+#endif
+  job->s.next_in = job->in;
+  job->s.avail_in = job->in_len;
+  job->s.next_out = job->out;
+  job->s.avail_out = PREFETCH_SIZE;
+
+#ifdef NSIS_COMPRESS_USE_LZMA
+  err = lzmaDecodeMem(&job->s);
+#else
+  {
+    unsigned int in, out;
+    do
+    {
+      in = job->s.avail_in;
+      out = job->s.avail_out;
+      err = inflate(&job->s);
+    }
+    while (err == Z_OK && (job->s.avail_in != in || job->s.avail_out != out));
+  }
+#endif
+
+  job->len = (char *)job->s.next_out - job->out;
+  if (err == Z_STREAM_END)
+    job->err = 0;
+  else if (err >= 0 && !job->s.avail_out)
+    job->err = PREFETCH_OVERFLOW;
+  else
+    job->err = -4;
+  return 0;
+}
+
+// returns the position of the first EW_EXTRACTFILE entry from pos on, or -1
+// if the run ends before. entries that don't touch the datablock or jump
+// may come in between.
+static int NSISCALL prefetch_next_file(int pos)
+{
+  for (; pos < g_blocks[NB_ENTRIES].num; pos++)
+  {
+    int which = g_entries[pos].which;
+    if (which == EW_EXTRACTFILE)
+      return pos;
+    if (which != EW_CREATEDIR && which != EW_SETFILEATTRIBUTES)
+      break;
+  }
+  return -1;
+}
+
+// reads the blob of the entry at pos and starts decoding it
+static void NSISCALL prefetch_start(struct prefetch_job *job, int pos)
+{
+  entry *e = g_entries + pos;
+  __int64 input_len;
+  crc32_t input_crc;
+  DWORD l;
+
+  job->pos = pos;
+  job->err = PREFETCH_DIRECT;
+
+  SetSelfFilePointer(g_blocks[NB_DATA].offset+MAKEQWORD(e->offsets[2],e->offsets[6]));
+  if (!ReadSelfFile((LPVOID)&input_len,sizeof(__int64)) ||
+      !ReadSelfFile((LPVOID)&input_crc,sizeof(crc32_t)))
+  {
+    job->err = -3;
+    return;
+  }
+  if ((input_len & ~COMPRESSED_FLAG_MARK) > PREFETCH_SIZE)
+    return;
+  l = (DWORD)(input_len & ~COMPRESSED_FLAG_MARK);
+  job->compressed = (input_len & COMPRESSED_FLAG_MARK) != 0;
+
+  if (l > job->in_alloc)
+  {
+    if (job->in) GlobalFree(job->in);
+    job->in = (char *)GlobalAlloc(GPTR, l);
+    job->in_alloc = job->in ? l : 0;
+  }
+  if (job->compressed && !job->out)
+    job->out = (char *)GlobalAlloc(GPTR, PREFETCH_SIZE);
+  if ((l && !job->in) || (job->compressed && !job->out))
+    return;
+
+  if (!ReadSelfFile((LPVOID)job->in,l))
+  {
+    job->err = -3;
+    return;
+  }
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+  if (m_blob_crc && CRC32(0,(unsigned char*)job->in,l) != input_crc)
+  {
+    job->err = -3;
+    return;
+  }
+#endif
+  job->len = job->in_len = l;
+  job->err = 0;
+
+  if (job->compressed)
+  {
+    DWORD tid;
+    job->hThread = CreateThread(NULL, 0, prefetch_thread, job, 0, &tid);
+    if (!job->hThread)
+      prefetch_thread(job);
+  }
+}
+
+// decodes the stored data of a job that overflowed in chunks, like
+// _dodecomp() does, so it doesn't have to be read again
+static __int64 NSISCALL prefetch_decode(struct prefetch_job *job, HANDLE hFileOut)
+{
+  __int64 retval=0;
+  int err;
+
+  inflateReset(&g_inflate_stream);
+  g_inflate_stream.next_in = job->in;
+  g_inflate_stream.avail_in = job->in_len;
+  do
+  {
+    DWORD u, t;
+
+    g_inflate_stream.next_out = job->out;
+    g_inflate_stream.avail_out = PREFETCH_SIZE;
+    err=inflate(&g_inflate_stream);
+    if (err<0) return -4;
+
+    u=(char*)g_inflate_stream.next_out - job->out;
+    if (!u && err!=Z_STREAM_END) return -4; // out of input
+    if (u && (!WriteFile(hFileOut,job->out,u,&t,NULL) || t != u)) return -2;
+    retval+=u;
+  }
+  while (err!=Z_STREAM_END);
+  return retval;
+}
+
+static void NSISCALL prefetch_wait(struct prefetch_job *job)
+{
+  if (job->hThread)
+  {
+    WaitForSingleObject(job->hThread, INFINITE);
+    CloseHandle(job->hThread);
+    job->hThread = NULL;
+  }
+}
+
+// queues the files of the run until all of the jobs are used
+static void NSISCALL prefetch_fill()
+{
+  while (prefetch_queued < prefetch_num_jobs)
+  {
+    int pos = prefetch_next_file(prefetch_scan);
+    if (pos < 0)
+      break;
+    prefetch_start(&prefetch_jobs[(prefetch_head + prefetch_queued) % prefetch_num_jobs], pos);
+    prefetch_queued++;
+    prefetch_scan = pos + 1;
+  }
+}
+
+static void NSISCALL prefetch_pop()
+{
+  prefetch_wait(&prefetch_jobs[prefetch_head]);
+  prefetch_head = (prefetch_head + 1) % prefetch_num_jobs;
+  prefetch_queued--;
+}
+
+__int64 NSISCALL ExtractFileEntry(int pos, HANDLE hFileOut)
+{
+  entry *e = g_entries + pos;
+  struct prefetch_job *job;
+  __int64 ret;
+  DWORD t;
+
+  if (!prefetch_num_jobs)
+  {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    prefetch_num_jobs = max(min(si.dwNumberOfProcessors, PREFETCH_JOBS), 2);
+  }
+
+  // files skipped since the last one were decoded for nothing, anything
+  // else queued means the script jumped
+  while (prefetch_queued && prefetch_jobs[prefetch_head].pos < pos)
+    prefetch_pop();
+  if (!prefetch_queued || prefetch_jobs[prefetch_head].pos != pos)
+  {
+    while (prefetch_queued)
+      prefetch_pop();
+
+    // a single file isn't worth it
+    if (prefetch_next_file(pos + 1) < 0)
+      return GetCompressedDataFromDataBlock(MAKEQWORD(e->offsets[2],e->offsets[6]),hFileOut);
+    prefetch_scan = pos;
+  }
+  prefetch_fill();
+
+  job = &prefetch_jobs[prefetch_head];
+  prefetch_wait(job);
+
+  if (job->err == PREFETCH_DIRECT)
+    ret = GetCompressedDataFromDataBlock(MAKEQWORD(e->offsets[2],e->offsets[6]),hFileOut);
+  else if (job->err == PREFETCH_OVERFLOW)
+    ret = prefetch_decode(job, hFileOut);
+  else if (job->err < 0)
+    ret = job->err;
+  else if (!WriteFile(hFileOut,job->compressed ? job->out : job->in,job->len,&t,NULL) || t != job->len)
+    ret = -2;
+  else
+    ret = job->len;
+
+  // the job is free again, for the next file of the run
+  prefetch_pop();
+  prefetch_fill();
+  return ret;
+}
+
+void NSISCALL EndPrefetch()
+{
+  int i;
+  while (prefetch_queued)
+    prefetch_pop();
+  for (i = 0; i < PREFETCH_JOBS; i++)
+  {
+    if (prefetch_jobs[i].in) GlobalFree(prefetch_jobs[i].in);
+    if (prefetch_jobs[i].out) GlobalFree(prefetch_jobs[i].out);
+    prefetch_jobs[i].in = prefetch_jobs[i].out = NULL;
+    prefetch_jobs[i].in_alloc = 0;
+  }
+}
+
+#endif//NSIS_SUPPORT_FILE && NSIS_CONFIG_COMPRESSION_SUPPORT
 #else//NSIS_COMPRESS_WHOLE
 
-static char _inbuffer[IBUFSIZE];
-static char _outbuffer[OBUFSIZE];
 extern __int64 m_length;
 extern __int64 m_pos;
 extern BOOL CALLBACK verProc(HWND, UINT, WPARAM, LPARAM);
 extern BOOL CALLBACK DialogProc(HWND, UINT, WPARAM, LPARAM);
-static int NSISCALL __ensuredata(int amount)
+
+// a block being decoded by one of the threads
+struct dbd_job
+{
+  z_stream s;
+  char *in;
+  int in_len;
+  int in_alloc;
+  char *out;
+  int out_len;
+  int err;
+};
+static struct dbd_job dbd_jobs[DBD_MAX_THREADS];
+
+static DWORD WINAPI dbd_decode_thread(LPVOID lpParameter)
+{
+  struct dbd_job *job = (struct dbd_job *)lpParameter;
+  unsigned int in, out;
+  int err;
+
+  inflateReset(&job->s);
+  job->s.next_in = job->in;
+  job->s.avail_in = job->in_len;
+  job->s.next_out = job->out;
+  // a little extra room, so a corrupt block can't go unnoticed
+  job->s.avail_out = dbd_sh.block_size + 16;
+
+  do
+  {
+    in = job->s.avail_in;
+    out = job->s.avail_out;
+    err = inflate(&job->s);
+  }
+  while (err == Z_OK && (job->s.avail_in != in || job->s.avail_out != out));
+
+  job->out_len = (char *)job->s.next_out - job->out;
+  job->err = err == Z_STREAM_END ? 0 : -3;
+  return 0;
+}
+
+// returns the index of the block that holds offset of the stream
+static int NSISCALL dbd_find_block(__int64 offset)
+{
+  int lo = 0, hi = dbd_sh.num_blocks - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (dbd_blocks[mid].offset <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// decodes the blocks that hold the amount bytes at dbd_pos into dbd_hFile,
+// unless they were decoded already. blocks before them are not touched. up
+// to dbd_num_threads blocks are decoded at once, the blocks that follow a
+// missing block are decoded along with it as they are likely needed next.
+static int NSISCALL __ensuredata(__int64 amount)
 {
-  int needed=amount-(dbd_size-dbd_pos);
+  __int64 end = dbd_pos + amount;
+  int b;
 #ifdef NSIS_CONFIG_VISIBLE_SUPPORT
   verify_time=GetTickCount()+500;
 #endif
-  if (needed>0)
+  if (amount <= 0) return 0;
+  if (end > dbd_sh.length) return -3;
+
+  m_length=amount;
+  m_pos=0;
+  b = dbd_find_block(dbd_pos);
+  while (b < dbd_sh.num_blocks && dbd_blocks[b].offset < end)
   {
-    SetSelfFilePointer(dbd_srcpos);
-    SetFilePointerEx(dbd_hFile,(LARGE_INTEGER*)&dbd_size,NULL,FILE_BEGIN);
-    m_length=needed;
-    m_pos=0;
-    for (;;)
+    HANDLE threads[DBD_MAX_THREADS];
+    int num_threads = 0;
+    int n = 0;
+    int i;
+
+    if (dbd_cache[b] >= 0)
     {
-      int err;
-      int l=min(IBUFSIZE,dbd_fulllen-dbd_srcpos);
-      if (!ReadSelfFile((LPVOID)_inbuffer,l)) return -1;
-      dbd_srcpos+=l;
-      g_inflate_stream.next_in=_inbuffer;
-      g_inflate_stream.avail_in=l;
-      do
+      b++;
+      continue;
+    }
+
+    // the installer can only be read from this thread
+    while (n < dbd_num_threads && b + n < dbd_sh.num_blocks && dbd_cache[b + n] < 0)
+    {
+      struct dbd_job *job = &dbd_jobs[n];
+      int l = (int)(dbd_blocks[b + n + 1].compressed_offset - dbd_blocks[b + n].compressed_offset);
+      if (l > job->in_alloc)
       {
-        DWORD r,t;
+        if (job->in) GlobalFree(job->in);
+        job->in = (char *)GlobalAlloc(GPTR, l);
+        job->in_alloc = job->in ? l : 0;
+      }
+      if (!job->out)
+        job->out = (char *)GlobalAlloc(GPTR, dbd_sh.block_size + 16);
+      if (!job->in || !job->out) return -1;
+      SetSelfFilePointer(dbd_srcpos + dbd_blocks[b + n].compressed_offset);
+      if (!ReadSelfFile((LPVOID)job->in, l)) return -1;
+      job->in_len = l;
+      n++;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      DWORD tid;
+      HANDLE hThread = n > 1 ? CreateThread(NULL, 0, dbd_decode_thread, &dbd_jobs[i], 0, &tid) : NULL;
+      if (hThread)
+        threads[num_threads++] = hThread;
+      else
+        dbd_decode_thread(&dbd_jobs[i]);
+    }
+
+    if (num_threads)
+    {
 #ifdef NSIS_CONFIG_VISIBLE_SUPPORT
+      while (WaitForMultipleObjects(num_threads, threads, TRUE, 100) == WAIT_TIMEOUT)
+      {
         if (g_header)
 #ifdef NSIS_CONFIG_SILENT_SUPPORT
           if (!g_exec_flags.silent)
 #endif
-          {
-            m_pos=m_length-(amount-(dbd_size-dbd_pos));
-
             handle_ver_dlg(FALSE);
-          }
-#endif//NSIS_CONFIG_VISIBLE_SUPPORT
-        g_inflate_stream.next_out=_outbuffer;
-        g_inflate_stream.avail_out=OBUFSIZE;
-        err=inflate(&g_inflate_stream);
-        if (err<0)
-        {
-          return -3;
-        }
-        r=(DWORD)g_inflate_stream.next_out-(DWORD)_outbuffer;
-        if (r)
-        {
-          if (!WriteFile(dbd_hFile,_outbuffer,r,&t,NULL) || r != t)
-          {
-            return -2;
-          }
-          dbd_size+=r;
-        }
-        else if (g_inflate_stream.avail_in || !l) return -3;
-        else break;
       }
-      while (g_inflate_stream.avail_in);
-      if (amount-(dbd_size-dbd_pos) <= 0) break;
+#else
+      WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+#endif
+      while (num_threads--)
+        CloseHandle(threads[num_threads]);
     }
-    SetFilePointerEx(dbd_hFile,(LARGE_INTEGER*)&dbd_pos,NULL,FILE_BEGIN);
+
+    // decoded blocks are appended to dbd_hFile
+    if (!SetFilePointerEx(dbd_hFile,*(LARGE_INTEGER*)&dbd_size,NULL,FILE_BEGIN)) return -2;
+    for (i = 0; i < n; i++)
+    {
+      struct dbd_job *job = &dbd_jobs[i];
+      __int64 expected = dbd_blocks[b + i + 1].offset - dbd_blocks[b + i].offset;
+      DWORD t;
+      if (job->err || job->out_len != expected) return -3;
+      if (!WriteFile(dbd_hFile,job->out,job->out_len,&t,NULL) || (DWORD)job->out_len != t)
+      {
+        return -2;
+      }
+      dbd_cache[b + i] = dbd_size;
+      dbd_size+=t;
+    }
+    b += n;
+
+#ifdef NSIS_CONFIG_VISIBLE_SUPPORT
+    if (g_header)
+#ifdef NSIS_CONFIG_SILENT_SUPPORT
+      if (!g_exec_flags.silent)
+#endif
+      {
+        m_pos=min(dbd_blocks[b].offset,end)-dbd_pos;
+
+        handle_ver_dlg(FALSE);
+      }
+#endif//NSIS_CONFIG_VISIBLE_SUPPORT
   }
 #ifdef NSIS_CONFIG_VISIBLE_SUPPORT
   handle_ver_dlg(TRUE);
@@ -662,44 +1736,66 @@ static int NSISCALL __ensuredata(int amount)
   return 0;
 }
 
+// reads the decoded stream at dbd_pos, __ensuredata() must be called first
+static BOOL NSISCALL dbd_read(LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
+{
+  while (nNumberOfBytesToRead)
+  {
+    int b = dbd_find_block(dbd_pos);
+    __int64 pos = dbd_cache[b] + (dbd_pos - dbd_blocks[b].offset);
+    DWORD l = (DWORD)min((__int64)nNumberOfBytesToRead, dbd_blocks[b + 1].offset - dbd_pos);
+    DWORD r;
+    if (dbd_cache[b] < 0) return FALSE;
+    if (!SetFilePointerEx(dbd_hFile,*(LARGE_INTEGER*)&pos,NULL,FILE_BEGIN)) return FALSE;
+    if (!ReadFile(dbd_hFile,lpBuffer,l,&r,NULL) || r != l) return FALSE;
+    lpBuffer = (char *)lpBuffer + l;
+    nNumberOfBytesToRead -= l;
+    dbd_pos += l;
+  }
+  return TRUE;
+}
+
 
 __int64 NSISCALL _dodecomp(__int64 offset, HANDLE hFileOut, unsigned char *outbuf, int outbuflen)
 {
-  DWORD r;
   __int64 input_len;
   __int64 retval;
   if (offset>=0)
   {
     dbd_pos=g_blocks[NB_DATA].offset+offset;
-    SetFilePointerEx(dbd_hFile,(LARGE_INTEGER*)&dbd_pos,NULL,FILE_BEGIN);
   }
-  retval=__ensuredata(sizeof(__int64));
+  retval=__ensuredata(BLOB_HEADER_SIZE);
   if (retval<0) return retval;
 
-  if (!ReadFile(dbd_hFile,(LPVOID)&input_len,sizeof(__int64),&r,NULL) || r!=sizeof(__int64)) return -3;
-  dbd_pos+=sizeof(__int64);
-
-  retval=__ensuredata(input_len);
-  if (retval < 0) return retval;
+  if (!dbd_read((LPVOID)&input_len,sizeof(__int64))) return -3;
+  // the crc of the blob is not needed, the whole installer was verified
+  dbd_pos+=sizeof(crc32_t);
 
   if (!outbuf)
   {
+    char *inbuffer=get_iobuf(input_len);
+    if (!inbuffer) return -1;
+    retval=__ensuredata(input_len);
+    if (retval < 0) return retval;
+
     while (input_len > 0)
     {
       DWORD t;
-      DWORD l=min(input_len,IBUFSIZE);
-      if (!ReadFile(dbd_hFile,(LPVOID)_inbuffer,l,&r,NULL) || l != r) return -3;
-      if (!WriteFile(hFileOut,_inbuffer,r,&t,NULL) || t != l) return -2;
-      retval+=r;
-      input_len-=r;
-      dbd_pos+=r;
+      DWORD l=min(input_len,iobuf_size);
+      if (!dbd_read((LPVOID)inbuffer,l)) return -3;
+      if (!WriteFile(hFileOut,inbuffer,l,&t,NULL) || t != l) return -2;
+      retval+=l;
+      input_len-=l;
     }
   }
   else
   {
-    if (!ReadFile(dbd_hFile,(LPVOID)outbuf,min(input_len,outbuflen),&r,NULL)) return -3;
-    retval=r;
-    dbd_pos+=r;
+    DWORD l=min(input_len,outbuflen);
+    retval=__ensuredata(l);
+    if (retval < 0) return retval;
+
+    if (!dbd_read((LPVOID)outbuf,l)) return -3;
+    retval=l;
   }
   return retval;
 }
@@ -714,11 +1810,12 @@ BOOL NSISCALL ReadSelfFile(LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
   }
   for (i=0;i<nNumberOfBytesToRead;)
   {
-	  __int64 offset=m_file_mapping.cur_offset-(m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume;
-	  if (offset < m_file_mapping.cur->dh.length)
+	  dataheader *dh=&m_file_mapping.volumes[m_file_mapping.cur];
+	  __int64 offset=m_file_mapping.cur_offset-m_file_mapping.cur*dh->length_per_volume;
+	  if (offset < dh->length)
 	  {
 		  // there is still some data,read them first
-		  DWORD l= min(m_file_mapping.cur->dh.length-offset,(__int64)nNumberOfBytesToRead-i);
+		  DWORD l= min(dh->length-offset,(__int64)nNumberOfBytesToRead-i);
 		  if (!ReadFile(g_db_hFile,lpBuffer,l,&rd,NULL) || (rd != l))
 			  return FALSE;
 
@@ -728,19 +1825,9 @@ BOOL NSISCALL ReadSelfFile(LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
 	  }
 	  else
 	  {
-		  LPTSTR psz,psz2;
-		  assert(m_file_mapping.cur->next);
-		  m_file_mapping.cur = m_file_mapping.cur->next;
-		  CloseHandle(g_db_hFile);
-		  mystrcpy(m_data_file_path, state_exe_path);
-		  psz =_tcsrchr(m_data_file_path,'\\');
-		  if (psz==NULL) psz=m_data_file_path;
-		  while (psz2=_tcschr(psz+1,'.'))
-		  {
-			  psz = psz2;
-		  }
-		  wsprintf(psz,_T(".%u.dat"),m_file_mapping.cur->dh.volume_index);
-		  g_db_hFile = myOpenFile(m_data_file_path, GENERIC_READ, OPEN_EXISTING);
+		  // go on at the start of the next volume
+		  if (m_file_mapping.cur+1 >= m_file_mapping.num || !open_volume(m_file_mapping.cur+1))
+			  return FALSE;
 		  SetFilePointer(g_db_hFile,sizeof(dataheader),NULL,FILE_BEGIN);
 	  }
   }
@@ -750,51 +1837,23 @@ BOOL NSISCALL ReadSelfFile(LPVOID lpBuffer, DWORD nNumberOfBytesToRead)
 __int64 NSISCALL SetSelfFilePointer(__int64 lDistanceToMove)
 {
 	__int64 ret;
+	__int64 length_per_volume;
+	int volume;
 	if (!m_file_mapping.LoadFinished)
 	{
 	  SetFilePointerEx(g_db_hFile,*(LARGE_INTEGER*)&lDistanceToMove,(LARGE_INTEGER*)&ret,FILE_BEGIN);
 	  return ret;
 	}
-	// need to check the valid range
-	if (lDistanceToMove>=(m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume && 
-		lDistanceToMove<(m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume+m_file_mapping.cur->dh.length)
-	{
-		// it's okay, locate in the current file
-		m_file_mapping.cur_offset = lDistanceToMove;
-		lDistanceToMove -= (m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume; // convert to the local offset
-		lDistanceToMove += sizeof(dataheader);
-		SetFilePointerEx(g_db_hFile,*(LARGE_INTEGER*)&lDistanceToMove,(LARGE_INTEGER*)&ret,FILE_BEGIN);
-		return /*m_file_mapping.cur_offset*/0;// the return is ignored
-	}
 
-	// open the correct file
-	m_file_mapping.cur = m_file_mapping.first;
-	while(m_file_mapping.cur)
-	{
-		if (lDistanceToMove>=(m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume && 
-			lDistanceToMove<(m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume+m_file_mapping.cur->dh.length)
-		{
-			// found it
-			LPTSTR psz,psz2;
-			CloseHandle(g_db_hFile);
-			mystrcpy(m_data_file_path, state_exe_path);
-			psz =_tcsrchr(m_data_file_path,'\\');
-			if (psz==NULL) psz=m_data_file_path;
-			while (psz2=_tcschr(psz+1,'.'))
-			{
-				psz = psz2;
-			}
-			wsprintf(psz,_T(".%u.dat"),m_file_mapping.cur->dh.volume_index);
-			g_db_hFile = myOpenFile(m_data_file_path, GENERIC_READ, OPEN_EXISTING);
-
-			m_file_mapping.cur_offset = lDistanceToMove;
-			lDistanceToMove -= (m_file_mapping.cur->dh.volume_index-1)*m_file_mapping.cur->dh.length_per_volume; // convert to the local offset
-			lDistanceToMove += sizeof(dataheader);
-			SetFilePointerEx(g_db_hFile,*(LARGE_INTEGER*)&lDistanceToMove,(LARGE_INTEGER*)&ret,FILE_BEGIN);
-			return /*m_file_mapping.cur_offset*/0;//the return is ignored
-		}
-		m_file_mapping.cur = m_file_mapping.cur->next;
-	}
-	assert(!"shouldn't happen");
-	return 0;
+	// offsets past the end go to the last volume, where the next read fails
+	length_per_volume=m_file_mapping.volumes[0].length_per_volume;
+	volume=m_file_mapping.num>1?(int)min(lDistanceToMove/length_per_volume,(__int64)m_file_mapping.num-1):0;
+	if ((volume != m_file_mapping.cur || g_db_hFile == INVALID_HANDLE_VALUE) && !open_volume(volume))
+		return 0;
+
+	m_file_mapping.cur_offset = lDistanceToMove;
+	lDistanceToMove -= volume*length_per_volume; // convert to the local offset
+	lDistanceToMove += sizeof(dataheader);
+	SetFilePointerEx(g_db_hFile,*(LARGE_INTEGER*)&lDistanceToMove,(LARGE_INTEGER*)&ret,FILE_BEGIN);
+	return /*m_file_mapping.cur_offset*/0;// the return is ignored
 }
@@ -41,7 +41,10 @@
 // headers + datablock is at least 512 bytes if CRC enabled
 
 
-#define MAX_ENTRY_OFFSETS 7
+#define MAX_ENTRY_OFFSETS 7 // no more than 8, entries are stored with a byte of offset flags
+// entries are stored as the difference with the last entry of the same
+// which, if which is below ENTRY_PACK_WHICH
+#define ENTRY_PACK_WHICH 128
 
 
 // if you want people to not be able to decompile your installers as easily,
@@ -209,7 +212,7 @@ enum
 #endif
 };
 
-#define FH_FLAGS_MASK 0x3f
+#define FH_FLAGS_MASK 0xff
 #define FH_FLAGS_UNINSTALL 1
 #ifdef NSIS_CONFIG_SILENT_SUPPORT
 #  define FH_FLAGS_SILENT 2
@@ -222,6 +225,13 @@ enum
 #define FH_FLAGS_NSIS64		0x10
 // mark this is an installer with standalone data file
 #define FH_FLAGS_DATA_FILE	0x20
+// mark the blobs in the datablock are verified as they are read, only the
+// headers are checked before the installer starts unless FH_FLAGS_FORCE_CRC
+// is set too
+#define FH_FLAGS_BLOB_CRC	0x40
+// mark the headers and the datablock are compressed as a whole, the layout
+// is described next to solidheader
+#define FH_FLAGS_SOLID	0x80
 
 #define FH_SIG 0xDEADBEEF
 
@@ -230,7 +240,7 @@ enum
 #define FH_INT2 0x74666F73
 #define FH_INT3 0x74736E49
 
-#include <PshPack1.h>
+#pragma pack(push, 1)
 typedef struct
 {
   int flags; // FH_FLAGS_*
@@ -239,6 +249,7 @@ typedef struct
   int nsinst[3]; // FH_INT1,FH_INT2,FH_INT3
 
   // these point to the header+sections+entries+stringtable in the datablock
+  // (the uncompressed length of all HEADER_PARTS blobs together)
   int length_of_header;
 
   // this specifies the length of all the data (including the firstheader and CRC)
@@ -253,8 +264,28 @@ typedef struct
 	int volume_index; // volume index
 	__int64 length;// data length in this volume
 	unsigned int crc;// data crc in this volume
+	unsigned __int64 hash;// 64 bit FNV-1a hash of the data in this volume, lets makensis skip unchanged volumes
 }dataheader;
-#include <PopPack.h>
+
+// compress whole (NSIS_COMPRESS_WHOLE): the header and the datablock are
+// compressed as one stream, split into blocks of block_size bytes that are
+// compressed independently of each other. the blocks follow the solidheader
+// and are followed by a seek table of num_blocks+1 solidblock entries, the
+// last of which holds the total lengths. any block can be decoded on its own
+// so the exehead only decodes the blocks that hold the data it needs.
+typedef struct
+{
+  int block_size; // uncompressed size of every block but the last
+  int num_blocks;
+  __int64 length; // uncompressed length of the whole stream
+} solidheader;
+
+typedef struct
+{
+  __int64 offset; // uncompressed offset of the block in the stream
+  __int64 compressed_offset; // offset of the compressed block from the first block
+} solidblock;
+#pragma pack(pop)
 
 // Flags for common_header.flags
 #define CH_FLAGS_DETAILS_SHOWDETAILS 1
@@ -290,11 +321,18 @@ enum {
 #ifdef NSIS_SUPPORT_BGBG
   NB_BGFONT,
 #endif
+  NB_TOC,
   NB_DATA,
 
   BLOCKS_NUM
 };
 
+// the header is stored as HEADER_PARTS blobs, one after the other, split at
+// the entries, strings and language tables blocks. each blob is compressed
+// on its own, so they can be decoded at the same time, and the first one
+// holds the header itself and with it where the others end.
+#define HEADER_PARTS 4
+
 // nsis strings
 typedef TCHAR NSIS_STRING[NSIS_MAX_STRLEN];
 
@@ -419,6 +457,23 @@ typedef struct
                                   // tables.
 } entry;
 
+// table of contents (SetTOC on): one entry for each blob File and ReserveFile
+// added, in the order they were added, so tools can list and find files
+// without walking the entries or decompressing anything. num is 0 if the
+// installer has none. the exehead doesn't use it.
+#define TOC_FLAGS_COMPRESSED 1
+
+typedef struct
+{
+  __int64 offset; // of the blob in the datablock, as in the entry
+  __int64 stored_size; // of the data after the blob header
+  __int64 size; // of the data once decompressed
+  int flags; // TOC_FLAGS_*
+  unsigned int crc; // of the stored data, as in the blob header
+  int name_ptr; // the name File writes, relative to $OUTDIR unless absolute
+  int entry; // index of the EW_EXTRACTFILE entry, -1 for ReserveFile
+} toc_entry;
+
 // page window proc
 enum
 {
@@ -540,6 +595,20 @@ extern int g_quit_flag;
 
 BOOL NSISCALL ReadSelfFile(LPVOID lpBuffer, DWORD nNumberOfBytesToRead);
 __int64 NSISCALL SetSelfFilePointer(__int64 lDistanceToMove);
+void NSISCALL CloseVolumes();
+
+#ifdef NSIS_SUPPORT_FILE
+// extracts the file of the EW_EXTRACTFILE entry at pos, like
+// GetCompressedDataFromDataBlock(). the files that follow it are decoded
+// ahead, EndPrefetch() waits for them and frees their memory.
+#if defined(NSIS_CONFIG_COMPRESSION_SUPPORT) && !defined(NSIS_COMPRESS_WHOLE)
+__int64 NSISCALL ExtractFileEntry(int pos, HANDLE hFileOut);
+void NSISCALL EndPrefetch();
+#else
+#define ExtractFileEntry(pos, hFileOut) GetCompressedDataFromDataBlock(MAKEQWORD(g_entries[pos].offsets[2],g_entries[pos].offsets[6]),hFileOut)
+#define EndPrefetch()
+#endif
+#endif//NSIS_SUPPORT_FILE
 
 extern struct block_header g_blocks[BLOCKS_NUM];
 extern header *g_header;
@@ -558,5 +627,8 @@ extern int g_is_uninstaller;
 #define HIDWORD(l)          ((unsigned int)((l)>>32))
 #define MAKEQWORD(l,h)		((unsigned __int64)((unsigned int)l) | (((unsigned __int64)((unsigned int)h))<<32))
 #define COMPRESSED_FLAG_MARK			0x8000000000000000
+// a blob in the datablock starts with its length, COMPRESSED_FLAG_MARK set
+// if compressed, and the crc32 of the data as stored that follows
+#define BLOB_HEADER_SIZE			(sizeof(__int64)+sizeof(crc32_t))
 
 #endif //_FILEFORM_H_
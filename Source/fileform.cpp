@@ -21,6 +21,7 @@
 #include "Platform.h"
 
 #include <cassert>
+#include <cstring>
 
 // these functions MUST be synchronized with the structures in Source/exehead/fileform.h !
 // data must be written in the same order it's defined in Source/exehead/fileform.h
@@ -35,6 +36,19 @@ void firstheader_writer::write(const firstheader *data)
   m_sink->write_data(&data->length_of_all_following_data,sizeof(data->length_of_all_following_data));
 }
 
+void solidheader_writer::write(const solidheader *data)
+{
+  m_sink->write_int(data->block_size);
+  m_sink->write_int(data->num_blocks);
+  m_sink->write_data(&data->length,sizeof(data->length));
+}
+
+void solidblock_writer::write(const solidblock *data)
+{
+  m_sink->write_data(&data->offset,sizeof(data->offset));
+  m_sink->write_data(&data->compressed_offset,sizeof(data->compressed_offset));
+}
+
 void block_header_writer::write(const block_header *data)
 {
   m_sink->write_int(data->offset);
@@ -118,10 +132,63 @@ void section_writer::write(const section *data)
   m_sink->write_string(data->name, NSIS_MAX_STRLEN);
 }
 
+// entries are packed. most offsets are 0, the same as in the last entry
+// of the same which or not far from it (string offsets, datablock offsets of
+// File): which as a varint, a byte with a bit set for each offset that
+// differs from the last entry of the same which and the differences zigzag
+// encoded as varints. see unpack_entries() in exehead/fileform.c
+static void write_varint(writer_sink *sink, unsigned int v)
+{
+  while (v >= 0x80)
+  {
+    sink->write_byte((unsigned char) (v | 0x80));
+    v >>= 7;
+  }
+  sink->write_byte((unsigned char) v);
+}
+
+entry_writer::entry_writer(writer_sink *sink) : writer(sink)
+{
+  memset(m_last, 0, sizeof(m_last));
+}
+
 void entry_writer::write(const entry *data)
 {
-  m_sink->write_int(data->which);
-  m_sink->write_int_array(data->offsets, MAX_ENTRY_OFFSETS);
+  static const int zero[MAX_ENTRY_OFFSETS] = {0,};
+  const bool delta = (unsigned int) data->which < ENTRY_PACK_WHICH;
+  const int *last = delta ? m_last[data->which] : zero;
+  unsigned int diff[MAX_ENTRY_OFFSETS];
+  unsigned char mask = 0;
+  int i;
+
+  for (i = 0; i < MAX_ENTRY_OFFSETS; i++)
+  {
+    int d = (int) ((unsigned int) data->offsets[i] - (unsigned int) last[i]);
+    diff[i] = ((unsigned int) d << 1) ^ (unsigned int) (d >> 31);
+    if (diff[i]) mask |= 1 << i;
+  }
+
+  write_varint(m_sink, data->which);
+  m_sink->write_byte(mask);
+  for (i = 0; i < MAX_ENTRY_OFFSETS; i++)
+  {
+    if (diff[i])
+      write_varint(m_sink, diff[i]);
+  }
+
+  if (delta)
+    memcpy(m_last[data->which], data->offsets, sizeof(data->offsets));
+}
+
+void entry_writer::write_block(IGrowBuf *buf, writer_sink *sink)
+{
+  entry *arr = (entry *) buf->get();
+  size_t l = buf->getlen() / sizeof(entry);
+  entry_writer writer(sink);
+  for (size_t i = 0; i < l; i++)
+  {
+    writer.write(&arr[i]);
+  }
 }
 
 void page_writer::write(const page *data)
@@ -156,6 +223,17 @@ void ctlcolors_writer::write(const ctlcolors *data)
   m_sink->write_int(data->flags);
 }
 
+void toc_entry_writer::write(const toc_entry *data)
+{
+  m_sink->write_data(&data->offset,sizeof(data->offset));
+  m_sink->write_data(&data->stored_size,sizeof(data->stored_size));
+  m_sink->write_data(&data->size,sizeof(data->size));
+  m_sink->write_int(data->flags);
+  m_sink->write_int(data->crc);
+  m_sink->write_int(data->name_ptr);
+  m_sink->write_int(data->entry);
+}
+
 void LOGFONT_writer::write(const LOGFONT *data)
 {
   m_sink->write_int(data->lfHeight);
@@ -41,14 +41,29 @@
   }
 
 DECLARE_WRITER(firstheader);
+DECLARE_WRITER(solidheader);
+DECLARE_WRITER(solidblock);
 DECLARE_WRITER(block_header);
 DECLARE_WRITER(header);
 DECLARE_WRITER(section);
-DECLARE_WRITER(entry);
 DECLARE_WRITER(page);
 DECLARE_WRITER(ctlcolors);
+DECLARE_WRITER(toc_entry);
 DECLARE_WRITER(LOGFONT);
 
+// entries are packed, see entry_writer::write()
+class entry_writer : public writer
+{
+public:
+  entry_writer(writer_sink *sink);
+  void write(const entry *data);
+  static void write_block(IGrowBuf *buf, writer_sink *sink);
+
+private:
+  int m_last[ENTRY_PACK_WHICH][MAX_ENTRY_OFFSETS]; // the last entry of each which
+
+};
+
 class lang_table_writer : public writer
 {
 public:
@@ -298,6 +298,14 @@ const TCHAR* StringsArray::get(int idx)
   return (const TCHAR *) m_strings.get() + ((int*) m_offsets.get())[idx];
 }
 
+bool StringsArray::isset(int idx)
+{
+  if (idx < 0 || (unsigned int)idx >= (m_offsets.getlen() / sizeof(int)))
+    return false;
+
+  return ((int*) m_offsets.get())[idx] != 0;
+}
+
 // =========
 // CEXEBuild
 // =========
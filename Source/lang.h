@@ -194,6 +194,14 @@ class StringsArray
 	  */
     const TCHAR *get(int idx);
 
+	 /**
+	  * Checks whether a string was set at index 'idx', even an empty one.
+	  *
+	  * @param idx The logical index to the string.
+	  * @return Returns true if set() was called for idx.
+	  */
+    bool isset(int idx);
+
   private:
     TinyGrowBuf m_offsets; /* Positional offsets of the stored string. */
     GrowBuf     m_strings; /* Storage of the actual strings. */
@@ -29,7 +29,10 @@ LineParser::LineParser(bool bCommentBlock)
   m_incommentblock=bCommentBlock;
   m_incomment=false;
   m_nt=m_eat=0;
-  m_tokens=0;
+  m_tokens=m_tinytokens;
+  m_maxtokens=sizeof(m_tinytokens)/sizeof(*m_tinytokens);
+  m_buf=m_tinybuf;
+  m_bufsize=sizeof(m_tinybuf)/sizeof(*m_tinybuf);
 }
 
 LineParser::~LineParser()
@@ -49,22 +52,17 @@ bool LineParser::inCommentBlock()
 
 int LineParser::parse(TCHAR *line, int ignore_escaping/*=0*/) // returns -1 on error
 {
-  freetokens();
-  bool bPrevCB=m_incommentblock;
-  int n=doline(line, ignore_escaping);
-  if (n) return n;
-  if (m_nt)
+  // a token is never longer than the text it's parsed from, and every one
+  // but the last ends with a space, quote or comment that isn't copied, so
+  // with their terminators they fit in as many TCHARs as the line
+  int len=_tcslen(line)+1;
+  if (len > m_bufsize)
   {
-    m_incommentblock=bPrevCB;
-    m_tokens=(TCHAR**)malloc(sizeof(TCHAR*)*m_nt);
-    n=doline(line, ignore_escaping);
-    if (n)
-    {
-      freetokens();
-      return -1;
-    }
+    if (m_buf != m_tinybuf) free(m_buf);
+    m_buf=(TCHAR*)malloc(len*sizeof(TCHAR));
+    m_bufsize=len;
   }
-  return 0;
+  return doline(line, ignore_escaping);
 }
 
 int LineParser::getnumtokens()
@@ -147,19 +145,16 @@ int LineParser::gettoken_enum(int token, const TCHAR *strlist) // null seperated
 
 void LineParser::freetokens()
 {
-  if (m_tokens)
-  {
-    int x;
-    for (x = 0; x < m_nt; x ++)
-      free(m_tokens[x]);
-    free(m_tokens);
-  }
-  m_tokens=0;
+  if (m_tokens != m_tinytokens) free(m_tokens);
+  if (m_buf != m_tinybuf) free(m_buf);
+  m_tokens=m_tinytokens;
+  m_buf=m_tinybuf;
   m_nt=0;
 }
 
 int LineParser::doline(TCHAR *line, int ignore_escaping/*=0*/)
 {
+  TCHAR *out = m_buf;
   m_nt=0;
   m_incomment = false;
   while (*line == _T(' ') || *line == _T('\t')) line++;
@@ -196,8 +191,7 @@ int LineParser::doline(TCHAR *line, int ignore_escaping/*=0*/)
         else if (*line == _T('\'')) lstate=2;
         else if (*line == _T('`')) lstate=4;
         if (lstate) line++;
-        int nc=0;
-        TCHAR *p = line;
+        TCHAR *tok = out;
         while (*line)
         {
           if (line[0] == _T('$') && line[1] == _T('\\')) {
@@ -205,7 +199,11 @@ int LineParser::doline(TCHAR *line, int ignore_escaping/*=0*/)
               case _T('"'):
               case _T('\''):
               case _T('`'):
-                nc += ignore_escaping ? 3 : 1;
+                if (ignore_escaping) {
+                  *out++ = line[0];
+                  *out++ = line[1];
+                }
+                *out++ = line[2];
                 line += 3;
                 continue;
             }
@@ -217,27 +215,18 @@ int LineParser::doline(TCHAR *line, int ignore_escaping/*=0*/)
 #ifdef NSIS_FIX_COMMENT_HANDLING
           if (!lstate && (*line == _T(';') || *line == _T('#') || (*line == _T('/') && *(line+1) == _T('*')))) break;
 #endif
-          line++;
-          nc++;
+          *out++ = *line++;
         }
-        if (m_tokens)
+        *out++ = 0;
+        if (m_nt == m_maxtokens)
         {
-          int i;
-          m_tokens[m_nt]=(TCHAR*)malloc((nc+1)*sizeof(TCHAR));
-          for (i = 0; p < line; i++, p++) {
-            if (!ignore_escaping && p[0] == _T('$') && p[1] == _T('\\')) {
-              switch (p[2]) {
-                case _T('"'):
-                case _T('\''):
-                case _T('`'):
-                  p += 2;
-              }
-            }
-            m_tokens[m_nt][i] = *p;
-          }
-          m_tokens[m_nt][nc]=0;
+          TCHAR **tokens=(TCHAR**)malloc(sizeof(TCHAR*)*m_maxtokens*2);
+          memcpy(tokens,m_tokens,sizeof(TCHAR*)*m_nt);
+          if (m_tokens != m_tinytokens) free(m_tokens);
+          m_tokens=tokens;
+          m_maxtokens*=2;
         }
-        m_nt++;
+        m_tokens[m_nt++]=tok;
         if (lstate)
         {
           if (*line) line++;
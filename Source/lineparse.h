@@ -22,6 +22,10 @@
 #include "tchar.h"
 
 class LineParser {
+  private: // don't copy instances
+    LineParser(const LineParser&);
+    void operator=(const LineParser&);
+
   public:
 
     LineParser(bool bCommentBlock);
@@ -47,6 +51,13 @@ class LineParser {
     int m_nt;
     bool m_incommentblock;
     bool m_incomment;
-    TCHAR **m_tokens;
+    TCHAR **m_tokens; // point into m_buf
+    int m_maxtokens;
+    TCHAR *m_buf; // the tokens, one after the other
+    int m_bufsize; // in TCHARs
+
+    // most lines fit in these, so parsing them doesn't allocate
+    TCHAR *m_tinytokens[32];
+    TCHAR m_tinybuf[256];
 };
 #endif//_LINEPARSE_H_
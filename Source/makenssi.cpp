@@ -148,6 +148,7 @@ static void print_usage()
          _T("    ") OPT_STR _T("PAUSE pauses after execution\n")
          _T("    ") OPT_STR _T("NOCONFIG disables inclusion of <path to makensis.exe>") PLATFORM_PATH_SEPARATOR_STR _T("nsisconf.nsh\n")
          _T("    ") OPT_STR _T("NOCD disabled the current directory change to that of the .nsi file\n")
+         _T("    ") OPT_STR _T("INCLUDECACHE dir keeps the defines and macros of included files in dir\n")
          _T("    ") OPT_STR _T("Ddefine[=value] defines the symbol \"define\" for the script [to value]\n")
          _T("    ") OPT_STR _T("Xscriptcmd executes scriptcmd in script (i.e. \"") OPT_STR _T("XOutFile poop.exe\")\n")
          _T("   parameters are processed by order (") OPT_STR _T("Ddef ins.nsi != ins.nsi ") OPT_STR _T("Ddef)\n")
@@ -410,6 +411,13 @@ int _tmain(int argc, TCHAR **argv)
         build.warning(OPT_STR _T("NOTIFYHWND is disabled for non Win32 platforms."));
 #endif
       }
+      else if (!_tcsicmp(&argv[argpos][1],_T("INCLUDECACHE")))
+      {
+        if (argpos < argc-1)
+          build.include_cache_dir=argv[++argpos];
+        else
+          build.warning(OPT_STR _T("INCLUDECACHE needs a directory."));
+      }
       else if (!_tcsicmp(&argv[argpos][1],_T("HDRINFO")))
       {
         print_stub_info(build);
@@ -0,0 +1,230 @@
+/*
+ * pipeline.c
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include "pipeline.h"
+
+// counters and flags read by the other side without waiting
+
+#ifdef _WIN32
+#  define ATOMIC_GET(p) InterlockedCompareExchange((LONG volatile *)(p), 0, 0)
+#  define ATOMIC_SET(p, v) InterlockedExchange((LONG volatile *)(p), (v))
+#else
+#  define ATOMIC_GET(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#  define ATOMIC_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+// semaphores
+
+#ifdef _WIN32
+
+static int NSISCALL sem_init_(pipe_sem *s, int count)
+{
+  s->h = CreateSemaphore(NULL, count, PIPE_MAX_SLOTS + 1, NULL);
+  return s->h != NULL;
+}
+
+static void NSISCALL sem_free_(pipe_sem *s)
+{
+  if (s->h) CloseHandle(s->h);
+  s->h = NULL;
+}
+
+static void NSISCALL sem_wait_(pipe_sem *s)
+{
+  WaitForSingleObject(s->h, INFINITE);
+}
+
+static void NSISCALL sem_post_(pipe_sem *s)
+{
+  ReleaseSemaphore(s->h, 1, NULL);
+}
+
+#else
+
+static int NSISCALL sem_init_(pipe_sem *s, int count)
+{
+  s->count = count;
+  if (pthread_mutex_init(&s->m, NULL))
+    return 0;
+  if (pthread_cond_init(&s->c, NULL))
+  {
+    pthread_mutex_destroy(&s->m);
+    return 0;
+  }
+  return 1;
+}
+
+static void NSISCALL sem_free_(pipe_sem *s)
+{
+  pthread_cond_destroy(&s->c);
+  pthread_mutex_destroy(&s->m);
+}
+
+static void NSISCALL sem_wait_(pipe_sem *s)
+{
+  pthread_mutex_lock(&s->m);
+  while (!s->count)
+    pthread_cond_wait(&s->c, &s->m);
+  s->count--;
+  pthread_mutex_unlock(&s->m);
+}
+
+static void NSISCALL sem_post_(pipe_sem *s)
+{
+  pthread_mutex_lock(&s->m);
+  s->count++;
+  pthread_cond_signal(&s->c);
+  pthread_mutex_unlock(&s->m);
+}
+
+#endif
+
+// queues
+//
+// free counts the empty buffers, filled the queued ones. pipe_close() and
+// pipe_abort() post once more to wake the other side up, which then finds
+// no buffer behind it and posts again for the next call.
+
+int NSISCALL pipe_init(pipe_queue *q, char *mem, int num, unsigned int size)
+{
+  int i;
+
+  if (num < 1 || num > PIPE_MAX_SLOTS) return 0;
+
+  for (i = 0; i < num; i++)
+  {
+    q->buf[i] = mem + i * size;
+    q->len[i] = 0;
+  }
+  q->size = size;
+  q->num = num;
+  q->puts = q->gets = 0;
+  q->err = q->aborted = 0;
+
+  if (!sem_init_(&q->free, num)) return 0;
+  if (!sem_init_(&q->filled, 0))
+  {
+    sem_free_(&q->free);
+    return 0;
+  }
+  return 1;
+}
+
+void NSISCALL pipe_free(pipe_queue *q)
+{
+  sem_free_(&q->free);
+  sem_free_(&q->filled);
+}
+
+char * NSISCALL pipe_get_free(pipe_queue *q)
+{
+  sem_wait_(&q->free);
+  if (ATOMIC_GET(&q->aborted))
+  {
+    sem_post_(&q->free); // for the next call
+    return NULL;
+  }
+  return q->buf[q->puts % q->num];
+}
+
+void NSISCALL pipe_put(pipe_queue *q, unsigned int len)
+{
+  q->len[q->puts % q->num] = len;
+  ATOMIC_SET(&q->puts, q->puts + 1);
+  sem_post_(&q->filled);
+}
+
+void NSISCALL pipe_close(pipe_queue *q, int err)
+{
+  q->err = err;
+  sem_post_(&q->filled);
+}
+
+char * NSISCALL pipe_get_filled(pipe_queue *q, unsigned int *len)
+{
+  int i;
+  sem_wait_(&q->filled);
+  // the buffers put before pipe_close() are taken first
+  if (q->gets == ATOMIC_GET(&q->puts))
+  {
+    sem_post_(&q->filled); // for the next call
+    return NULL;
+  }
+  i = q->gets % q->num;
+  *len = q->len[i];
+  return q->buf[i];
+}
+
+void NSISCALL pipe_release(pipe_queue *q)
+{
+  q->gets++;
+  sem_post_(&q->free);
+}
+
+void NSISCALL pipe_abort(pipe_queue *q)
+{
+  ATOMIC_SET(&q->aborted, 1);
+  sem_post_(&q->free);
+}
+
+// threads
+
+#ifdef _WIN32
+
+static DWORD WINAPI pipe_thread_proc(LPVOID p)
+{
+  pipe_thread *t = (pipe_thread *) p;
+  t->fn(t->ctx);
+  return 0;
+}
+
+int NSISCALL pipe_start(pipe_thread *t, pipe_thread_fn fn, void *ctx)
+{
+  DWORD tid;
+  t->fn = fn;
+  t->ctx = ctx;
+  t->h = CreateThread(NULL, 0, pipe_thread_proc, t, 0, &tid);
+  return t->h != NULL;
+}
+
+void NSISCALL pipe_join(pipe_thread *t)
+{
+  WaitForSingleObject(t->h, INFINITE);
+  CloseHandle(t->h);
+}
+
+#else
+
+static void *pipe_thread_proc(void *p)
+{
+  pipe_thread *t = (pipe_thread *) p;
+  t->fn(t->ctx);
+  return NULL;
+}
+
+int NSISCALL pipe_start(pipe_thread *t, pipe_thread_fn fn, void *ctx)
+{
+  t->fn = fn;
+  t->ctx = ctx;
+  return !pthread_create(&t->t, NULL, pipe_thread_proc, t);
+}
+
+void NSISCALL pipe_join(pipe_thread *t)
+{
+  pthread_join(t->t, NULL);
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * pipeline.h
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include "Platform.h"
+
+#ifndef ___PIPELINE__H___
+#define ___PIPELINE__H___
+
+// bounded queues of buffers and threads, so reading, decoding and writing
+// the data of a file can overlap. used by _dodecomp() in the exehead and by
+// the reader. nothing is allocated, the caller provides the memory, and on
+// Windows nothing but kernel32 is used.
+
+#ifndef _WIN32
+#  include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPE_MAX_SLOTS 8
+
+typedef struct
+{
+#ifdef _WIN32
+  HANDLE h;
+#else
+  pthread_mutex_t m;
+  pthread_cond_t c;
+  int count;
+#endif
+} pipe_sem;
+
+// a ring of buffers filled by one thread and emptied by another
+typedef struct
+{
+  char *buf[PIPE_MAX_SLOTS];
+  unsigned int len[PIPE_MAX_SLOTS];
+  unsigned int size; // of each buffer
+  int num;
+  int puts; // buffers put so far, written by the producer only
+  int gets; // buffers taken so far, written by the consumer only
+  int err; // why the producer closed the queue
+  int aborted; // the consumer gave up
+  pipe_sem free, filled;
+} pipe_queue;
+
+/**
+ * Splits mem into num buffers of size bytes. num can't be more than
+ * PIPE_MAX_SLOTS. Returns nonzero on success.
+ */
+int NSISCALL pipe_init(pipe_queue *q, char *mem, int num, unsigned int size);
+void NSISCALL pipe_free(pipe_queue *q);
+
+/**
+ * Producer side. pipe_get_free() waits for an empty buffer and returns it,
+ * or NULL from then on once the consumer called pipe_abort(). pipe_put()
+ * queues the buffer with len bytes in it. pipe_close() ends the data, err
+ * is passed on to the consumer.
+ */
+char * NSISCALL pipe_get_free(pipe_queue *q);
+void NSISCALL pipe_put(pipe_queue *q, unsigned int len);
+void NSISCALL pipe_close(pipe_queue *q, int err);
+
+/**
+ * Consumer side. pipe_get_filled() waits for the next buffer and returns
+ * it, or NULL from then on once the queue is closed and empty, q->err tells
+ * why. pipe_release() hands the buffer back to the producer. pipe_abort()
+ * tells the producer no more buffers will be taken.
+ */
+char * NSISCALL pipe_get_filled(pipe_queue *q, unsigned int *len);
+void NSISCALL pipe_release(pipe_queue *q);
+void NSISCALL pipe_abort(pipe_queue *q);
+
+typedef void (NSISCALL *pipe_thread_fn)(void *ctx);
+
+typedef struct
+{
+  pipe_thread_fn fn;
+  void *ctx;
+#ifdef _WIN32
+  HANDLE h;
+#else
+  pthread_t t;
+#endif
+} pipe_thread;
+
+/**
+ * Runs fn(ctx) on a new thread. Returns nonzero on success, t must then be
+ * passed to pipe_join().
+ */
+int NSISCALL pipe_start(pipe_thread *t, pipe_thread_fn fn, void *ctx);
+void NSISCALL pipe_join(pipe_thread *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//!___PIPELINE__H___
@@ -0,0 +1,1115 @@
+/*
+ * nsis-extract.c
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+// lists, verifies and extracts the files of a built installer and its data
+// volumes on any platform, and reports how fast it went.
+
+#include "reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef min
+#  define min(a,b) (((a)<(b))?(a):(b))
+#endif
+
+#ifdef _WIN32
+#  include <direct.h>
+#  define MKDIR(x) _mkdir(x)
+#else
+#  include <sys/stat.h>
+#  include <sys/time.h>
+#  include <unistd.h>
+#  define MKDIR(x) mkdir(x, 0755)
+#endif
+
+static double get_time()
+{
+#ifdef _WIN32
+  return GetTickCount() / 1000.0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+static void print_speed(const char *what, __int64 bytes, double seconds)
+{
+  double mb = bytes / (1024.0 * 1024.0);
+  if (seconds <= 0)
+    seconds = 0.000001;
+  printf("%s: %.1f MB in %.2f s, %.1f MB/s\n", what, mb, seconds, mb / seconds);
+}
+
+// a disk that reads read_rate bytes per second, for bench
+static double read_rate;
+static nsis_io slow_io;
+
+static int slow_read(void *f, void *buf, unsigned int len)
+{
+  double seconds = len / read_rate;
+#ifdef _WIN32
+  Sleep((DWORD) (seconds * 1000));
+#else
+  usleep((useconds_t) (seconds * 1000000));
+#endif
+  return nsis_stdio.read(f, buf, len);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+    "Usage: nsis-extract <command> installer [output directory] [file ...]\n"
+    "       nsis-extract bench installer [read MB/s]\n"
+    "       nsis-extract stress installer [rounds]\n"
+    "       nsis-extract selftest directory\n"
+    "  list     lists the files of the installer, without decompressing them\n"
+    "           if it has a table of contents (SetTOC on)\n"
+    "  verify   checks the crc of the installer, its data files and every blob\n"
+    "  extract  extracts the files of the installer, to the current directory\n"
+    "           unless an output directory is given, or only the files named\n"
+    "           as File wrote them (found through the table of contents if any)\n"
+    "  bench    checks the crc of the data files on 1 and 4 threads, decompresses\n"
+    "           every compressed blob in memory with lzmaDecode()\n"
+    "           as _dodecomp() streams it and with lzmaDecodeMem(), then\n"
+    "           extracts every blob to a temporary file, serially and through\n"
+    "           the read/decode/write pipeline, and with blobs decoded ahead\n"
+    "           on threads, the way runs of File instructions are extracted, and\n"
+    "           once more with smaller buffers. reads can be slowed down to\n"
+    "           the given speed, as on a slow disk or network share\n"
+    "  stress   extracts the blobs decoded ahead over and over, skipping and\n"
+    "           going back at random, and compares them with nsis_extract()\n"
+    "  selftest writes an installer to the directory and checks that a byte\n"
+    "           flipped in any of its blobs fails verify and extract with a\n"
+    "           crc error, and that a stream cut short fails extract and bench\n"
+    "           as corrupted\n");
+}
+
+static int write_null(void *ctx, const void *data, unsigned int len)
+{
+  return 1;
+}
+
+static int write_file(void *ctx, const void *data, unsigned int len)
+{
+  return fwrite(data, 1, len, (FILE *) ctx) == len;
+}
+
+// the name of an extracted file, relative to $OUTDIR unless it is absolute
+static void get_file_name(nsis_reader *r, const entry *e, const char *outdir, char *buf, int buflen)
+{
+  char name[NSIS_MAX_STRLEN];
+
+  nsis_string(r, e->offsets[1], name, sizeof(name));
+  if (name[0] == '$' || name[0] == '\\' || (name[0] && name[1] == ':'))
+    snprintf(buf, buflen, "%s", name);
+  else
+    snprintf(buf, buflen, "%s\\%s", outdir, name);
+}
+
+// turns an installer path into a path under dir, without drive letters or
+// parent directory references
+static void get_output_path(const char *dir, const char *name, char *buf, int buflen)
+{
+  int n = snprintf(buf, buflen, "%s", dir);
+  const char *p = name;
+
+  while (*p && n < buflen - 1)
+  {
+    const char *end = p;
+    int len;
+
+    while (*end && *end != '\\' && *end != '/')
+      end++;
+    len = (int) (end - p);
+
+    if (len && !(len == 1 && p[0] == '.') && !(len == 2 && p[0] == '.' && p[1] == '.'))
+    {
+      int i;
+      buf[n++] = '/';
+      for (i = 0; i < len && n < buflen - 1; i++)
+        buf[n++] = p[i] == ':' ? '_' : p[i];
+    }
+
+    p = *end ? end + 1 : end;
+  }
+  buf[n] = 0;
+}
+
+static int create_dirs(char *path)
+{
+  char *p;
+  for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+  {
+    *p = 0;
+    if (MKDIR(path) && errno != EEXIST)
+    {
+      *p = '/';
+      return 0;
+    }
+    *p = '/';
+  }
+  return 1;
+}
+
+static int do_list(nsis_reader *r)
+{
+  const entry *entries = nsis_entries(r);
+  char outdir[NSIS_MAX_STRLEN] = "$INSTDIR";
+  char name[NSIS_MAX_STRLEN * 2];
+  int i, t, files = 0;
+
+  printf("%14s %14s  %s\n", "Size", "Stored", "Name");
+  for (i = 0; i < nsis_num_entries(r); i++)
+  {
+    const entry *e = &entries[i];
+
+    if (e->which == EW_CREATEDIR && e->offsets[1])
+      nsis_string(r, e->offsets[0], outdir, sizeof(outdir));
+    else if (e->which == EW_EXTRACTFILE)
+    {
+      __int64 offset = MAKEQWORD(e->offsets[2], e->offsets[6]);
+      __int64 stored, size;
+      int compressed;
+      crc32_t crc;
+      int err = nsis_blob_info(r, offset, &stored, &compressed, &crc);
+
+      get_file_name(r, e, outdir, name, sizeof(name));
+      if (err)
+      {
+        printf("%s: %s\n", name, nsis_strerror(err));
+        return 1;
+      }
+
+      // the size of compressed files is only known once decompressed,
+      // unless the table of contents has it
+      t = nsis_toc_lookup(r, offset, NULL);
+      if (t >= 0)
+        size = nsis_toc(r)[t].size;
+      else
+        size = compressed ? nsis_extract(r, offset, write_null, NULL) : stored;
+      if (size < 0)
+        printf("%14s %14lld  %s (%s)\n", "?", stored, name, nsis_strerror((int) size));
+      else
+        printf("%14lld %14lld  %s\n", size, stored, name);
+      files++;
+    }
+  }
+  printf("%d files\n", files);
+
+  if (nsis_toc_num(r))
+  {
+    const toc_entry *toc = nsis_toc(r);
+    __int64 saved = 0;
+    int blobs = 0, refs;
+
+    // files the datablock optimizer stored once
+    for (i = 0; i < nsis_toc_num(r); i++)
+    {
+      if (nsis_toc_lookup(r, toc[i].offset, &refs) == i)
+      {
+        saved += (refs - 1) * (toc[i].stored_size + BLOB_HEADER_SIZE);
+        blobs++;
+      }
+    }
+    printf("table of contents: %d files in %d blobs, %lld bytes saved by sharing\n",
+      nsis_toc_num(r), blobs, saved);
+  }
+  return 0;
+}
+
+static int do_verify(nsis_reader *r)
+{
+  __int64 offset = 0, size = 0, read_bytes;
+  int blobs = 0, err;
+  double t;
+
+  t = get_time();
+  err = nsis_verify_crc(r, &read_bytes);
+  if (err)
+  {
+    printf("installer crc: %s\n", nsis_strerror(err));
+    return 1;
+  }
+  if (read_bytes)
+    print_speed("crc", read_bytes, get_time() - t);
+
+  t = get_time();
+  while (offset < r->db_length)
+  {
+    __int64 stored, ret;
+    int compressed;
+    crc32_t crc;
+
+    err = nsis_blob_info(r, offset, &stored, &compressed, &crc);
+    ret = err ? err : nsis_extract(r, offset, write_null, NULL);
+    if (ret < 0)
+    {
+      printf("blob at %lld: %s\n", offset, nsis_strerror((int) ret));
+      return 1;
+    }
+
+    size += ret;
+    offset += BLOB_HEADER_SIZE + stored;
+    blobs++;
+  }
+
+  printf("%d blobs ok\n", blobs);
+  if (r->num_volumes)
+    printf("%d data files, opened %d times\n", r->num_volumes, r->volume_opens);
+  print_speed("read", r->db_length, get_time() - t);
+  print_speed("decompressed", size, get_time() - t);
+  return 0;
+}
+
+#define EXTRACT_JOBS 4 // files decoded ahead
+
+// marks the EW_EXTRACTFILE entries of the files named in names, through the
+// table of contents if there is one. returns nonzero if all were found.
+static int select_files(nsis_reader *r, char **names, int num_names, char *selected)
+{
+  const entry *entries = nsis_entries(r);
+  char name[NSIS_MAX_STRLEN];
+  int i, j, ret = 1;
+
+  for (j = 0; j < num_names; j++)
+  {
+    int found = 0;
+
+    if (nsis_toc_num(r))
+    {
+      int t;
+      for (t = nsis_toc_find(r, names[j], -1); t >= 0; t = nsis_toc_find(r, names[j], t))
+      {
+        int e = nsis_toc(r)[t].entry;
+        if (e >= 0 && e < nsis_num_entries(r) && entries[e].which == EW_EXTRACTFILE)
+          selected[e] = found = 1;
+      }
+    }
+    else
+    {
+      for (i = 0; i < nsis_num_entries(r); i++)
+      {
+        if (entries[i].which != EW_EXTRACTFILE)
+          continue;
+        nsis_string(r, entries[i].offsets[1], name, sizeof(name));
+        if (nsis_same_name(name, names[j]))
+          selected[i] = found = 1;
+      }
+    }
+
+    if (!found)
+    {
+      printf("%s: no such file\n", names[j]);
+      ret = 0;
+    }
+  }
+  return ret;
+}
+
+static int do_extract(nsis_reader *r, const char *dir, char **names, int num_names)
+{
+  const entry *entries = nsis_entries(r);
+  char outdir[NSIS_MAX_STRLEN] = "$INSTDIR";
+  char name[NSIS_MAX_STRLEN * 2];
+  char path[NSIS_MAX_STRLEN * 3];
+  __int64 size = 0, *offsets;
+  char *selected;
+  nsis_prefetch p;
+  int i, files = 0, ret = 0;
+  double t = get_time();
+
+  // the files are extracted in order, as one run
+  offsets = (__int64 *) malloc(sizeof(__int64) * (nsis_num_entries(r) + 1));
+  selected = (char *) malloc(nsis_num_entries(r) + 1);
+  if (!offsets || !selected)
+  {
+    printf("%s\n", nsis_strerror(NSIS_E_MEMORY));
+    free(offsets);
+    free(selected);
+    return 1;
+  }
+  memset(selected, !num_names, nsis_num_entries(r) + 1);
+  if (num_names && !select_files(r, names, num_names, selected))
+  {
+    free(offsets);
+    free(selected);
+    return 1;
+  }
+  for (i = 0; i < nsis_num_entries(r); i++)
+  {
+    const entry *e = &entries[i];
+    if (e->which == EW_EXTRACTFILE && selected[i])
+      offsets[files++] = MAKEQWORD(e->offsets[2], e->offsets[6]);
+  }
+  nsis_prefetch_begin(&p, r, offsets, files, EXTRACT_JOBS);
+  files = 0;
+
+  for (i = 0; i < nsis_num_entries(r) && !ret; i++)
+  {
+    const entry *e = &entries[i];
+
+    if (e->which == EW_CREATEDIR && e->offsets[1])
+      nsis_string(r, e->offsets[0], outdir, sizeof(outdir));
+    else if (e->which == EW_EXTRACTFILE && selected[i])
+    {
+      FILE *fp;
+      __int64 len;
+
+      get_file_name(r, e, outdir, name, sizeof(name));
+      get_output_path(dir, name, path, sizeof(path));
+
+      if (!create_dirs(path) || (fp = fopen(path, "wb")) == NULL)
+      {
+        printf("%s: can't create file\n", path);
+        ret = 1;
+        break;
+      }
+      len = nsis_prefetch_extract(&p, files, write_file, fp);
+      if (fclose(fp) && len >= 0)
+        len = NSIS_E_WRITE;
+      if (len < 0)
+      {
+        printf("%s: %s\n", path, nsis_strerror((int) len));
+        ret = 1;
+        break;
+      }
+
+      size += len;
+      files++;
+    }
+  }
+
+  nsis_prefetch_end(&p);
+  free(offsets);
+  free(selected);
+  if (ret)
+    return ret;
+
+  printf("%d files extracted\n", files);
+  print_speed("extracted", size, get_time() - t);
+  return 0;
+}
+
+#define BENCH_IBUFSIZE (16384*32)
+#define BENCH_OBUFSIZE (32768*32)
+
+// decodes in and returns the crc of the output, or -1 on errors
+static __int64 bench_stream(lzma_stream *s, char *in, unsigned int len, char *obuf, __int64 *size)
+{
+  crc32_t crc = 0;
+  int err = LZMA_OK;
+
+  *size = 0;
+  lzmaInit(s);
+  while (len && err == LZMA_OK)
+  {
+    unsigned int l = min(len, BENCH_IBUFSIZE);
+    s->next_in = (Byte *) in;
+    s->avail_in = l;
+    in += l;
+    len -= l;
+
+    for (;;)
+    {
+      unsigned int u;
+      s->next_out = (Byte *) obuf;
+      s->avail_out = BENCH_OBUFSIZE;
+      err = lzmaDecode(s);
+      if (err < 0)
+        return -1;
+      u = (unsigned int) ((char *) s->next_out - obuf);
+      if (!u)
+        break;
+      crc = CRC32(crc, (unsigned char *) obuf, u);
+      *size += u;
+      if (err == LZMA_STREAM_END)
+        break;
+    }
+  }
+  return err == LZMA_STREAM_END ? (__int64) crc : -1;
+}
+
+struct crc_writer
+{
+  FILE *fp; // may be NULL
+  crc32_t crc;
+};
+
+static int write_crc(void *ctx, const void *data, unsigned int len)
+{
+  struct crc_writer *w = (struct crc_writer *) ctx;
+  w->crc = CRC32(w->crc, (const unsigned char *) data, len);
+  return !w->fp || fwrite(data, 1, len, w->fp) == len;
+}
+
+// the offsets of every blob in the datablock, returns how many or -1
+static int get_blobs(nsis_reader *r, __int64 **offsets)
+{
+  __int64 offset = 0;
+  int num = 0, alloc = 0;
+
+  *offsets = NULL;
+  while (offset < r->db_length)
+  {
+    __int64 stored;
+    int compressed, err;
+    crc32_t crc;
+
+    err = nsis_blob_info(r, offset, &stored, &compressed, &crc);
+    if (err)
+    {
+      printf("blob at %lld: %s\n", offset, nsis_strerror(err));
+      free(*offsets);
+      return -1;
+    }
+    if (num == alloc)
+    {
+      __int64 *p = (__int64 *) realloc(*offsets, sizeof(__int64) * (alloc = alloc * 2 + 64));
+      if (!p)
+      {
+        free(*offsets);
+        return -1;
+      }
+      *offsets = p;
+    }
+    (*offsets)[num++] = offset;
+    offset += BLOB_HEADER_SIZE + stored;
+  }
+  return num;
+}
+
+enum { BENCH_SERIAL, BENCH_PIPELINED, BENCH_PREFETCH };
+
+// extracts every blob to a temporary file, returns the time it took
+static double bench_extract(nsis_reader *r, const __int64 *offsets, int num, int how, crc32_t *crc, __int64 *size)
+{
+  struct crc_writer w;
+  nsis_prefetch p;
+  double t = get_time();
+  int i;
+
+  w.fp = tmpfile();
+  w.crc = 0;
+  *size = 0;
+  if (how == BENCH_PREFETCH)
+    nsis_prefetch_begin(&p, r, offsets, num, EXTRACT_JOBS);
+  for (i = 0; w.fp && i < num; i++)
+  {
+    __int64 ret;
+
+    if (how == BENCH_PREFETCH)
+      ret = nsis_prefetch_extract(&p, i, write_crc, &w);
+    else if (how == BENCH_PIPELINED)
+      ret = nsis_extract_pipelined(r, offsets[i], write_crc, &w);
+    else
+      ret = nsis_extract(r, offsets[i], write_crc, &w);
+    if (ret < 0)
+    {
+      printf("blob at %lld: %s\n", offsets[i], nsis_strerror((int) ret));
+      *size = -1;
+      break;
+    }
+    *size += ret;
+  }
+  if (how == BENCH_PREFETCH)
+    nsis_prefetch_end(&p);
+  if (w.fp)
+  {
+    fflush(w.fp);
+    fclose(w.fp);
+  }
+  else
+    *size = -1;
+
+  *crc = w.crc;
+  return get_time() - t;
+}
+
+#define BENCH_DIFFERS -100 // the decoders disagree
+
+// decodes the compressed blob at offset with lzmaDecode(), as _dodecomp()
+// streams it, and with lzmaDecodeMem(), returns its size or an error
+static __int64 bench_decode(nsis_reader *r, __int64 offset, lzma_stream *s, char *obuf, double *t_stream, double *t_mem)
+{
+  __int64 stored, crc, len;
+  int compressed, err;
+  crc32_t blob_crc;
+  char *in, *out;
+  double t;
+
+  err = nsis_blob_info(r, offset, &stored, &compressed, &blob_crc);
+  if (err)
+    return err;
+  in = (char *) malloc((size_t) stored);
+  if (!in)
+    return NSIS_E_MEMORY;
+  err = nsis_read_blob(r, offset, in);
+  if (err)
+  {
+    free(in);
+    return err;
+  }
+
+  t = get_time();
+  crc = bench_stream(s, in, (unsigned int) stored, obuf, &len);
+  *t_stream += get_time() - t;
+  if (crc < 0)
+  {
+    free(in);
+    return NSIS_E_DECOMPRESS;
+  }
+
+  out = (char *) malloc((size_t) len + 1);
+  if (!out)
+  {
+    free(in);
+    return NSIS_E_MEMORY;
+  }
+
+  t = get_time();
+  s->next_in = (Byte *) in;
+  s->avail_in = (unsigned int) stored;
+  s->next_out = (Byte *) out;
+  s->avail_out = (unsigned int) len;
+  err = lzmaDecodeMem(s);
+  *t_mem += get_time() - t;
+
+  if (err != LZMA_STREAM_END || s->avail_out || CRC32(0, (unsigned char *) out, (unsigned int) len) != crc)
+    len = BENCH_DIFFERS;
+  free(in);
+  free(out);
+  return len;
+}
+
+static int do_bench(nsis_reader *r)
+{
+  lzma_stream s;
+  __int64 offset = 0, size = 0;
+  double t_stream = 0, t_mem = 0;
+  char *obuf = (char *) malloc(BENCH_OBUFSIZE);
+  int blobs = 0, ret = 0;
+
+  // data volumes checked one at a time and in parallel
+  if (r->num_volumes)
+  {
+    int threads = r->verify_threads;
+    __int64 read_bytes;
+    double t;
+    int i;
+
+    for (i = 0; i < 2 && !ret; i++)
+    {
+      r->verify_threads = i ? threads : 1;
+      read_bytes = 0;
+      t = get_time();
+      if (nsis_verify_crc(r, &read_bytes))
+      {
+        printf("crc check failed\n");
+        ret = 1;
+      }
+      else
+      {
+        char what[64];
+        sprintf(what, "crc, %d thread%s", r->verify_threads, r->verify_threads > 1 ? "s" : "");
+        print_speed(what, read_bytes, get_time() - t);
+      }
+    }
+    r->verify_threads = threads;
+  }
+
+  memset(&s, 0, sizeof(s));
+  while (offset < r->db_length && !ret)
+  {
+    __int64 stored, len;
+    int compressed, err;
+    crc32_t blob_crc;
+
+    err = nsis_blob_info(r, offset, &stored, &compressed, &blob_crc);
+    len = err ? err : compressed ? bench_decode(r, offset, &s, obuf, &t_stream, &t_mem) : 0;
+    if (len < 0)
+    {
+      printf("blob at %lld: %s\n", offset, len == BENCH_DIFFERS ? "lzmaDecodeMem() output differs" : nsis_strerror((int) len));
+      ret = 1;
+    }
+    else if (compressed)
+    {
+      size += len;
+      blobs++;
+    }
+    offset += BLOB_HEADER_SIZE + stored;
+  }
+
+  lzmafree(s.dictionary);
+  lzmafree(s.dynamicData);
+  free(obuf);
+
+  if (!ret)
+  {
+    static const char *names[] = { "extract", "extract pipelined", "extract prefetched" };
+    crc32_t crc[3];
+    __int64 len[3], *offsets;
+    double t[3];
+    int num = get_blobs(r, &offsets);
+    int i;
+
+    printf("%d compressed blobs\n", blobs);
+    print_speed("lzmaDecode", size, t_stream);
+    print_speed("lzmaDecodeMem", size, t_mem);
+
+    for (i = BENCH_SERIAL; i <= BENCH_PREFETCH && num >= 0 && !ret; i++)
+    {
+      t[i] = bench_extract(r, offsets, num, i, &crc[i], &len[i]);
+      if (len[i] < 0)
+        ret = 1;
+      else if (len[i] != len[0] || crc[i] != crc[0])
+      {
+        printf("%s output differs\n", names[i]);
+        ret = 1;
+      }
+      else
+        print_speed(names[i], len[i], t[i]);
+    }
+    // smaller buffers, as a stub variant with a smaller NSIS_IBUFSIZE and
+    // NSIS_OBUFSIZE would use
+    printf("buffers: %u KB of %u KB\n", (r->ibufsize + r->obufsize) / 1024, (NSIS_IBUFSIZE + NSIS_OBUFSIZE) / 1024);
+    for (i = 32; i <= 2048 && num >= 0 && !ret; i *= 4)
+    {
+      unsigned int size = (NSIS_IBUFSIZE + NSIS_OBUFSIZE) * i / 2048;
+      char what[64];
+      int how;
+
+      if (nsis_set_buffers(r, size))
+      {
+        printf("%s\n", nsis_strerror(NSIS_E_MEMORY));
+        ret = 1;
+        break;
+      }
+      for (how = BENCH_SERIAL; how <= BENCH_PIPELINED && !ret; how++)
+      {
+        t[how] = bench_extract(r, offsets, num, how, &crc[how], &len[how]);
+        if (len[how] != len[0] || crc[how] != crc[0])
+          ret = 1;
+        sprintf(what, "%s, %u KB buffers", names[how], (r->ibufsize + r->obufsize) / 1024);
+        print_speed(what, len[how], t[how]);
+      }
+    }
+    if (nsis_set_buffers(r, NSIS_IBUFSIZE + NSIS_OBUFSIZE))
+      ret = 1;
+
+    if (num < 0)
+      ret = 1;
+    free(offsets);
+  }
+  return ret;
+}
+
+// extracts the blobs decoded ahead with random skips and jumps back, with
+// every number of jobs, and compares them with what nsis_extract() returns
+static int do_stress(nsis_reader *r, int rounds)
+{
+  __int64 *offsets, *sizes;
+  crc32_t *crcs;
+  struct crc_writer w;
+  int num = get_blobs(r, &offsets);
+  int i, round, extracted = 0, ret = 0;
+
+  if (num < 0)
+    return 1;
+  sizes = (__int64 *) malloc(sizeof(__int64) * (num + 1));
+  crcs = (crc32_t *) malloc(sizeof(crc32_t) * (num + 1));
+  if (!sizes || !crcs)
+    ret = 1;
+
+  w.fp = NULL;
+  for (i = 0; i < num && !ret; i++)
+  {
+    w.crc = 0;
+    sizes[i] = nsis_extract(r, offsets[i], write_crc, &w);
+    crcs[i] = w.crc;
+  }
+
+  srand(1);
+  for (round = 0; round < rounds && !ret; round++)
+  {
+    nsis_prefetch p;
+    int jobs = round % NSIS_PREFETCH_JOBS + 1;
+
+    nsis_prefetch_begin(&p, r, offsets, num, jobs);
+    for (i = 0; i < num && !ret; i++)
+    {
+      __int64 len;
+
+      // skip a few, as files that exist already, or go back, as a loop
+      if (rand() % 4 == 0)
+        i += rand() % 3;
+      else if (rand() % 16 == 0)
+      {
+        int back = rand() % 3; // min() would call rand() twice
+        i -= min(i, back);
+      }
+      if (i >= num)
+        break;
+
+      w.crc = 0;
+      len = nsis_prefetch_extract(&p, i, write_crc, &w);
+      if (len != sizes[i] || (len >= 0 && w.crc != crcs[i]))
+      {
+        printf("blob at %lld, %d jobs: %s\n", offsets[i], jobs, len < 0 ? nsis_strerror((int) len) : "output differs");
+        ret = 1;
+      }
+      extracted++;
+    }
+    nsis_prefetch_end(&p);
+  }
+
+  if (!ret)
+    printf("%d blobs, %d rounds, %d extracted ok\n", num, rounds, extracted);
+  free(offsets);
+  free(sizes);
+  free(crcs);
+  return ret;
+}
+
+// an lzma stream of SELFTEST_TEXT written 64 times, with an end marker
+#define SELFTEST_TEXT "0123456789abcdef"
+static const unsigned char selftest_lzma[] =
+{
+  0x5d, 0x00, 0x00, 0x01, 0x00, 0x00, 0x18, 0x0c, 0x42, 0x92, 0x6a, 0x67, 0xbc,
+  0x0e, 0xd1, 0x33, 0x2c, 0xe4, 0xcc, 0x42, 0x29, 0xc0, 0x9c, 0x4a, 0x8f, 0x7e,
+  0xff, 0xb6, 0xfe, 0xcc, 0x65, 0x87, 0x9f, 0x67, 0xff, 0xfe, 0x56, 0x88, 0x00
+};
+
+#define SELFTEST_STORED 8192 // size of stored data, more than one read
+#define SELFTEST_BLOBS 3
+
+struct selftest_blob
+{
+  const char *what;
+  __int64 offset; // in the datablock
+  __int64 size; // extracted
+  crc32_t crc; // of the extracted data
+  int flip; // the byte of the stored data corrupted
+};
+
+// appends a blob to buf, returns its offset
+static int selftest_add_blob(char *buf, int *len, const char *data, int size, int compressed)
+{
+  __int64 l = size | (compressed ? COMPRESSED_FLAG_MARK : 0);
+  crc32_t crc = CRC32(0, (const unsigned char *) data, size);
+  int offset = *len;
+
+  memcpy(buf + *len, &l, sizeof(__int64));
+  memcpy(buf + *len + sizeof(__int64), &crc, sizeof(crc32_t));
+  memcpy(buf + *len + BLOB_HEADER_SIZE, data, size);
+  *len += BLOB_HEADER_SIZE + size;
+  return offset;
+}
+
+// an installer without entries, whose datablock holds a stored blob, an
+// lzma blob and an lzma blob with stored data after the end of its stream,
+// as _dodecomp() has to check too
+static char *selftest_installer(struct selftest_blob *blobs, int *len, int *db_offset)
+{
+  int size = 512 + sizeof(firstheader) + HEADER_PARTS * BLOB_HEADER_SIZE + sizeof(header) +
+    SELFTEST_BLOBS * BLOB_HEADER_SIZE + 2 * SELFTEST_STORED + 2 * sizeof(selftest_lzma) + sizeof(crc32_t);
+  char *buf = (char *) calloc(size, 1);
+  char *stored = (char *) malloc(SELFTEST_STORED + sizeof(selftest_lzma));
+  char text[sizeof(SELFTEST_TEXT) * 64];
+  firstheader fh;
+  header h;
+  crc32_t crc;
+  int i, fh_offset = 512;
+
+  if (!buf || !stored)
+  {
+    free(buf);
+    free(stored);
+    return NULL;
+  }
+
+  // the header, all of it in the first part
+  memset(&h, 0, sizeof(h));
+  h.blocks[NB_ENTRIES].offset = h.blocks[NB_STRINGS].offset = h.blocks[NB_LANGTABLES].offset = sizeof(header);
+  *len = fh_offset + sizeof(firstheader);
+  selftest_add_blob(buf, len, (char *) &h, sizeof(header), 0);
+  for (i = 1; i < HEADER_PARTS; i++)
+    selftest_add_blob(buf, len, NULL, 0, 0);
+  *db_offset = *len;
+
+  for (i = 0; i < SELFTEST_STORED; i++)
+    stored[i] = (char) (i * 7 + i / 251);
+  for (i = 0; i < 64; i++)
+    memcpy(text + i * (sizeof(SELFTEST_TEXT) - 1), SELFTEST_TEXT, sizeof(SELFTEST_TEXT) - 1);
+
+  blobs[0].what = "stored";
+  blobs[0].offset = selftest_add_blob(buf, len, stored, SELFTEST_STORED, 0) - *db_offset;
+  blobs[0].size = SELFTEST_STORED;
+  blobs[0].crc = CRC32(0, (unsigned char *) stored, SELFTEST_STORED);
+  blobs[0].flip = SELFTEST_STORED / 2;
+
+  blobs[1].what = "lzma";
+  blobs[1].offset = selftest_add_blob(buf, len, (char *) selftest_lzma, sizeof(selftest_lzma), 1) - *db_offset;
+  blobs[1].flip = sizeof(selftest_lzma) / 2;
+
+  memmove(stored + sizeof(selftest_lzma), stored, SELFTEST_STORED);
+  memcpy(stored, selftest_lzma, sizeof(selftest_lzma));
+  blobs[2].what = "lzma with data after the end of the stream";
+  blobs[2].offset = selftest_add_blob(buf, len, stored, SELFTEST_STORED + sizeof(selftest_lzma), 1) - *db_offset;
+  blobs[2].flip = sizeof(selftest_lzma) + SELFTEST_STORED / 2;
+
+  for (i = 1; i < 3; i++)
+  {
+    blobs[i].size = 64 * (sizeof(SELFTEST_TEXT) - 1);
+    blobs[i].crc = CRC32(0, (unsigned char *) text, (unsigned int) blobs[i].size);
+  }
+  free(stored);
+
+  memset(&fh, 0, sizeof(fh));
+  fh.flags = FH_FLAGS_BLOB_CRC;
+  fh.siginfo = FH_SIG;
+  fh.nsinst[0] = FH_INT1;
+  fh.nsinst[1] = FH_INT2;
+  fh.nsinst[2] = FH_INT3;
+  fh.length_of_header = sizeof(header);
+  fh.length_of_all_following_data = *len - fh_offset + sizeof(crc32_t);
+  memcpy(buf + fh_offset, &fh, sizeof(fh));
+
+  // the first 512 bytes are not covered, see loadHeaders()
+  crc = CRC32(0, (unsigned char *) buf + 512, *len - 512);
+  memcpy(buf + *len, &crc, sizeof(crc32_t));
+  *len += sizeof(crc32_t);
+  return buf;
+}
+
+// checks that every way of extracting the blobs of the installer at path
+// returns them, or NSIS_E_CRC for blobs[corrupt] and the installer crc
+static int selftest_check(const char *path, const struct selftest_blob *blobs, int corrupt)
+{
+  // as verify, bench and extract do
+  static const char *names[] = { "extract", "extract pipelined", "extract prefetched" };
+  __int64 offsets[SELFTEST_BLOBS];
+  struct crc_writer w;
+  nsis_reader r;
+  nsis_prefetch p;
+  int i, how, err, ret = 0;
+
+  err = nsis_open(&r, path, &nsis_stdio);
+  // the smallest buffers, so the stored blobs take more than one read and
+  // go through the pipeline
+  if (!err)
+    err = nsis_set_buffers(&r, 16384);
+  if (err)
+  {
+    printf("%s: %s\n", path, nsis_strerror(err));
+    return 1;
+  }
+
+  err = nsis_verify_crc(&r, NULL);
+  if (err != (corrupt >= 0 ? NSIS_E_CRC : NSIS_OK))
+  {
+    printf("installer crc: %s\n", nsis_strerror(err));
+    ret = 1;
+  }
+
+  for (i = 0; i < SELFTEST_BLOBS; i++)
+    offsets[i] = blobs[i].offset;
+  w.fp = NULL;
+  for (how = BENCH_SERIAL; how <= BENCH_PREFETCH; how++)
+  {
+    if (how == BENCH_PREFETCH)
+      nsis_prefetch_begin(&p, &r, offsets, SELFTEST_BLOBS, EXTRACT_JOBS);
+    for (i = 0; i < SELFTEST_BLOBS; i++)
+    {
+      __int64 len;
+
+      w.crc = 0;
+      if (how == BENCH_PREFETCH)
+        len = nsis_prefetch_extract(&p, i, write_crc, &w);
+      else if (how == BENCH_PIPELINED)
+        len = nsis_extract_pipelined(&r, offsets[i], write_crc, &w);
+      else
+        len = nsis_extract(&r, offsets[i], write_crc, &w);
+
+      if (i == corrupt ? len != NSIS_E_CRC : len != blobs[i].size || w.crc != blobs[i].crc)
+      {
+        printf("%s, %s blob: %s\n", names[how], blobs[i].what,
+          len < 0 ? nsis_strerror((int) len) : i == corrupt ? "corruption not detected" : "output differs");
+        ret = 1;
+      }
+    }
+    if (how == BENCH_PREFETCH)
+      nsis_prefetch_end(&p);
+  }
+
+  nsis_close(&r);
+  return ret;
+}
+
+static int selftest_write(const char *path, const char *buf, int len)
+{
+  FILE *fp = fopen(path, "wb");
+  int ok = fp && fwrite(buf, 1, len, fp) == (size_t) len;
+
+  if (fp && fclose(fp))
+    ok = 0;
+  if (!ok)
+    printf("%s: can't create file\n", path);
+  return ok;
+}
+
+// updates the crc of a blob changed in buf and the crc of the installer
+static void selftest_reseal(char *buf, int len, char *blob)
+{
+  __int64 l;
+  crc32_t crc;
+
+  memcpy(&l, blob, sizeof(__int64));
+  l &= ~COMPRESSED_FLAG_MARK;
+  crc = CRC32(0, (unsigned char *) blob + BLOB_HEADER_SIZE, (unsigned int) l);
+  memcpy(blob + sizeof(__int64), &crc, sizeof(crc32_t));
+  crc = CRC32(0, (unsigned char *) buf + 512, len - sizeof(crc32_t) - 512);
+  memcpy(buf + len - sizeof(crc32_t), &crc, sizeof(crc32_t));
+}
+
+// checks that extract and bench fail to decode the blob at offset
+static int selftest_check_decode(const char *path, __int64 offset)
+{
+  nsis_reader r;
+  lzma_stream s;
+  char *obuf = (char *) malloc(BENCH_OBUFSIZE);
+  double t_stream = 0, t_mem = 0;
+  __int64 len[2];
+  int err, ret = 0;
+
+  err = obuf ? nsis_open(&r, path, &nsis_stdio) : NSIS_E_MEMORY;
+  if (err)
+  {
+    printf("%s: %s\n", path, nsis_strerror(err));
+    free(obuf);
+    return 1;
+  }
+
+  memset(&s, 0, sizeof(s));
+  len[0] = nsis_extract(&r, offset, write_null, NULL);
+  len[1] = bench_decode(&r, offset, &s, obuf, &t_stream, &t_mem);
+  if (len[0] != NSIS_E_DECOMPRESS || len[1] != NSIS_E_DECOMPRESS)
+  {
+    printf("corrupted stream: extract %s, bench %s\n",
+      len[0] < 0 ? nsis_strerror((int) len[0]) : "no error",
+      len[1] == BENCH_DIFFERS ? "lzmaDecodeMem() output differs" : len[1] < 0 ? nsis_strerror((int) len[1]) : "no error");
+    ret = 1;
+  }
+
+  lzmafree(s.dictionary);
+  lzmafree(s.dynamicData);
+  free(obuf);
+  nsis_close(&r);
+  return ret;
+}
+
+// writes an installer to dir, then a copy with a byte flipped in each blob
+// in turn, and checks every copy fails with a crc error. then one whose
+// lzma stream is cut short, with a crc that matches, that has to fail to
+// decode.
+static int do_selftest(const char *dir)
+{
+  struct selftest_blob blobs[SELFTEST_BLOBS];
+  char path[NSIS_MAX_STRLEN];
+  int len, db_offset, i, ret;
+  char *buf = selftest_installer(blobs, &len, &db_offset);
+
+  if (!buf)
+  {
+    printf("%s\n", nsis_strerror(NSIS_E_MEMORY));
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/selftest.exe", dir);
+
+  ret = !selftest_write(path, buf, len) || selftest_check(path, blobs, -1);
+  for (i = 0; i < SELFTEST_BLOBS && !ret; i++)
+  {
+    char *flip = buf + db_offset + blobs[i].offset + BLOB_HEADER_SIZE + blobs[i].flip;
+
+    *flip ^= 0x10;
+    ret = !selftest_write(path, buf, len) || selftest_check(path, blobs, i);
+    *flip ^= 0x10;
+  }
+  if (!ret)
+  {
+    char *blob = buf + db_offset + blobs[1].offset;
+    __int64 l = (sizeof(selftest_lzma) - 6) | COMPRESSED_FLAG_MARK;
+    memcpy(blob, &l, sizeof(__int64));
+    selftest_reseal(buf, len, blob);
+    ret = !selftest_write(path, buf, len) || selftest_check_decode(path, blobs[1].offset);
+  }
+
+  remove(path);
+  free(buf);
+  if (!ret)
+    printf("%d blobs ok, corruption detected in each, corrupted stream detected\n", SELFTEST_BLOBS);
+  return ret;
+}
+
+int main(int argc, char **argv)
+{
+  nsis_reader r;
+  int err, ret;
+
+  if (argc < 3)
+  {
+    usage();
+    return 2;
+  }
+
+  if (!strcmp(argv[1], "selftest"))
+    return do_selftest(argv[2]);
+
+  if (!strcmp(argv[1], "bench") && argc > 3 && atof(argv[3]) > 0)
+  {
+    read_rate = atof(argv[3]) * 1024 * 1024;
+    slow_io = nsis_stdio;
+    slow_io.read = slow_read;
+  }
+
+  err = nsis_open(&r, argv[2], read_rate > 0 ? &slow_io : &nsis_stdio);
+  if (err)
+  {
+    fprintf(stderr, "%s: %s\n", argv[2], nsis_strerror(err));
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "list"))
+    ret = do_list(&r);
+  else if (!strcmp(argv[1], "verify"))
+    ret = do_verify(&r);
+  else if (!strcmp(argv[1], "extract"))
+    ret = do_extract(&r, argc > 3 ? argv[3] : ".", argv + 4, argc > 4 ? argc - 4 : 0);
+  else if (!strcmp(argv[1], "bench"))
+    ret = do_bench(&r);
+  else if (!strcmp(argv[1], "stress"))
+    ret = do_stress(&r, argc > 3 ? atoi(argv[3]) : 64);
+  else
+  {
+    usage();
+    ret = 2;
+  }
+
+  nsis_close(&r);
+  return ret;
+}
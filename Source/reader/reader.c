@@ -0,0 +1,1529 @@
+/*
+ * reader.c
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include "reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IBUFSIZE NSIS_IBUFSIZE // same as the exehead
+#define OBUFSIZE NSIS_OBUFSIZE
+
+#ifndef min
+#  define min(a,b) (((a)<(b))?(a):(b))
+#endif
+#ifndef max
+#  define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+#ifdef _WIN32
+#  define FSEEK64 _fseeki64
+#  define FTELL64 _ftelli64
+#else
+#  define FSEEK64 fseeko
+#  define FTELL64 ftello
+#endif
+
+// stdio nsis_io
+
+static void *stdio_open(const char *path)
+{
+  return fopen(path, "rb");
+}
+
+static int stdio_read(void *f, void *buf, unsigned int len)
+{
+  return fread(buf, 1, len, (FILE *) f) == len;
+}
+
+static int stdio_seek(void *f, __int64 pos)
+{
+  return !FSEEK64((FILE *) f, pos, SEEK_SET);
+}
+
+static __int64 stdio_size(void *f)
+{
+  __int64 size;
+  if (FSEEK64((FILE *) f, 0, SEEK_END))
+    return -1;
+  size = FTELL64((FILE *) f);
+  FSEEK64((FILE *) f, 0, SEEK_SET);
+  return size;
+}
+
+static void stdio_close(void *f)
+{
+  fclose((FILE *) f);
+}
+
+const nsis_io nsis_stdio = {
+  stdio_open,
+  stdio_read,
+  stdio_seek,
+  stdio_size,
+  stdio_close
+};
+
+const char *nsis_strerror(int err)
+{
+  switch (err)
+  {
+    case NSIS_OK: return "no error";
+    case NSIS_E_OPEN: return "can't open file";
+    case NSIS_E_READ: return "read error";
+    case NSIS_E_FORMAT: return "not an installer or corrupted header";
+    case NSIS_E_CRC: return "crc mismatch";
+    case NSIS_E_DECOMPRESS: return "corrupted compressed data";
+    case NSIS_E_WRITE: return "write error";
+    case NSIS_E_MEMORY: return "out of memory";
+  }
+  return "unknown error";
+}
+
+// data volumes, see ReadSelfFile() and SetSelfFilePointer()
+
+static void get_volume_name(const nsis_reader *r, int index, char *buf, size_t buflen)
+{
+  char *ext, *sep;
+
+  strncpy(buf, r->path, buflen - 16);
+  buf[buflen - 16] = 0;
+
+  // the last extension is replaced, like get_data_volume_filename() does
+  sep = strrchr(buf, '/');
+  if (!sep || strrchr(buf, '\\') > sep)
+    sep = strrchr(buf, '\\');
+  ext = strrchr(sep ? sep : buf, '.');
+  if (ext)
+    *ext = 0;
+  sprintf(buf + strlen(buf), ".%u.dat", index);
+}
+
+// makes v the current volume, opening it in place of the least recently
+// used handle unless it is still open
+static int open_volume(nsis_reader *r, int v)
+{
+  char name[1024 + 16];
+  int i, slot = 0;
+
+  if (r->cur_volume == v)
+    return NSIS_OK;
+
+  for (i = 0; i < NSIS_VOLUME_HANDLES; i++)
+  {
+    if (r->vhandles[i].f && r->vhandles[i].volume == v)
+    {
+      slot = i;
+      break;
+    }
+    if (r->vhandles[i].used < r->vhandles[slot].used)
+      slot = i;
+  }
+
+  if (i == NSIS_VOLUME_HANDLES)
+  {
+    if (r->vhandles[slot].f)
+      r->io->close(r->vhandles[slot].f);
+    r->vhandles[slot].f = NULL;
+    r->vhandles[slot].used = 0;
+    r->vf = NULL;
+    r->cur_volume = -1;
+
+    get_volume_name(r, v + 1, name, sizeof(name));
+    r->vhandles[slot].f = r->io->open(name);
+    if (!r->vhandles[slot].f)
+      return NSIS_E_OPEN;
+    r->vhandles[slot].volume = v;
+    r->volume_opens++;
+  }
+
+  r->vhandles[slot].used = ++r->vclock;
+  r->vf = r->vhandles[slot].f;
+  r->cur_volume = v;
+  return NSIS_OK;
+}
+
+static int load_volumes(nsis_reader *r)
+{
+  int i = 0;
+
+  do
+  {
+    dataheader dh;
+    __int64 size;
+    int err;
+
+    r->num_volumes = i + 1;
+    r->volumes = (dataheader *) realloc(r->volumes, r->num_volumes * sizeof(dataheader));
+    if (!r->volumes)
+      return NSIS_E_MEMORY;
+
+    err = open_volume(r, i);
+    if (err)
+      return err;
+
+    if (!r->io->seek(r->vf, 0) || !r->io->read(r->vf, &dh, sizeof(dh)))
+      return NSIS_E_READ;
+    size = r->io->size(r->vf);
+    if (size != dh.length + (__int64) sizeof(dataheader) || dh.volume_index != i + 1)
+      return NSIS_E_FORMAT;
+    // offsets are mapped to volumes by length_per_volume
+    if ((dh.total_volume > 1 && (dh.length_per_volume <= 0 || dh.length > dh.length_per_volume)) ||
+        (i && (dh.length_per_volume != r->volumes[0].length_per_volume || dh.total_volume != r->volumes[0].total_volume)))
+      return NSIS_E_FORMAT;
+
+    r->volumes[i] = dh;
+    i++;
+  }
+  while (i < r->volumes[0].total_volume);
+
+  return NSIS_OK;
+}
+
+static int read_volumes(nsis_reader *r, char *buf, unsigned int len)
+{
+  while (len)
+  {
+    __int64 lpv = r->volumes[0].length_per_volume;
+    int v = r->num_volumes > 1 ? (int) (r->pos / lpv) : 0;
+    __int64 start = v * lpv;
+    unsigned int l;
+    int err;
+
+    if (r->pos < 0 || v >= r->num_volumes || r->pos >= start + r->volumes[v].length)
+      return NSIS_E_READ;
+
+    err = open_volume(r, v);
+    if (err)
+      return err;
+
+    l = (unsigned int) min((__int64) len, start + r->volumes[v].length - r->pos);
+    if (!r->io->seek(r->vf, r->pos - start + sizeof(dataheader)) || !r->io->read(r->vf, buf, l))
+      return NSIS_E_READ;
+
+    buf += l;
+    len -= l;
+    r->pos += l;
+  }
+  return NSIS_OK;
+}
+
+// solid installers, see __ensuredata()
+
+static int find_block(const nsis_reader *r, __int64 offset)
+{
+  int lo = 0, hi = r->sh.num_blocks - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (r->blocks[mid].offset <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+static int decode_block(nsis_reader *r, int b)
+{
+  __int64 left = r->blocks[b + 1].compressed_offset - r->blocks[b].compressed_offset;
+  int expected = (int) (r->blocks[b + 1].offset - r->blocks[b].offset);
+  int err = LZMA_OK;
+
+  if (!r->io->seek(r->f, r->blocks_offset + r->blocks[b].compressed_offset))
+    return NSIS_E_READ;
+
+  r->cur_block = -1;
+  lzmaInit(&r->block_lzma);
+  r->block_lzma.next_out = (Byte *) r->block;
+  // a little extra room, so a corrupt block can't go unnoticed
+  r->block_lzma.avail_out = r->sh.block_size + 16;
+
+  while (left > 0 && err == LZMA_OK)
+  {
+    unsigned int l = (unsigned int) min(left, (__int64) IBUFSIZE);
+    if (!r->io->read(r->f, r->block_in, l))
+      return NSIS_E_READ;
+    left -= l;
+
+    r->block_lzma.next_in = (Byte *) r->block_in;
+    r->block_lzma.avail_in = l;
+    do
+    {
+      unsigned int in = r->block_lzma.avail_in, out = r->block_lzma.avail_out;
+      err = lzmaDecode(&r->block_lzma);
+      if (r->block_lzma.avail_in == in && r->block_lzma.avail_out == out)
+        break;
+    }
+    while (err == LZMA_OK);
+  }
+
+  if (err != LZMA_STREAM_END || (char *) r->block_lzma.next_out - r->block != expected)
+    return NSIS_E_DECOMPRESS;
+
+  r->cur_block = b;
+  return NSIS_OK;
+}
+
+static int read_solid(nsis_reader *r, char *buf, unsigned int len)
+{
+  if (r->pos + len > r->sh.length)
+    return NSIS_E_READ;
+
+  while (len)
+  {
+    int b = find_block(r, r->pos);
+    unsigned int l;
+
+    if (r->cur_block != b)
+    {
+      int err = decode_block(r, b);
+      if (err)
+        return err;
+    }
+
+    l = (unsigned int) min((__int64) len, r->blocks[b + 1].offset - r->pos);
+    memcpy(buf, r->block + (r->pos - r->blocks[b].offset), l);
+
+    buf += l;
+    len -= l;
+    r->pos += l;
+  }
+  return NSIS_OK;
+}
+
+// reads the stored data at r->pos
+static int stored_read(nsis_reader *r, void *buf, unsigned int len)
+{
+  switch (r->source)
+  {
+    case NR_VOLUMES:
+      return read_volumes(r, (char *) buf, len);
+    case NR_SOLID:
+      return read_solid(r, (char *) buf, len);
+  }
+
+  if (!r->io->seek(r->f, r->fh_offset + sizeof(firstheader) + r->pos) || !r->io->read(r->f, buf, len))
+    return NSIS_E_READ;
+  r->pos += len;
+  return NSIS_OK;
+}
+
+// blobs, see _dodecomp()
+
+static int read_blob_header(nsis_reader *r, __int64 *stored_len, int *compressed, crc32_t *crc)
+{
+  __int64 len;
+  int err = stored_read(r, &len, sizeof(__int64));
+  if (!err)
+    err = stored_read(r, crc, sizeof(crc32_t));
+  if (err)
+    return err;
+
+  *compressed = (len & COMPRESSED_FLAG_MARK) != 0;
+  *stored_len = len & ~COMPRESSED_FLAG_MARK;
+  return NSIS_OK;
+}
+
+// extracts the blob at the stored offset pos
+static __int64 extract_blob(nsis_reader *r, __int64 pos, nsis_write_fn write, void *ctx)
+{
+  __int64 left, retval = 0;
+  int compressed, ended = 0, failed = 0;
+  crc32_t blob_crc, crc = 0;
+  int err;
+
+  r->pos = pos;
+  err = read_blob_header(r, &left, &compressed, &blob_crc);
+  if (err)
+    return err;
+
+  if (compressed)
+    lzmaInit(&r->lzma);
+
+  while (left > 0)
+  {
+    unsigned int l = (unsigned int) min(left, (__int64) r->ibufsize);
+
+    err = stored_read(r, r->inbuf, l);
+    if (err)
+      return err;
+    crc = CRC32(crc, (unsigned char *) r->inbuf, l);
+    left -= l;
+
+    if (!compressed)
+    {
+      if (!write(ctx, r->inbuf, l))
+        return NSIS_E_WRITE;
+      retval += l;
+      continue;
+    }
+
+    r->lzma.next_in = (Byte *) r->inbuf;
+    r->lzma.avail_in = l;
+
+    // anything after the end of the stream is only read for the crc
+    while (!ended && !failed)
+    {
+      unsigned int u;
+
+      r->lzma.next_out = (Byte *) r->outbuf;
+      r->lzma.avail_out = r->obufsize;
+
+      err = lzmaDecode(&r->lzma);
+      if (err < 0)
+      {
+        // corrupted data, which the crc tells better
+        failed++;
+        break;
+      }
+
+      // if there's no output, more input is needed
+      u = (unsigned int) ((char *) r->lzma.next_out - r->outbuf);
+      if (!u && err != LZMA_STREAM_END)
+        break;
+
+      if (u && !write(ctx, r->outbuf, u))
+        return NSIS_E_WRITE;
+      retval += u;
+
+      ended = err == LZMA_STREAM_END;
+    }
+  }
+
+  if (crc != blob_crc)
+    return NSIS_E_CRC;
+  if (compressed && (failed || !ended))
+    return NSIS_E_DECOMPRESS;
+
+  return retval;
+}
+
+// the pipelined counterpart of extract_blob(), see dodecomp_pipelined()
+
+#define PIPE_SLOTS 4
+
+struct extract_pipe
+{
+  nsis_reader *r;
+  pipe_queue in; // stored data, read by extract_read()
+  pipe_queue out; // decoded data, written by extract_write()
+  pipe_queue *write_q; // in for uncompressed data, out otherwise
+  __int64 stored_len;
+  crc32_t blob_crc;
+  nsis_write_fn write;
+  void *ctx;
+  int write_err;
+};
+
+static void NSISCALL extract_read(void *ctx)
+{
+  struct extract_pipe *p = (struct extract_pipe *) ctx;
+  __int64 left = p->stored_len;
+  crc32_t crc = 0;
+
+  while (left > 0)
+  {
+    unsigned int l = (unsigned int) min(left, (__int64) p->in.size);
+    char *buf = pipe_get_free(&p->in);
+    int err;
+
+    if (!buf)
+      return;
+    err = stored_read(p->r, buf, l);
+    if (err)
+    {
+      pipe_close(&p->in, err);
+      return;
+    }
+    left -= l;
+
+    // the last part is held back if the crc doesn't match
+    crc = CRC32(crc, (unsigned char *) buf, l);
+    if (!left && crc != p->blob_crc)
+    {
+      pipe_close(&p->in, NSIS_E_CRC);
+      return;
+    }
+
+    pipe_put(&p->in, l);
+  }
+  pipe_close(&p->in, NSIS_OK);
+}
+
+static void NSISCALL extract_write(void *ctx)
+{
+  struct extract_pipe *p = (struct extract_pipe *) ctx;
+  unsigned int l;
+  char *buf;
+
+  while ((buf = pipe_get_filled(p->write_q, &l)) != NULL)
+  {
+    if (!p->write(p->ctx, buf, l))
+    {
+      p->write_err++;
+      pipe_abort(p->write_q);
+      return;
+    }
+    pipe_release(p->write_q);
+  }
+}
+
+// decodes the stored data of p->in into p->out on the calling thread
+static __int64 extract_decode(struct extract_pipe *p, lzma_stream *s)
+{
+  __int64 retval = 0;
+  char *in, *out = NULL;
+  unsigned int l;
+  int err = LZMA_OK;
+
+  lzmaInit(s);
+  while (err == LZMA_OK && (in = pipe_get_filled(&p->in, &l)) != NULL)
+  {
+    s->next_in = (Byte *) in;
+    s->avail_in = l;
+
+    for (;;)
+    {
+      unsigned int avail;
+
+      // output buffers are only passed on once full, or at the end
+      if (!out)
+      {
+        out = pipe_get_free(&p->out);
+        if (!out)
+          return NSIS_E_WRITE;
+        s->next_out = (Byte *) out;
+        s->avail_out = p->out.size;
+      }
+      avail = s->avail_out;
+
+      err = lzmaDecode(s);
+      if (err < 0)
+        break;
+      retval += avail - s->avail_out;
+
+      if (!s->avail_out || err == LZMA_STREAM_END)
+      {
+        pipe_put(&p->out, p->out.size - s->avail_out);
+        out = NULL;
+      }
+
+      // if there's no output, more input is needed
+      if (err == LZMA_STREAM_END || avail == s->avail_out)
+        break;
+    }
+    pipe_release(&p->in);
+  }
+
+  // anything after the end of the stream is only read for the crc, as is
+  // the rest of corrupted data, which the crc tells better
+  while (pipe_get_filled(&p->in, &l))
+    pipe_release(&p->in);
+
+  if (p->in.err)
+    return p->in.err;
+  if (err != LZMA_STREAM_END)
+    return NSIS_E_DECOMPRESS;
+  return retval;
+}
+
+static __int64 extract_blob_pipelined(nsis_reader *r, __int64 pos, nsis_write_fn write, void *ctx)
+{
+  struct extract_pipe p;
+  pipe_thread reader, writer;
+  int compressed, err;
+  __int64 retval;
+
+  r->pos = pos;
+  err = read_blob_header(r, &p.stored_len, &compressed, &p.blob_crc);
+  if (err)
+    return err;
+
+  // data in decoded solid blocks doesn't need another thread, neither does
+  // a single read
+  if (r->source == NR_SOLID || p.stored_len <= r->ibufsize / PIPE_SLOTS)
+    return extract_blob(r, pos, write, ctx);
+
+  if (!r->pipe_mem)
+  {
+    r->pipe_mem = (char *) malloc(r->ibufsize + r->obufsize);
+    if (!r->pipe_mem)
+      return NSIS_E_MEMORY;
+  }
+
+  p.r = r;
+  p.write = write;
+  p.ctx = ctx;
+  p.write_err = 0;
+
+  if (compressed)
+  {
+    if (!pipe_init(&p.in, r->pipe_mem, PIPE_SLOTS, r->ibufsize / PIPE_SLOTS))
+      return NSIS_E_MEMORY;
+    if (!pipe_init(&p.out, r->pipe_mem + r->ibufsize, PIPE_SLOTS, r->obufsize / PIPE_SLOTS))
+    {
+      pipe_free(&p.in);
+      return NSIS_E_MEMORY;
+    }
+    p.write_q = &p.out;
+  }
+  else
+  {
+    if (!pipe_init(&p.in, r->pipe_mem, PIPE_SLOTS, (r->ibufsize + r->obufsize) / PIPE_SLOTS))
+      return NSIS_E_MEMORY;
+    p.write_q = &p.in;
+  }
+
+  if (!pipe_start(&writer, extract_write, &p))
+  {
+    pipe_free(&p.in);
+    if (compressed)
+      pipe_free(&p.out);
+    return extract_blob(r, pos, write, ctx);
+  }
+  if (!pipe_start(&reader, extract_read, &p))
+  {
+    pipe_close(p.write_q, NSIS_OK);
+    pipe_join(&writer);
+    pipe_free(&p.in);
+    if (compressed)
+      pipe_free(&p.out);
+    return extract_blob(r, pos, write, ctx);
+  }
+
+  if (compressed)
+  {
+    retval = extract_decode(&p, &r->lzma);
+    pipe_abort(&p.in);
+    pipe_join(&reader);
+    pipe_close(&p.out, NSIS_OK);
+    pipe_join(&writer);
+    pipe_free(&p.out);
+  }
+  else
+  {
+    pipe_join(&reader);
+    pipe_join(&writer);
+    retval = p.in.err ? p.in.err : p.stored_len;
+  }
+  pipe_free(&p.in);
+
+  return p.write_err ? NSIS_E_WRITE : retval;
+}
+
+struct mem_writer
+{
+  char *buf;
+  __int64 len;
+  __int64 size;
+};
+
+static int write_mem(void *ctx, const void *data, unsigned int len)
+{
+  struct mem_writer *w = (struct mem_writer *) ctx;
+  if (w->len + len > w->size)
+    return 0;
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+  return 1;
+}
+
+static int is_firstheader(const firstheader *h)
+{
+  return
+    (h->flags & (~FH_FLAGS_MASK)) == 0 &&
+    h->siginfo == FH_SIG &&
+    h->nsinst[2] == FH_INT3 &&
+    h->nsinst[1] == FH_INT2 &&
+    h->nsinst[0] == FH_INT1;
+}
+
+static __int64 get_crc_length(const nsis_reader *r)
+{
+#ifdef NSIS_CONFIG_CRC_SUPPORT
+  if (!(r->fh.flags & FH_FLAGS_NO_CRC))
+    return sizeof(crc32_t);
+#endif
+  return 0;
+}
+
+static int load_solid(nsis_reader *r)
+{
+  __int64 end = r->fh_offset + r->fh.length_of_all_following_data - get_crc_length(r);
+  int n;
+
+  if (!r->io->seek(r->f, r->fh_offset + sizeof(firstheader)) || !r->io->read(r->f, &r->sh, sizeof(solidheader)))
+    return NSIS_E_READ;
+  if (r->sh.num_blocks < 1 || r->sh.block_size < 1)
+    return NSIS_E_FORMAT;
+  r->blocks_offset = r->fh_offset + sizeof(firstheader) + sizeof(solidheader);
+
+  // the seek table comes last
+  n = r->sh.num_blocks + 1;
+  r->blocks = (solidblock *) malloc(n * sizeof(solidblock));
+  r->block = (char *) malloc(r->sh.block_size + 16);
+  r->block_in = (char *) malloc(IBUFSIZE);
+  if (!r->blocks || !r->block || !r->block_in)
+    return NSIS_E_MEMORY;
+  if (!r->io->seek(r->f, end - n * sizeof(solidblock)) || !r->io->read(r->f, r->blocks, n * sizeof(solidblock)))
+    return NSIS_E_READ;
+  if (r->blocks[n - 1].offset != r->sh.length)
+    return NSIS_E_FORMAT;
+
+  r->source = NR_SOLID;
+  return NSIS_OK;
+}
+
+// entries are stored packed, see entry_writer::write() in fileform.cpp
+static int read_varint(const unsigned char **p, const unsigned char *end, unsigned int *v)
+{
+  const unsigned char *q = *p;
+  int shift = 0;
+
+  *v = 0;
+  do
+  {
+    if (q >= end || shift > 28)
+      return 0;
+    *v |= (unsigned int) (*q & 0x7f) << shift;
+    shift += 7;
+  } while (*q++ & 0x80);
+  *p = q;
+  return 1;
+}
+
+static int unpack_entries(nsis_reader *r)
+{
+  const unsigned char *p, *end = (unsigned char *) r->hdr + r->fh.length_of_header;
+  int num = r->header->blocks[NB_ENTRIES].num, n, i;
+  int last[ENTRY_PACK_WHICH]; // 1 + index of the last entry of each which
+
+  if (num < 0 || r->header->blocks[NB_ENTRIES].offset < (int) sizeof(header) ||
+      r->header->blocks[NB_ENTRIES].offset > r->fh.length_of_header)
+    return NSIS_E_FORMAT;
+  p = (unsigned char *) r->hdr + r->header->blocks[NB_ENTRIES].offset;
+  r->entries = (entry *) calloc(num + 1, sizeof(entry));
+  if (!r->entries)
+    return NSIS_E_MEMORY;
+
+  memset(last, 0, sizeof(last));
+  for (n = 0; n < num; n++)
+  {
+    entry *e = &r->entries[n];
+    unsigned int v;
+    int mask;
+
+    if (!read_varint(&p, end, &v) || p >= end)
+      return NSIS_E_FORMAT;
+    e->which = (int) v;
+    if (v < ENTRY_PACK_WHICH)
+    {
+      if (last[v])
+        memcpy(e->offsets, r->entries[last[v] - 1].offsets, sizeof(e->offsets));
+      last[v] = n + 1;
+    }
+    mask = *p++;
+    for (i = 0; i < MAX_ENTRY_OFFSETS; i++)
+    {
+      if (!(mask & (1 << i)))
+        continue;
+      if (!read_varint(&p, end, &v))
+        return NSIS_E_FORMAT;
+      e->offsets[i] = (int) ((unsigned int) e->offsets[i] + ((v >> 1) ^ (0U - (v & 1))));
+    }
+  }
+  return NSIS_OK;
+}
+
+static int load_headers(nsis_reader *r)
+{
+  struct mem_writer w;
+  __int64 size, ret;
+  int err;
+
+  size = r->io->size(r->f);
+  if (size < 0)
+    return NSIS_E_READ;
+
+  // the firstheader is 512 bytes aligned
+  for (r->fh_offset = 0; ; r->fh_offset += 512)
+  {
+    if (r->fh_offset + (__int64) sizeof(firstheader) > size)
+      return NSIS_E_FORMAT;
+    if (!r->io->seek(r->f, r->fh_offset) || !r->io->read(r->f, &r->fh, sizeof(firstheader)))
+      return NSIS_E_READ;
+    if (is_firstheader(&r->fh))
+      break;
+  }
+
+  if (r->fh.length_of_all_following_data > size - r->fh_offset || r->fh.length_of_header <= 0)
+    return NSIS_E_FORMAT;
+
+  if (r->fh.flags & FH_FLAGS_SOLID)
+  {
+    err = load_solid(r);
+    if (err)
+      return err;
+  }
+
+  r->hdr = (char *) malloc(r->fh.length_of_header);
+  if (!r->hdr)
+    return NSIS_E_MEMORY;
+
+  // the header is stored as HEADER_PARTS blobs, the first one holds the
+  // header itself and with it where the others end
+  w.buf = r->hdr;
+  w.len = 0;
+  w.size = r->fh.length_of_header;
+  ret = extract_blob(r, 0, write_mem, &w);
+  if (ret < 0)
+    return (int) ret;
+  r->header = (header *) r->hdr;
+  if (ret < (int) sizeof(header) || ret != r->header->blocks[NB_ENTRIES].offset)
+    return NSIS_E_FORMAT;
+  {
+    int ends[HEADER_PARTS], i;
+    ends[0] = r->header->blocks[NB_ENTRIES].offset;
+    ends[1] = r->header->blocks[NB_STRINGS].offset;
+    ends[2] = r->header->blocks[NB_LANGTABLES].offset;
+    ends[3] = r->fh.length_of_header;
+    for (i = 1; i < HEADER_PARTS; i++)
+    {
+      if (ends[i] < ends[i - 1] || ends[i] > r->fh.length_of_header)
+        return NSIS_E_FORMAT;
+      w.buf = r->hdr + ends[i - 1];
+      w.len = 0;
+      w.size = ends[i] - ends[i - 1];
+      ret = extract_blob(r, r->pos, write_mem, &w);
+      if (ret < 0)
+        return (int) ret;
+      if (ret != w.size)
+        return NSIS_E_FORMAT;
+    }
+  }
+
+  err = unpack_entries(r);
+  if (err)
+    return err;
+
+  // only the table of contents is looked up by tools, the rest of the
+  // header is used by the exehead as it is
+  if (r->header->blocks[NB_TOC].num < 0 || (r->header->blocks[NB_TOC].num &&
+      (r->header->blocks[NB_TOC].offset < (int) sizeof(header) ||
+       r->header->blocks[NB_TOC].offset + (__int64) r->header->blocks[NB_TOC].num * sizeof(toc_entry) > r->fh.length_of_header)))
+    return NSIS_E_FORMAT;
+
+  // the datablock follows the header
+  r->db_offset = r->pos;
+  if (r->fh.flags & FH_FLAGS_DATA_FILE)
+  {
+    err = load_volumes(r);
+    if (err)
+      return err;
+    r->source = NR_VOLUMES;
+    r->db_offset = 0;
+    r->db_length = r->volumes[0].total_length;
+  }
+  else if (r->source == NR_SOLID)
+    r->db_length = r->sh.length - r->db_offset;
+  else
+    r->db_length = r->fh.length_of_all_following_data - sizeof(firstheader) - get_crc_length(r) - r->db_offset;
+
+  return NSIS_OK;
+}
+
+int nsis_open(nsis_reader *r, const char *path, const nsis_io *io)
+{
+  int err;
+
+  memset(r, 0, sizeof(nsis_reader));
+  r->io = io ? io : &nsis_stdio;
+  strncpy(r->path, path, sizeof(r->path) - 1);
+  r->cur_volume = -1;
+  r->cur_block = -1;
+  r->verify_threads = 4;
+
+  err = nsis_set_buffers(r, IBUFSIZE + OBUFSIZE);
+  if (err)
+  {
+    nsis_close(r);
+    return err;
+  }
+
+  r->f = r->io->open(path);
+  if (!r->f)
+  {
+    nsis_close(r);
+    return NSIS_E_OPEN;
+  }
+
+  err = load_headers(r);
+  if (!err)
+    err = nsis_set_buffers(r, IBUFSIZE + OBUFSIZE);
+  if (err)
+    nsis_close(r);
+  return err;
+}
+
+int nsis_set_buffers(nsis_reader *r, unsigned int size)
+{
+  // the data of the installer, the header and the datablock
+  __int64 need = size;
+  if (r->header)
+  {
+    need = r->fh.length_of_all_following_data;
+    if (r->source == NR_VOLUMES)
+      need += r->db_length;
+  }
+  size = (unsigned int) min(max(need, 16384), (__int64) size);
+
+  free(r->inbuf);
+  free(r->outbuf);
+  free(r->pipe_mem);
+  r->pipe_mem = NULL;
+  r->ibufsize = (unsigned int) ((__int64) size * IBUFSIZE / (IBUFSIZE + OBUFSIZE));
+  r->obufsize = size - r->ibufsize;
+  r->inbuf = (char *) malloc(r->ibufsize);
+  r->outbuf = (char *) malloc(r->obufsize);
+  if (!r->inbuf || !r->outbuf)
+    return NSIS_E_MEMORY;
+  return NSIS_OK;
+}
+
+void nsis_close(nsis_reader *r)
+{
+  int i;
+
+  if (r->f)
+    r->io->close(r->f);
+  for (i = 0; i < NSIS_VOLUME_HANDLES; i++)
+    if (r->vhandles[i].f)
+      r->io->close(r->vhandles[i].f);
+  free(r->volumes);
+  free(r->blocks);
+  free(r->block);
+  free(r->block_in);
+  free(r->hdr);
+  free(r->entries);
+  free(r->inbuf);
+  free(r->outbuf);
+  free(r->pipe_mem);
+  free(r->toc_hash);
+  free(r->toc_chain);
+  free(r->toc_offsets);
+  lzmafree(r->lzma.dictionary);
+  lzmafree(r->lzma.dynamicData);
+  lzmafree(r->block_lzma.dictionary);
+  lzmafree(r->block_lzma.dynamicData);
+  memset(r, 0, sizeof(nsis_reader));
+}
+
+// data volume verification, see verify_volumes() in exehead/fileform.c.
+// each thread checks volumes first, first+step, ... with its own handle.
+
+struct verify_job
+{
+  nsis_reader *r;
+  int first;
+  int step;
+  int err;
+  __int64 read_bytes;
+};
+
+static void NSISCALL verify_thread(void *ctx)
+{
+  struct verify_job *job = (struct verify_job *) ctx;
+  nsis_reader *r = job->r;
+  char name[1024 + 16];
+  char *buf = (char *) malloc(IBUFSIZE);
+  int v;
+
+  if (!buf)
+  {
+    job->err = NSIS_E_MEMORY;
+    return;
+  }
+
+  for (v = job->first; v < r->num_volumes && !job->err; v += job->step)
+  {
+    __int64 pos;
+    crc32_t crc = 0;
+    void *f;
+
+    get_volume_name(r, v + 1, name, sizeof(name));
+    f = r->io->open(name);
+    if (!f)
+    {
+      job->err = NSIS_E_OPEN;
+      break;
+    }
+
+    if (!r->io->seek(f, sizeof(dataheader)))
+      job->err = NSIS_E_READ;
+    for (pos = 0; !job->err && pos < r->volumes[v].length; )
+    {
+      unsigned int l = (unsigned int) min(r->volumes[v].length - pos, (__int64) IBUFSIZE);
+      if (!r->io->read(f, buf, l))
+        job->err = NSIS_E_READ;
+      else
+        crc = CRC32(crc, (unsigned char *) buf, l);
+      pos += l;
+    }
+    r->io->close(f);
+
+    job->read_bytes += pos;
+    if (!job->err && crc != r->volumes[v].crc)
+      job->err = NSIS_E_CRC;
+  }
+
+  free(buf);
+}
+
+static int verify_volumes(nsis_reader *r, __int64 *read_bytes)
+{
+  struct verify_job jobs[NSIS_MAX_VERIFY_THREADS];
+  pipe_thread threads[NSIS_MAX_VERIFY_THREADS];
+  int started[NSIS_MAX_VERIFY_THREADS];
+  int n = min(r->verify_threads, r->num_volumes);
+  int i, err = NSIS_OK;
+
+  if (n > NSIS_MAX_VERIFY_THREADS)
+    n = NSIS_MAX_VERIFY_THREADS;
+  if (n < 1)
+    n = 1;
+
+  // the crc tables are built on the first call, not by the threads
+  CRC32(0, NULL, 0);
+
+  for (i = 0; i < n; i++)
+  {
+    jobs[i].r = r;
+    jobs[i].first = i;
+    jobs[i].step = n;
+    jobs[i].err = NSIS_OK;
+    jobs[i].read_bytes = 0;
+    started[i] = n > 1 && pipe_start(&threads[i], verify_thread, &jobs[i]);
+    if (!started[i])
+      verify_thread(&jobs[i]);
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if (started[i])
+      pipe_join(&threads[i]);
+    if (read_bytes)
+      *read_bytes += jobs[i].read_bytes;
+    if (jobs[i].err && !err)
+      err = jobs[i].err;
+  }
+  return err;
+}
+
+int nsis_verify_crc(nsis_reader *r, __int64 *read_bytes)
+{
+  __int64 pos, end;
+  crc32_t crc = 0, fcrc;
+
+  if (read_bytes)
+    *read_bytes = 0;
+
+  if (!get_crc_length(r))
+    return NSIS_OK;
+
+  // the first 512 bytes are not covered, see loadHeaders()
+  end = r->fh_offset + r->fh.length_of_all_following_data - sizeof(crc32_t);
+  if (!r->io->seek(r->f, 512))
+    return NSIS_E_READ;
+  for (pos = 512; pos < end; )
+  {
+    unsigned int l = (unsigned int) min(end - pos, (__int64) r->ibufsize);
+    if (!r->io->read(r->f, r->inbuf, l))
+      return NSIS_E_READ;
+    crc = CRC32(crc, (unsigned char *) r->inbuf, l);
+    pos += l;
+  }
+  if (!r->io->read(r->f, &fcrc, sizeof(crc32_t)))
+    return NSIS_E_READ;
+  if (read_bytes)
+    *read_bytes += end - 512;
+  if (crc != fcrc)
+    return NSIS_E_CRC;
+
+  return verify_volumes(r, read_bytes);
+}
+
+int nsis_blob_info(nsis_reader *r, __int64 offset, __int64 *stored_len, int *compressed, crc32_t *crc)
+{
+  if (offset < 0 || offset + (__int64) BLOB_HEADER_SIZE > r->db_length)
+    return NSIS_E_FORMAT;
+  r->pos = r->db_offset + offset;
+  return read_blob_header(r, stored_len, compressed, crc);
+}
+
+int nsis_read_blob(nsis_reader *r, __int64 offset, void *buf)
+{
+  __int64 left;
+  int compressed;
+  crc32_t blob_crc, crc = 0;
+  char *p = (char *) buf;
+  int err = nsis_blob_info(r, offset, &left, &compressed, &blob_crc);
+
+  while (!err && left > 0)
+  {
+    unsigned int l = (unsigned int) min(left, (__int64) r->ibufsize);
+    err = stored_read(r, p, l);
+    crc = CRC32(crc, (unsigned char *) p, l);
+    p += l;
+    left -= l;
+  }
+
+  if (!err && crc != blob_crc)
+    err = NSIS_E_CRC;
+  return err;
+}
+
+__int64 nsis_extract(nsis_reader *r, __int64 offset, nsis_write_fn write, void *ctx)
+{
+  if (offset < 0 || offset + (__int64) BLOB_HEADER_SIZE > r->db_length)
+    return NSIS_E_FORMAT;
+  return extract_blob(r, r->db_offset + offset, write, ctx);
+}
+
+__int64 nsis_extract_pipelined(nsis_reader *r, __int64 offset, nsis_write_fn write, void *ctx)
+{
+  if (offset < 0 || offset + (__int64) BLOB_HEADER_SIZE > r->db_length)
+    return NSIS_E_FORMAT;
+  return extract_blob_pipelined(r, r->db_offset + offset, write, ctx);
+}
+
+// runs of files, see ExtractFileEntry()
+
+#define PREFETCH_DIRECT 1 // job err of blobs left to nsis_extract_pipelined()
+#define PREFETCH_OVERFLOW 2 // job err of blobs that decode to more than out holds
+
+static void NSISCALL prefetch_thread(void *ctx)
+{
+  struct nsis_prefetch_job *job = (struct nsis_prefetch_job *) ctx;
+  int err;
+
+  job->s.next_in = (Byte *) job->in;
+  job->s.avail_in = job->in_len;
+  job->s.next_out = (Byte *) job->out;
+  job->s.avail_out = NSIS_PREFETCH_SIZE;
+
+  err = lzmaDecodeMem(&job->s);
+
+  job->len = (unsigned int) ((char *) job->s.next_out - job->out);
+  if (err == LZMA_STREAM_END)
+    job->err = NSIS_OK;
+  else if (err >= 0 && !job->s.avail_out)
+    job->err = PREFETCH_OVERFLOW;
+  else
+    job->err = NSIS_E_DECOMPRESS;
+}
+
+// reads the blob at offsets[index] and starts decoding it
+static void prefetch_start(nsis_prefetch *p, struct nsis_prefetch_job *job, int index)
+{
+  nsis_reader *r = p->r;
+  __int64 stored_len;
+  crc32_t blob_crc;
+  int err, toc;
+
+  job->index = index;
+  job->err = PREFETCH_DIRECT;
+
+  // blobs known to overflow out aren't worth reading ahead
+  toc = nsis_toc_lookup(r, p->offsets[index], NULL);
+  if (toc >= 0 && nsis_toc(r)[toc].size > NSIS_PREFETCH_SIZE)
+    return;
+
+  err = nsis_blob_info(r, p->offsets[index], &stored_len, &job->compressed, &blob_crc);
+  if (err)
+  {
+    job->err = err;
+    return;
+  }
+  if (stored_len > NSIS_PREFETCH_SIZE)
+    return;
+
+  if (stored_len > job->in_alloc)
+  {
+    free(job->in);
+    job->in = (char *) malloc((size_t) stored_len);
+    job->in_alloc = job->in ? (unsigned int) stored_len : 0;
+  }
+  if (job->compressed && !job->out)
+    job->out = (char *) malloc(NSIS_PREFETCH_SIZE);
+  if ((stored_len && !job->in) || (job->compressed && !job->out))
+    return;
+
+  job->len = job->in_len = (unsigned int) stored_len;
+  err = stored_read(r, job->in, job->in_len);
+  if (!err && CRC32(0, (unsigned char *) job->in, job->in_len) != blob_crc)
+    err = NSIS_E_CRC;
+  job->err = err;
+  if (err || !job->compressed)
+    return;
+
+  job->running = pipe_start(&job->t, prefetch_thread, job);
+  if (!job->running)
+    prefetch_thread(job);
+}
+
+// decodes the stored data of a job that overflowed in chunks, as extract_blob()
+// does, so it doesn't have to be read again
+static __int64 prefetch_decode(nsis_reader *r, struct nsis_prefetch_job *job, nsis_write_fn write, void *ctx)
+{
+  __int64 retval = 0;
+  int err;
+
+  lzmaInit(&r->lzma);
+  r->lzma.next_in = (Byte *) job->in;
+  r->lzma.avail_in = job->in_len;
+  do
+  {
+    unsigned int u;
+
+    r->lzma.next_out = (Byte *) r->outbuf;
+    r->lzma.avail_out = r->obufsize;
+    err = lzmaDecode(&r->lzma);
+    if (err < 0)
+      return NSIS_E_DECOMPRESS;
+
+    u = (unsigned int) ((char *) r->lzma.next_out - r->outbuf);
+    if (!u && err != LZMA_STREAM_END)
+      return NSIS_E_DECOMPRESS; // out of input
+    if (u && !write(ctx, r->outbuf, u))
+      return NSIS_E_WRITE;
+    retval += u;
+  }
+  while (err != LZMA_STREAM_END);
+  return retval;
+}
+
+static void prefetch_wait(struct nsis_prefetch_job *job)
+{
+  if (job->running)
+  {
+    pipe_join(&job->t);
+    job->running = 0;
+  }
+}
+
+// queues the blobs that follow until all of the jobs are used
+static void prefetch_fill(nsis_prefetch *p)
+{
+  while (p->queued < p->num_jobs && p->next < p->num)
+  {
+    prefetch_start(p, &p->jobs[(p->head + p->queued) % p->num_jobs], p->next);
+    p->queued++;
+    p->next++;
+  }
+}
+
+static void prefetch_pop(nsis_prefetch *p)
+{
+  prefetch_wait(&p->jobs[p->head]);
+  p->head = (p->head + 1) % p->num_jobs;
+  p->queued--;
+}
+
+void nsis_prefetch_begin(nsis_prefetch *p, nsis_reader *r, const __int64 *offsets, int num, int jobs)
+{
+  memset(p, 0, sizeof(*p));
+  p->r = r;
+  p->offsets = offsets;
+  p->num = num;
+  p->num_jobs = jobs < 1 ? 1 : min(jobs, NSIS_PREFETCH_JOBS);
+}
+
+__int64 nsis_prefetch_extract(nsis_prefetch *p, int index, nsis_write_fn write, void *ctx)
+{
+  struct nsis_prefetch_job *job;
+  __int64 ret;
+
+  // blobs skipped since the last one were decoded for nothing
+  while (p->queued && p->jobs[p->head].index < index)
+    prefetch_pop(p);
+  if (index < 0 || index >= p->num)
+    return NSIS_E_FORMAT;
+  if (!p->queued && index >= p->next)
+    p->next = index;
+  if (index < p->next - p->queued)
+    return nsis_extract_pipelined(p->r, p->offsets[index], write, ctx);
+  prefetch_fill(p);
+
+  job = &p->jobs[p->head];
+  prefetch_wait(job);
+
+  if (job->err == PREFETCH_DIRECT)
+    ret = nsis_extract_pipelined(p->r, p->offsets[index], write, ctx);
+  else if (job->err == PREFETCH_OVERFLOW)
+    ret = prefetch_decode(p->r, job, write, ctx);
+  else if (job->err < 0)
+    ret = job->err;
+  else if (job->len && !write(ctx, job->compressed ? job->out : job->in, job->len))
+    ret = NSIS_E_WRITE;
+  else
+    ret = job->len;
+
+  // the job is free again, for the next blob of the run
+  prefetch_pop(p);
+  prefetch_fill(p);
+  return ret;
+}
+
+void nsis_prefetch_end(nsis_prefetch *p)
+{
+  int i;
+  while (p->queued)
+    prefetch_pop(p);
+  for (i = 0; i < NSIS_PREFETCH_JOBS; i++)
+  {
+    free(p->jobs[i].in);
+    free(p->jobs[i].out);
+    lzmafree(p->jobs[i].s.dynamicData);
+  }
+  memset(p, 0, sizeof(*p));
+}
+
+// strings, see GetNSISString()
+
+static const char *var_names[] = {
+  "CMDLINE", "INSTDIR", "OUTDIR", "EXEDIR", "LANGUAGE", "TEMP",
+  "PLUGINSDIR", "EXEPATH", "EXEFILE", "HWNDPARENT", "_CLICK", "_OUTDIR"
+};
+
+static const struct { int csidl; const char *name; } shell_names[] = {
+  { 0x24, "WINDIR" }, { 0x25, "SYSDIR" }, { 0x02, "SMPROGRAMS" },
+  { 0x07, "SMSTARTUP" }, { 0x10, "DESKTOP" }, { 0x0b, "STARTMENU" },
+  { 0x05, "DOCUMENTS" }, { 0x09, "SENDTO" }, { 0x08, "RECENT" },
+  { 0x06, "FAVORITES" }, { 0x0d, "MUSIC" }, { 0x27, "PICTURES" },
+  { 0x0e, "VIDEOS" }, { 0x13, "NETHOOD" }, { 0x14, "FONTS" },
+  { 0x15, "TEMPLATES" }, { 0x1a, "APPDATA" }, { 0x1c, "LOCALAPPDATA" },
+  { 0x1b, "PRINTHOOD" }, { 0x20, "INTERNET_CACHE" }, { 0x21, "COOKIES" },
+  { 0x22, "HISTORY" }, { 0x28, "PROFILE" }, { 0x30, "ADMINTOOLS" },
+  { 0x26, "PROGRAMFILES" }, { 0x2b, "COMMONFILES" }
+};
+
+// returns the string table offset of a language string of the first language
+static int get_lang_string(const nsis_reader *r, int id)
+{
+  const char *table = r->hdr + r->header->blocks[NB_LANGTABLES].offset;
+  if (!r->header->blocks[NB_LANGTABLES].num || id < 0 ||
+      sizeof(LANGID) + (2 + id + 1) * sizeof(int) > (size_t) r->header->langtable_size)
+    return -1;
+  return ((const int *) (table + sizeof(LANGID) + 2 * sizeof(int)))[id];
+}
+
+static int decode_string(const nsis_reader *r, int offset, char *out, int left, int depth)
+{
+  const char *in;
+  int n = 0;
+
+  if (offset < 0)
+  {
+    // a language string, which points to a normal string
+    offset = depth < 4 ? get_lang_string(r, -(offset + 1)) : -1;
+    if (offset < 0)
+      return 0;
+  }
+
+  in = r->hdr + r->header->blocks[NB_STRINGS].offset + offset;
+  while (*in && n < left - 1)
+  {
+    unsigned char c = (unsigned char) *in++;
+    char tmp[32];
+    const char *s = tmp;
+
+    if (c == NS_SKIP_CODE)
+    {
+      out[n++] = *in++;
+      continue;
+    }
+    if (!NS_IS_CODE(c))
+    {
+      out[n++] = (char) c;
+      continue;
+    }
+
+    if (c == NS_LANG_CODE)
+    {
+      n += decode_string(r, -DECODE_SHORT(in) - 1, out + n, left - n, depth + 1);
+      in += sizeof(SHORT);
+      continue;
+    }
+
+    if (c == NS_VAR_CODE)
+    {
+      int idx = DECODE_SHORT(in);
+      if (idx < 10)
+        sprintf(tmp, "$%d", idx);
+      else if (idx < 20)
+        sprintf(tmp, "$R%d", idx - 10);
+      else if (idx < 20 + (int) (sizeof(var_names) / sizeof(var_names[0])))
+        sprintf(tmp, "$%s", var_names[idx - 20]);
+      else
+        sprintf(tmp, "$_%d_", idx);
+    }
+    else // NS_SHELL_CODE
+    {
+      int csidl = (unsigned char) in[0], i;
+      sprintf(tmp, "$SHELL%d", csidl);
+      for (i = 0; i < (int) (sizeof(shell_names) / sizeof(shell_names[0])); i++)
+      {
+        if (shell_names[i].csidl == csidl)
+        {
+          sprintf(tmp, "$%s", shell_names[i].name);
+          break;
+        }
+      }
+    }
+    in += sizeof(SHORT);
+
+    while (*s && n < left - 1)
+      out[n++] = *s++;
+  }
+  out[n] = 0;
+  return n;
+}
+
+char *nsis_string(nsis_reader *r, int offset, char *buf, int buflen)
+{
+  buf[0] = 0;
+  if (buflen > 0)
+    decode_string(r, offset, buf, buflen, 0);
+  return buf;
+}
+
+// table of contents
+
+static int toc_char(char c)
+{
+  if (c == '/')
+    return '\\';
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 'a';
+  return (unsigned char) c;
+}
+
+static unsigned int toc_hash(const char *name)
+{
+  unsigned int h = 2166136261U; // FNV-1a
+  while (*name)
+    h = (h ^ toc_char(*name++)) * 16777619U;
+  return h;
+}
+
+int nsis_same_name(const char *a, const char *b)
+{
+  while (*a && toc_char(*a) == toc_char(*b))
+    a++, b++;
+  return !*a && !*b;
+}
+
+static int cmp_toc_ref(const void *a, const void *b)
+{
+  const struct nsis_toc_ref *x = (const struct nsis_toc_ref *) a;
+  const struct nsis_toc_ref *y = (const struct nsis_toc_ref *) b;
+  if (x->offset != y->offset)
+    return x->offset < y->offset ? -1 : 1;
+  return x->index - y->index;
+}
+
+static int index_toc(nsis_reader *r)
+{
+  const toc_entry *toc = nsis_toc(r);
+  int num = nsis_toc_num(r), i;
+  char name[NSIS_MAX_STRLEN];
+
+  if (r->toc_hash || !num)
+    return NSIS_OK;
+
+  for (r->toc_hash_size = 16; r->toc_hash_size < num * 2; r->toc_hash_size *= 2);
+  r->toc_hash = (int *) malloc(sizeof(int) * r->toc_hash_size);
+  r->toc_chain = (int *) malloc(sizeof(int) * num);
+  r->toc_offsets = (struct nsis_toc_ref *) malloc(sizeof(struct nsis_toc_ref) * num);
+  if (!r->toc_hash || !r->toc_chain || !r->toc_offsets)
+  {
+    free(r->toc_hash);
+    free(r->toc_chain);
+    free(r->toc_offsets);
+    r->toc_hash = r->toc_chain = NULL;
+    r->toc_offsets = NULL;
+    return NSIS_E_MEMORY;
+  }
+
+  memset(r->toc_hash, -1, sizeof(int) * r->toc_hash_size);
+  // backwards, so the chains are in the order of the table
+  for (i = num - 1; i >= 0; i--)
+  {
+    unsigned int b = toc_hash(nsis_string(r, toc[i].name_ptr, name, sizeof(name))) & (r->toc_hash_size - 1);
+    r->toc_chain[i] = r->toc_hash[b];
+    r->toc_hash[b] = i;
+    r->toc_offsets[i].offset = toc[i].offset;
+    r->toc_offsets[i].index = i;
+  }
+  qsort(r->toc_offsets, num, sizeof(struct nsis_toc_ref), cmp_toc_ref);
+  return NSIS_OK;
+}
+
+int nsis_toc_find(nsis_reader *r, const char *name, int after)
+{
+  char buf[NSIS_MAX_STRLEN];
+  int i;
+
+  if (!nsis_toc_num(r) || index_toc(r))
+    return -1;
+
+  for (i = r->toc_hash[toc_hash(name) & (r->toc_hash_size - 1)]; i >= 0; i = r->toc_chain[i])
+  {
+    if (i > after && nsis_same_name(nsis_string(r, nsis_toc(r)[i].name_ptr, buf, sizeof(buf)), name))
+      return i;
+  }
+  return -1;
+}
+
+int nsis_toc_lookup(nsis_reader *r, __int64 offset, int *refs)
+{
+  int lo = 0, hi = nsis_toc_num(r), n;
+
+  if (refs)
+    *refs = 0;
+  if (!hi || index_toc(r))
+    return -1;
+
+  // the first entry at offset
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (r->toc_offsets[mid].offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == nsis_toc_num(r) || r->toc_offsets[lo].offset != offset)
+    return -1;
+
+  if (refs)
+  {
+    for (n = lo; n < nsis_toc_num(r) && r->toc_offsets[n].offset == offset; n++);
+    *refs = n - lo;
+  }
+  return r->toc_offsets[lo].index;
+}
@@ -0,0 +1,282 @@
+/*
+ * reader.h
+ *
+ * This file is a part of NSIS.
+ *
+ * Copyright (C) 1999-2009 Nullsoft and Contributors
+ *
+ * Licensed under the zlib/libpng license (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * Licence details can be found in the file COPYING.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#ifndef ___NSIS_READER__H___
+#define ___NSIS_READER__H___
+
+// a portable reader for built installers, the host side counterpart of
+// loadHeaders(), ReadSelfFile(), SetSelfFilePointer() and _dodecomp() in
+// exehead/fileform.c. it reads the installer, its .N.dat data volumes and
+// solid installers, everything through a nsis_io so it can be benchmarked
+// or tested against any kind of storage.
+
+#include "../exehead/fileform.h"
+#include "../crc32.h"
+#include "../7zip/LZMADecode.h"
+#include "../pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// errors, all negative
+#define NSIS_OK 0
+#define NSIS_E_OPEN -1      // can't open the installer or a data volume
+#define NSIS_E_READ -2      // read error or unexpected end of file
+#define NSIS_E_FORMAT -3    // no installer or a corrupted header
+#define NSIS_E_CRC -4       // crc mismatch
+#define NSIS_E_DECOMPRESS -5 // corrupted compressed data
+#define NSIS_E_WRITE -6     // the write callback failed
+#define NSIS_E_MEMORY -7
+
+// file I/O used by the reader. read and seek return nonzero on success,
+// read only succeeds if all of the bytes were read.
+typedef struct
+{
+  void * (*open)(const char *path);
+  int (*read)(void *f, void *buf, unsigned int len);
+  int (*seek)(void *f, __int64 pos);
+  __int64 (*size)(void *f);
+  void (*close)(void *f);
+} nsis_io;
+
+// stdio based nsis_io
+extern const nsis_io nsis_stdio;
+
+#define NSIS_VOLUME_HANDLES 4
+#define NSIS_MAX_VERIFY_THREADS 16
+
+// where the stored data of the reader comes from
+enum
+{
+  NR_SELF,    // the installer itself
+  NR_VOLUMES, // the .N.dat data volumes
+  NR_SOLID    // the decoded solid stream
+};
+
+typedef struct
+{
+  const nsis_io *io;
+  char path[1024]; // the installer, data volumes are named after it
+  void *f;
+
+  firstheader fh;
+  __int64 fh_offset; // offset of the firstheader in the installer
+
+  char *hdr; // the uncompressed header, block offsets are relative to it
+  header *header;
+  entry *entries; // unpacked from the header, see nsis_entries()
+
+  // the stored data is addressed by stored offsets. the datablock starts
+  // at db_offset, datablock offsets as found in entries are added to it.
+  int source; // NR_*
+  __int64 pos; // current stored offset
+  __int64 db_offset;
+  __int64 db_length;
+
+  // NR_SELF: stored offset 0 is right after the firstheader
+  // NR_VOLUMES: stored offset 0 is the start of the first volume's data
+  dataheader *volumes;
+  int num_volumes;
+  int cur_volume; // the volume vf reads, -1 if none
+  void *vf;
+  // the last volumes used are kept open, like the exehead does
+  struct
+  {
+    void *f; // NULL if unused
+    int volume;
+    unsigned int used;
+  } vhandles[NSIS_VOLUME_HANDLES];
+  unsigned int vclock;
+  int volume_opens; // how many times a volume was opened
+  int verify_threads; // data volumes nsis_verify_crc() checks at once, 4 by default
+
+  // NR_SOLID: stored offsets are offsets in the decoded stream
+  solidheader sh;
+  solidblock *blocks; // seek table, num_blocks+1 entries
+  __int64 blocks_offset; // offset of the first block in the installer
+  char *block; // the last decoded block
+  int cur_block; // -1 if none
+  char *block_in; // compressed input of the block being decoded
+  lzma_stream block_lzma;
+
+  lzma_stream lzma;
+  char *inbuf;
+  char *outbuf;
+  unsigned int ibufsize, obufsize; // see nsis_set_buffers()
+  char *pipe_mem; // buffers of nsis_extract_pipelined(), allocated on first use
+
+  // indexes of the table of contents, built on first use
+  int *toc_hash; // toc_hash_size chains of entries with the same name hash
+  int *toc_chain; // the entry that follows each entry in its chain, or -1
+  int toc_hash_size;
+  struct nsis_toc_ref
+  {
+    __int64 offset;
+    int index;
+  } *toc_offsets; // the entries sorted by offset
+} nsis_reader;
+
+// called with the uncompressed data of a blob, returns nonzero on success
+typedef int (*nsis_write_fn)(void *ctx, const void *data, unsigned int len);
+
+/**
+ * Opens the installer at path along with its data volumes and reads its
+ * header. Nothing but the header is verified, see nsis_verify_crc().
+ * On error, r doesn't have to be closed.
+ */
+int nsis_open(nsis_reader *r, const char *path, const nsis_io *io);
+void nsis_close(nsis_reader *r);
+
+/**
+ * Sizes the buffers extraction reads and decodes with the way the exehead
+ * does: no more than the installer data needs, size bytes at most, split
+ * in the proportion of NSIS_IBUFSIZE and NSIS_OBUFSIZE. nsis_open() passes
+ * NSIS_IBUFSIZE + NSIS_OBUFSIZE.
+ */
+int nsis_set_buffers(nsis_reader *r, unsigned int size);
+
+/**
+ * Checks the crc of the installer and of each data volume, the way the
+ * exehead does before it starts with CRCCheck force or without
+ * FH_FLAGS_BLOB_CRC. Up to
+ * r->verify_threads data volumes are checked at once.
+ * @param read_bytes Receives the amount of data read, may be NULL.
+ * @return NSIS_OK, NSIS_E_CRC or another error.
+ */
+int nsis_verify_crc(nsis_reader *r, __int64 *read_bytes);
+
+/**
+ * Reads the header of the blob at offset in the datablock.
+ * @param stored_len Receives the length of the stored data.
+ * @param compressed Receives nonzero if the data is compressed.
+ * @param crc Receives the crc32 of the stored data.
+ */
+int nsis_blob_info(nsis_reader *r, __int64 offset, __int64 *stored_len, int *compressed, crc32_t *crc);
+
+/**
+ * Reads the stored data of the blob at offset in the datablock into buf,
+ * which must be as large as the stored_len nsis_blob_info() returns. The
+ * crc of the blob is checked.
+ */
+int nsis_read_blob(nsis_reader *r, __int64 offset, void *buf);
+
+/**
+ * Decompresses the blob at offset in the datablock and passes the data to
+ * write. The crc of the blob is checked as it is read.
+ * @return The uncompressed length or a negative error.
+ */
+__int64 nsis_extract(nsis_reader *r, __int64 offset, nsis_write_fn write, void *ctx);
+
+/**
+ * Same as nsis_extract(), but the stored data is read on one thread and
+ * write is called on another while the data is decoded, the way _dodecomp()
+ * extracts files. Blobs that take a single read, and solid installers,
+ * are extracted by nsis_extract().
+ */
+__int64 nsis_extract_pipelined(nsis_reader *r, __int64 offset, nsis_write_fn write, void *ctx);
+
+// decodes the blobs of a run of files ahead, see ExtractFileEntry()
+
+#define NSIS_PREFETCH_JOBS 16
+#define NSIS_PREFETCH_SIZE (1024*1024) // larger blobs are left to nsis_extract_pipelined()
+
+struct nsis_prefetch_job
+{
+  int index; // of the blob in offsets
+  char *in;
+  unsigned int in_alloc;
+  unsigned int in_len; // of the stored data in in
+  char *out; // NSIS_PREFETCH_SIZE bytes
+  unsigned int len; // of the data in out, or in if stored uncompressed
+  int compressed;
+  int err; // NSIS_OK, a negative error or 1 if left to nsis_extract_pipelined()
+  lzma_stream s;
+  pipe_thread t;
+  int running;
+};
+
+typedef struct
+{
+  nsis_reader *r;
+  const __int64 *offsets; // of the blobs, in the order they are extracted
+  int num;
+  int next; // the next blob to read
+  int num_jobs;
+  int head, queued; // the jobs queued in jobs
+  struct nsis_prefetch_job jobs[NSIS_PREFETCH_JOBS];
+} nsis_prefetch;
+
+/**
+ * Starts a run of num blobs, extracted in order by nsis_prefetch_extract().
+ * Up to jobs blobs that follow the one being extracted are read and decoded
+ * in memory ahead of time, on a thread each. Blobs the table of contents
+ * lists as larger than NSIS_PREFETCH_SIZE are left to the pipeline without
+ * reading them first. offsets must stay valid until nsis_prefetch_end().
+ * Only the calling thread uses r.
+ */
+void nsis_prefetch_begin(nsis_prefetch *p, nsis_reader *r, const __int64 *offsets, int num, int jobs);
+
+/**
+ * Same as nsis_extract_pipelined() for offsets[index]. Blobs before index
+ * that weren't extracted are dropped. Blobs are only decoded ahead in order,
+ * going back to an earlier index extracts it without prefetching.
+ */
+__int64 nsis_prefetch_extract(nsis_prefetch *p, int index, nsis_write_fn write, void *ctx);
+
+/**
+ * Waits for the threads and frees the memory of the run.
+ */
+void nsis_prefetch_end(nsis_prefetch *p);
+
+/**
+ * Decodes the string at offset in the string table into buf. Variables,
+ * shell folders and language strings are written by their names.
+ */
+char *nsis_string(nsis_reader *r, int offset, char *buf, int buflen);
+
+// the table of contents, see SetTOC. nsis_toc_num() is 0 if the installer
+// has none, the lookups then find nothing.
+#define nsis_toc(r) ((const toc_entry *) ((r)->hdr + (r)->header->blocks[NB_TOC].offset))
+#define nsis_toc_num(r) ((r)->header->blocks[NB_TOC].num)
+
+/**
+ * Finds the next file named name in the table of contents, after the entry
+ * at index after, -1 to start. Names are compared the way Windows does and
+ * / matches \, so both "dir\file" and "dir/file" find File /oname=dir\file.
+ * @return The index of the entry, or -1 if there's no other.
+ */
+int nsis_toc_find(nsis_reader *r, const char *name, int after);
+int nsis_same_name(const char *a, const char *b); // as nsis_toc_find() compares
+
+/**
+ * Finds the blob at offset in the datablock in the table of contents.
+ * @param refs Receives how many files share the blob, the datablock
+ * optimizer stores identical files once. May be NULL.
+ * @return The index of its first entry, or -1 if it isn't listed.
+ */
+int nsis_toc_lookup(nsis_reader *r, __int64 offset, int *refs);
+
+#define nsis_entries(r) ((r)->entries)
+#define nsis_num_entries(r) ((r)->header->blocks[NB_ENTRIES].num)
+
+const char *nsis_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//!___NSIS_READER__H___
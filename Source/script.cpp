@@ -154,38 +154,21 @@ void CEXEBuild::restore_timestamp_predefine(TCHAR *oldtimestamp)
   }
 }
 
-TCHAR *CEXEBuild::set_line_predefine(int linecnt, BOOL is_macro)
+struct line_predefine
 {
-  TCHAR* linebuf = NULL;
-  MANAGE_WITH(linebuf, free);
+  int line;
+  BOOL is_macro; // the line of a macro, __LINE__ gets the line it's inserted on in front
+};
 
-  TCHAR temp[128] = _T("");
-  _stprintf(temp,_T("%d"),linecnt);
-
-  TCHAR *oldline = definedlist.find(_T("__LINE__"));
-  if(oldline) {
-    oldline = _tcsdup(oldline);
-    definedlist.del(_T("__LINE__"));
-  }
-  if(is_macro && oldline) {
-    linebuf = (TCHAR *)malloc((_tcslen(oldline)+_tcslen(temp)+2)*sizeof(TCHAR));
-    _stprintf(linebuf,_T("%s.%s"),oldline,temp);
-  }
-  else {
-    linebuf = _tcsdup(temp);
-  }
-  definedlist.add(_T("__LINE__"),linebuf);
-
-  return oldline;
+void CEXEBuild::set_line_predefine(int linecnt, BOOL is_macro)
+{
+  struct line_predefine lp = { linecnt, is_macro };
+  m_line_predefines.add(&lp, sizeof(lp));
 }
 
-void CEXEBuild::restore_line_predefine(TCHAR *oldline)
+void CEXEBuild::restore_line_predefine()
 {
-  definedlist.del(_T("__LINE__"));
-  if(oldline) {
-      definedlist.add(_T("__LINE__"),oldline);
-      free(oldline);
-  }
+  m_line_predefines.resize(m_line_predefines.getlen() - sizeof(struct line_predefine));
 }
 
 void CEXEBuild::set_date_time_predefines()
@@ -225,6 +208,44 @@ void CEXEBuild::del_date_time_predefines()
 }
 #endif
 
+// looks up a define. __LINE__ and __MACRO__ change with every line and
+// every macro, so they're only worked out when a script uses them.
+TCHAR *CEXEBuild::find_define(const TCHAR *name)
+{
+  if (name[0] == _T('_') && name[1] == _T('_'))
+  {
+#ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
+    if (!_tcsicmp(name,_T("__LINE__")))
+    {
+      struct line_predefine *lp = (struct line_predefine *) m_line_predefines.get();
+      int n = m_line_predefines.getlen() / sizeof(struct line_predefine);
+      int first = n - 1;
+      if (n == 0) return NULL;
+
+      // the lines of macros follow the line they're inserted on: 12.3.1
+      while (first > 0 && lp[first].is_macro) first--;
+      m_line_predefine_value.resize(0);
+      for (int i = first; i < n; i++)
+      {
+        TCHAR temp[16];
+        _stprintf(temp,i > first ? _T(".%d") : _T("%d"),lp[i].line);
+        m_line_predefine_value.add(temp,_tcslen(temp)*sizeof(TCHAR));
+      }
+      m_line_predefine_value.add(_T(""),sizeof(_T("")));
+      return (TCHAR *) m_line_predefine_value.get();
+    }
+#endif
+    if (!_tcsicmp(name,_T("__MACRO__")))
+    {
+      if (m_include_record) include_record_define(name,m_currentmacroname);
+      return (TCHAR *) m_currentmacroname;
+    }
+  }
+  TCHAR *value=definedlist.find(name);
+  if (m_include_record) include_record_define(name,value);
+  return value;
+}
+
 int CEXEBuild::process_script(FILE *filepointer, const TCHAR *filename, BOOL unicode)
 {
   linecnt = 0;
@@ -370,6 +391,7 @@ parse_again:
 
   int np,op,pos;
   int tkid=get_commandtoken(line.gettoken_str(0),&np,&op,&pos);
+  if (m_include_guard.state != GUARD_NONE) include_guard_line(tkid,line);
   if (tkid == -1)
   {
     TCHAR *p=line.gettoken_str(0);
@@ -380,6 +402,7 @@ parse_again:
         ERROR_MSG(_T("Invalid label: %s (labels cannot begin with !, $, -, +, or 0-9)\n"),line.gettoken_str(0));
         return PS_ERROR;
       }
+      include_not_cacheable();
       if (add_label(line.gettoken_str(0))) return PS_ERROR;
       line.eattoken();
       goto parse_again;
@@ -490,6 +513,7 @@ parse_again:
 
       else if (line.getnumtokens() == 3) {
         if (!_tcsicmp(line.gettoken_str(1),_T("/fileexists"))) {
+          include_not_cacheable();
           TCHAR *fc = my_convert(line.gettoken_str(2));
           tstring dir = get_dir_name(fc), spec = get_file_name(fc);
           my_convert_free(fc);
@@ -570,7 +594,7 @@ parse_again:
         {
           int new_s;
           if (tkid == TOK_P_IFNDEF || tkid == TOK_P_IFDEF)
-            new_s=!!definedlist.find(line.gettoken_str(p));
+            new_s=!!find_define(line.gettoken_str(p));
           else
             new_s=MacroExists(line.gettoken_str(p));
           if (tkid == TOK_P_IFNDEF || tkid == TOK_P_IFMACRONDEF)
@@ -615,161 +639,156 @@ parse_again:
   return PS_OK;
 }
 
-// Func size: about 140 lines (orip)
-#ifdef NSIS_FIX_DEFINES_IN_STRINGS
-void CEXEBuild::ps_addtoline(const TCHAR *str, GrowBuf &linedata, StringList &hist, bool bIgnoreDefines /*= false*/)
+// the $ that starts ${VAR}, $%VAR% and the escapes is never part of a
+// multibyte character, so all the text up to it can be copied in one go
+static inline const TCHAR *ps_skiptext(const TCHAR *in, const TCHAR *end)
+{
+  while (in < end && *in != _T('$'))
+#ifdef _UNICODE
+    in++;
 #else
-void CEXEBuild::ps_addtoline(const TCHAR *str, GrowBuf &linedata, StringList &hist)
+    in=CharNext(in);
 #endif
+  return in;
+}
+
+// returns the } that closes the ${ in front of in, NULL if there is none
+static const TCHAR *ps_findbrace(const TCHAR *in, const TCHAR *end)
+{
+  unsigned int bn = 0;
+  while (in < end)
+  {
+    if (*in == _T('{')) bn++;
+    if (*in == _T('}') && bn-- == 0) return in;
+    in=CharNext(in);
+  }
+  return NULL;
+}
+
+void CEXEBuild::ps_addtoline(const TCHAR *str, GrowBuf &linedata)
+{
+  ps_addtoline(str,str+_tcslen(str),linedata,false);
+}
+
+// Func size: about 140 lines (orip)
+void CEXEBuild::ps_addtoline(const TCHAR *in, const TCHAR *end, GrowBuf &linedata, bool bIgnoreDefines)
 {
   // convert $\r, $\n to their literals
   // preprocessor replace ${VAR} and $%VAR% with whatever value
   // note that if VAR does not exist, ${VAR} or $%VAR% will go through unmodified
-  const TCHAR *in=str;
-  while (*in)
+  while (in < end)
   {
-    int add=1;
-    TCHAR *t;
-    TCHAR c=*in;
-    t=CharNext(in);
+    const TCHAR *text=in;
+    in=ps_skiptext(in,end);
+    linedata.add((void*)text,(in-text)*sizeof(TCHAR));
+    if (in == end) break;
 
-    if (t-in > 1) // handle multibyte chars (no escape)
-    {
-      linedata.add((void*)in,(t-in)*sizeof(TCHAR));
-      in=t;
-      continue;
-    }
-    in=t;
+    TCHAR c=*in++;
+    // in and end may be a define name inside another one, don't look past it
+    TCHAR n0=in < end ? in[0] : 0;
+    TCHAR n1=in+1 < end ? in[1] : 0;
 
-    if (c == _T('$'))
+    if (n0 == _T('\\'))
     {
-      if (in[0] == _T('\\'))
+      if (n1 == _T('r'))
       {
-        if (in[1] == _T('r'))
-        {
-          in+=2;
-          c=_T('\r');
-        }
-        else if (in[1] == _T('n'))
-        {
-          in+=2;
-          c=_T('\n');
-        }
-        else if (in[1] == _T('t'))
-        {
-          in+=2;
-          c=_T('\t');
-        }
+        in+=2;
+        c=_T('\r');
       }
-      else if (in[0] == _T('{'))
+      else if (n1 == _T('n'))
       {
-        TCHAR *s=_tcsdup(in+1);
-        MANAGE_WITH(s, free);
-        TCHAR *t=s;
-        unsigned int bn = 0;
-        while (*t)
-        {
-          if (*t == _T('{')) bn++;
-          if (*t == _T('}') && bn-- == 0) break;
-          t=CharNext(t);
-        }
-        if (*t && t!=s
-#ifdef NSIS_FIX_DEFINES_IN_STRINGS
-          && !bIgnoreDefines
-#endif
-          )
-        {
-          *t=0;
-          // check for defines inside the define name - ${bla${blo}}
-          GrowBuf defname;
-          ps_addtoline(s,defname,hist);
-          defname.add(_T(""),sizeof(_T("")));
-          t=definedlist.find((TCHAR*)defname.get());
-          if (t && hist.find((TCHAR*)defname.get(),0)<0)
-          {
-            in+=_tcslen(s)+2;
-            add=0;
-            hist.add((TCHAR*)defname.get(),0);
-#ifdef NSIS_FIX_DEFINES_IN_STRINGS
-            ps_addtoline(t,linedata,hist,true);
-#else
-            ps_addtoline(t,linedata,hist);
-#endif
-            hist.delbypos(hist.find((TCHAR*)defname.get(),0));
-          }
-        }
+        in+=2;
+        c=_T('\n');
       }
-      else if (in[0] == _T('%'))
+      else if (n1 == _T('t'))
       {
-        TCHAR *s=_tcsdup(in+1);
-        MANAGE_WITH(s, free);
-        TCHAR *t=s;
-        while (*t)
-        {
-          if (*t == _T('%')) break;
-          t=CharNext(t);
-        }
-        if (*t && t!=s)
-        {
-          *t=0;
-          // check for defines inside the define name - ${bla${blo}}
-          GrowBuf defname;
-          ps_addtoline(s,defname,hist);
-          defname.add(_T(""),sizeof(_T("")));
-          t=_tgetenv((TCHAR*)defname.get());
-          if (t && hist.find((TCHAR*)defname.get(),0)<0)
-          {
-            in+=_tcslen(s)+2;
-            add=0;
-            hist.add((TCHAR*)defname.get(),0);
+        in+=2;
+        c=_T('\t');
+      }
+    }
+    else if (n0 == _T('{'))
+    {
+      const TCHAR *t=ps_findbrace(in+1,end);
+      if (t && t!=in+1
 #ifdef NSIS_FIX_DEFINES_IN_STRINGS
-            ps_addtoline(t,linedata,hist,true);
-#else
-            ps_addtoline(t,linedata,hist);
+        && !bIgnoreDefines
 #endif
-            hist.delbypos(hist.find((TCHAR*)defname.get(),0));
-          }
-        }
+        && ps_addvalue(in+1,t,FALSE,linedata))
+      {
+        in=t+1;
+        continue;
+      }
+    }
+    else if (n0 == _T('%'))
+    {
+      const TCHAR *t=in+1;
+      while (t < end && *t != _T('%')) t=CharNext(t);
+      if (t < end && t!=in+1 && ps_addvalue(in+1,t,TRUE,linedata))
+      {
+        in=t+1;
+        continue;
       }
+    }
 #ifdef NSIS_FIX_DEFINES_IN_STRINGS
-      else if (in[0] == _T('$'))
+    else if (n0 == _T('$'))
+    {
+      if (n1 == _T('{')) // Found $$ before - Don't replace this define
       {
-        if (in[1] == _T('{')) // Found $$ before - Don't replace this define
-        {
-          TCHAR *s=_tcsdup(in+2);
-          MANAGE_WITH(s, free);
-          TCHAR *t=s;
-          unsigned int bn = 0;
-          while (*t)
-          {
-            if (*t == _T('{')) bn++;
-            if (*t == _T('}') && bn-- == 0) break;
-            t=CharNext(t);
-          }
-          if (*t && t!=s)
-          {
-            *t=0;
-            // add text unchanged
-            GrowBuf defname;
-            ps_addtoline(s,defname,hist);
-            in++;
-          }
-        }
-        else
-        {
-          linedata.add((void*)&c,1*sizeof(TCHAR));
-          in++;
-        }
+        const TCHAR *t=ps_findbrace(in+2,end);
+        if (t && t!=in+2) in++; // add text unchanged
+      }
+      else
+      {
+        linedata.add((void*)&c,1*sizeof(TCHAR));
+        in++;
       }
-#endif
     }
-    if (add) linedata.add((void*)&c,1*sizeof(TCHAR));
+#endif
+    linedata.add((void*)&c,1*sizeof(TCHAR));
   }
 }
 
+// Adds the value of the define (or environment variable) named by name to
+// end to linedata. Returns 0 if there's no such define or if it's already
+// being replaced further up, so ${a} defined as ${a} doesn't go on forever.
+int CEXEBuild::ps_addvalue(const TCHAR *name, const TCHAR *end, BOOL env, GrowBuf &linedata)
+{
+  int base=m_ps_names.getlen();
+  const TCHAR *p=name;
+  while (p < end && *p != _T('$')) p++;
+  if (p < end)
+  {
+    // check for defines inside the define name - ${bla${blo}}
+    TinyGrowBuf defname;
+    ps_addtoline(name,end,defname,false);
+    m_ps_names.add(defname.get(),defname.getlen());
+  }
+  else
+    m_ps_names.add((void*)name,(end-name)*sizeof(TCHAR));
+  m_ps_names.add(_T(""),sizeof(_T("")));
+
+  // the names below this one are the ones being replaced
+  const TCHAR *names=(const TCHAR *) m_ps_names.get();
+  const TCHAR *key=(const TCHAR *) ((const char *) names + base);
+  if (env) include_not_cacheable(); // the cache doesn't check the environment
+  TCHAR *value=env ? _tgetenv(key) : find_define(key);
+  for (const TCHAR *n=names; value && n<key; n+=_tcslen(n)+1)
+    if (!_tcsicmp(n,key)) value=NULL;
+
+  if (value)
+#ifdef NSIS_FIX_DEFINES_IN_STRINGS
+    ps_addtoline(value,value+_tcslen(value),linedata,true);
+#else
+    ps_addtoline(value,value+_tcslen(value),linedata,false);
+#endif
+  m_ps_names.resize(base);
+  return value != NULL;
+}
+
 int CEXEBuild::parseScript()
 {
   TCHAR str[MAX_LINELENGTH];
+  GrowBuf linedata; // kept for all the lines, doParse() is done with it
 
   for (;;)
   {
@@ -785,21 +804,20 @@ int CEXEBuild::parseScript()
     while (p >= str && (*p == _T('\r') || *p == _T('\n') || *p == _T(' ') || *p == _T('\t'))) p--;
     *++p=0;
 
-    StringList hist;
-    GrowBuf linedata;
+    linedata.resize(0);
 
 #ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
   // Added by Sunil Kamath 11 June 2003
-    TCHAR *oldline = set_line_predefine(linecnt, FALSE);
+    set_line_predefine(linecnt, FALSE);
 #endif
 
-    ps_addtoline(str,linedata,hist);
+    ps_addtoline(str,linedata);
     linedata.add(_T(""),sizeof(_T("")));
     int ret=doParse((TCHAR*)linedata.get());
 
 #ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
     // Added by Sunil Kamath 11 June 2003
-    restore_line_predefine(oldline);
+    restore_line_predefine();
 #endif
 
     if (ret != PS_OK) return ret;
@@ -808,9 +826,608 @@ int CEXEBuild::parseScript()
   return PS_EOF;
 }
 
+// The include cache. While makensis has an include cache directory, a file
+// that's !included is recorded as it's parsed: the defines and macros it
+// finds as the files including it left them, the files its !includes find
+// and the defines, macros and LangStrings it leaves behind. Those go into a
+// cache entry named after the file's path and contents. The next time the
+// file is included, the entry is replayed instead of parsing the file again,
+// if its !includes still find the same files and all it found is still the
+// same. Files that do anything else, or warn, aren't cached.
+
+struct include_record
+{
+  bool cacheable;
+  DefineList defines;         // the defines before the file
+  DefineList macros;          // the macros before it, lowercase name=serial
+  const TCHAR *macroname;     // ${__MACRO__} before it
+  DefineList define_reads;    // defines it found as they were before it
+  DefineList undefined_reads; // defines it found missing as before it
+  DefineList macro_reads;     // macros it looked for, lowercase name=1 or 0
+  GrowBuf includes;           // what its !includes found, see include_record_include()
+  int num_includes;
+  GrowBuf langstrings;        // the LangStrings it set, see include_record_langstring()
+  int num_langstrings;
+  // the file has to leave these as it found them
+  int display[4];
+  TinyGrowBuf verbose_stack;
+  bool inside_comment;
+  int num_ifblock;
+  int linebuild_len;
+};
+
+static const TCHAR include_cache_magic[] = _T("NSIS include cache 4");
+
+// FNV-1a, 64 bits
+static const UINT64 include_hash_basis=((UINT64) 0xcbf29ce4 << 32) | 0x84222325;
+
+static UINT64 include_hash(UINT64 hash, const void *data, size_t len)
+{
+  const UINT64 prime=((UINT64) 0x100 << 32) | 0x1b3;
+  const unsigned char *p=(const unsigned char *) data;
+  while (len--)
+  {
+    hash^=*p++;
+    hash*=prime;
+  }
+  return hash;
+}
+
+static tstring include_hash_str(UINT64 hash)
+{
+  TCHAR buf[17];
+  _stprintf(buf,_T("%08x%08x"),(unsigned int) (hash >> 32),(unsigned int) hash);
+  return buf;
+}
+
+// hashes the contents of the file, returns an empty string if it can't
+static tstring include_hash_file(const TCHAR *path)
+{
+  FILE *f=FOPEN(path,"rb");
+  if (!f) return tstring();
+  MANAGE_WITH(f, fclose);
+
+  UINT64 hash=include_hash_basis;
+  char buf[16384];
+  size_t n;
+  while ((n=fread(buf,1,sizeof(buf),f)) > 0)
+    hash=include_hash(hash,buf,n);
+  if (ferror(f)) return tstring();
+  return include_hash_str(hash);
+}
+
+// the entries are NUL terminated strings, numbers are written out too
+static void include_cache_add(GrowBuf &out, const TCHAR *s)
+{
+  out.add(s,(_tcslen(s)+1)*sizeof(TCHAR));
+}
+
+static void include_cache_add(GrowBuf &out, int i)
+{
+  TCHAR buf[16];
+  _stprintf(buf,_T("%d"),i);
+  include_cache_add(out,buf);
+}
+
+// adds the number of items in list, then the list
+static void include_cache_add_list(GrowBuf &out, int n, GrowBuf &list)
+{
+  include_cache_add(out,n);
+  out.add(list.get(),list.getlen());
+  list.resize(0);
+}
+
+class include_cache_reader
+{
+  public:
+    // data has to end with an extra NUL
+    include_cache_reader(const GrowBuf &data) :
+      m_p((const TCHAR *) data.get()),
+      m_end((const TCHAR *) data.get() + data.getlen()/sizeof(TCHAR) - 1) {}
+
+    // returns NULL past the end
+    const TCHAR *next()
+    {
+      if (m_p >= m_end) return NULL;
+      const TCHAR *s=m_p;
+      m_p+=_tcslen(m_p)+1;
+      return s;
+    }
+
+    // returns -1 past the end
+    int count()
+    {
+      const TCHAR *s=next();
+      return s ? _ttoi(s) : -1;
+    }
+
+  private:
+    const TCHAR *m_p, *m_end;
+};
+
+// the commands a file can use and still be replayed from the cache
+static bool include_cacheable_command(int which_token, LineParser &line)
+{
+  switch (which_token)
+  {
+    case TOK_P_DEFINE:
+    {
+      int a=1;
+      if (!_tcsicmp(line.gettoken_str(a),_T("/ifndef")) || !_tcsicmp(line.gettoken_str(a),_T("/redef")))
+        a++;
+      const TCHAR *opt=line.gettoken_str(a);
+      return _tcsicmp(opt,_T("/date")) && _tcsicmp(opt,_T("/utcdate")) &&
+        _tcsicmp(opt,_T("/file")) && _tcsicmp(opt,_T("/file_noerr"));
+    }
+    case TOK_P_UNDEF:
+    case TOK_P_MACRO:
+    case TOK_P_MACROEND:
+    case TOK_P_INCLUDE:
+    case TOK_P_MACROUNDEF:
+    case TOK_P_INSERTMACRO:
+    case TOK_P_VERBOSE:
+    case TOK_P_SEARCHREPLACESTRING:
+    case TOK_LANGSTRING:
+      return true;
+  }
+  return false;
+}
+
+void CEXEBuild::include_not_cacheable()
+{
+  if (m_include_record) m_include_record->cacheable=false;
+}
+
+void CEXEBuild::include_record_start()
+{
+  struct include_record *rec=new include_record;
+  rec->cacheable=true;
+  rec->num_includes=0;
+  rec->num_langstrings=0;
+  int i;
+  for (i=0; i<definedlist.getnum(); i++)
+    rec->defines.add(definedlist.getname(i),definedlist.getvalue(i));
+  for (i=0; i<m_macros.getnum(); i++)
+  {
+    struct macro *mac=m_macros.get(i);
+    TCHAR serial[16];
+    _stprintf(serial,_T("%d"),mac->serial);
+    rec->macros.add(lowercase(mac->name).c_str(),serial);
+  }
+  rec->macroname=m_currentmacroname;
+  rec->display[0]=display_errors;
+  rec->display[1]=display_warnings;
+  rec->display[2]=display_info;
+  rec->display[3]=display_script;
+  rec->verbose_stack.add(verbose_stack.get(),verbose_stack.getlen());
+  rec->inside_comment=inside_comment;
+  rec->num_ifblock=num_ifblock();
+  rec->linebuild_len=(int) m_linebuild.getlen();
+  m_include_record=rec;
+}
+
+// called with what find_define() found
+void CEXEBuild::include_record_define(const TCHAR *name, const TCHAR *value)
+{
+  struct include_record *rec=m_include_record;
+  if (!rec->cacheable || rec->define_reads.find(name) || rec->undefined_reads.find(name))
+    return;
+  // only what the file didn't change itself is up to the files including it
+  const TCHAR *before=_tcsicmp(name,_T("__MACRO__")) ? rec->defines.find(name) : rec->macroname;
+  if (!value && !before)
+    rec->undefined_reads.add(name);
+  else if (value && before && !_tcscmp(value,before))
+    rec->define_reads.add(name,value);
+}
+
+// called with the files an !include found, the entry checks the same search
+// still finds the same files, as they were
+void CEXEBuild::include_record_include(const TCHAR *spec, const std::vector<tstring> &files)
+{
+  struct include_record *rec=m_include_record;
+  if (!rec->cacheable) return;
+  TinyGrowBuf found;
+  for (size_t i=0; i<files.size(); i++)
+  {
+    tstring hash=include_hash_file(files[i].c_str());
+    if (hash.empty())
+    {
+      include_not_cacheable();
+      return;
+    }
+    include_cache_add(found,get_full_path(files[i]).c_str());
+    include_cache_add(found,hash.c_str());
+  }
+  include_cache_add(rec->includes,spec);
+  include_cache_add_list(rec->includes,(int) files.size(),found);
+  rec->num_includes++;
+}
+
+// called with a LangString the file set, as the command got it. the entry
+// sets it again the same way, for the language tables as they are then.
+void CEXEBuild::include_record_langstring(const TCHAR *name, LANGID lang, const TCHAR *str)
+{
+  struct include_record *rec=m_include_record;
+  if (!rec->cacheable) return;
+  include_cache_add(rec->langstrings,name);
+  include_cache_add(rec->langstrings,(int) lang);
+#ifndef _UNICODE
+  if (build_include_isutf8)
+    include_cache_add(rec->langstrings,_T("u"));
+  else
+#endif
+    include_cache_add(rec->langstrings,curfile_unicode ? _T("1") : _T("0"));
+  include_cache_add(rec->langstrings,str);
+  rec->num_langstrings++;
+}
+
+// returns true if the macro is one the file didn't add itself
+bool CEXEBuild::include_record_macro(const TCHAR *name)
+{
+  struct include_record *rec=m_include_record;
+  tstring key=lowercase(name);
+  struct macro *mac=m_macros.find(name);
+  const TCHAR *before=rec->macros.find(key.c_str());
+  bool outside=mac && before && mac->serial == _ttoi(before);
+  if (rec->cacheable && !rec->macro_reads.find(key.c_str()))
+  {
+    if (outside)
+      rec->macro_reads.add(key.c_str(),_T("1"));
+    else if (!mac && !before)
+      rec->macro_reads.add(key.c_str(),_T("0"));
+  }
+  return outside;
+}
+
+void CEXEBuild::include_cache_save(const tstring &cachefile, int parse_ms, const tstring &guard)
+{
+  struct include_record *rec=m_include_record;
+  if (!rec->cacheable) return;
+  if (rec->display[0] != display_errors || rec->display[1] != display_warnings ||
+      rec->display[2] != display_info || rec->display[3] != display_script ||
+      rec->verbose_stack.getlen() != verbose_stack.getlen() ||
+      (verbose_stack.getlen() && memcmp(rec->verbose_stack.get(),verbose_stack.get(),(size_t) verbose_stack.getlen())) ||
+      rec->inside_comment != inside_comment || rec->num_ifblock != num_ifblock() ||
+      rec->linebuild_len != m_linebuild.getlen())
+    return;
+
+  GrowBuf out, list;
+  int i, n;
+  include_cache_add(out,include_cache_magic);
+  include_cache_add(out,(int) sizeof(TCHAR));
+  include_cache_add(out,parse_ms);
+  include_cache_add(out,guard.c_str());
+
+  // what has to be the same to replay it
+  include_cache_add_list(out,rec->num_includes,rec->includes);
+  include_cache_add(out,rec->define_reads.getnum());
+  for (i=0; i<rec->define_reads.getnum(); i++)
+  {
+    include_cache_add(out,rec->define_reads.getname(i));
+    include_cache_add(out,rec->define_reads.getvalue(i));
+  }
+  include_cache_add(out,rec->undefined_reads.getnum());
+  for (i=0; i<rec->undefined_reads.getnum(); i++)
+    include_cache_add(out,rec->undefined_reads.getname(i));
+  include_cache_add(out,rec->macro_reads.getnum());
+  for (i=0; i<rec->macro_reads.getnum(); i++)
+  {
+    include_cache_add(out,rec->macro_reads.getname(i));
+    include_cache_add(out,rec->macro_reads.getvalue(i));
+  }
+
+  // what it changed, the defines it set
+  for (i=n=0; i<definedlist.getnum(); i++)
+  {
+    const TCHAR *before=rec->defines.find(definedlist.getname(i));
+    if (!before || _tcscmp(before,definedlist.getvalue(i)))
+    {
+      include_cache_add(list,definedlist.getname(i));
+      include_cache_add(list,definedlist.getvalue(i));
+      n++;
+    }
+  }
+  include_cache_add_list(out,n,list);
+  // the ones it deleted
+  for (i=n=0; i<rec->defines.getnum(); i++)
+  {
+    if (!definedlist.find(rec->defines.getname(i)))
+    {
+      include_cache_add(list,rec->defines.getname(i));
+      n++;
+    }
+  }
+  include_cache_add_list(out,n,list);
+  // the macros it deleted, or deleted and added again
+  for (i=n=0; i<rec->macros.getnum(); i++)
+  {
+    struct macro *mac=m_macros.find(rec->macros.getname(i));
+    if (!mac || mac->serial != _ttoi(rec->macros.getvalue(i)))
+    {
+      include_cache_add(list,rec->macros.getname(i));
+      n++;
+    }
+  }
+  include_cache_add_list(out,n,list);
+  // and the ones it added
+  for (i=n=0; i<m_macros.getnum(); i++)
+  {
+    struct macro *mac=m_macros.get(i);
+    const TCHAR *before=rec->macros.find(lowercase(mac->name).c_str());
+    if (before && mac->serial == _ttoi(before)) continue;
+
+    include_cache_add(list,mac->name);
+    int np=0;
+    const TCHAR *p;
+    for (p=mac->params; *p; p+=_tcslen(p)+1) np++;
+    include_cache_add(list,np);
+    for (p=mac->params; *p; p+=_tcslen(p)+1) include_cache_add(list,p);
+    include_cache_add(list,mac->num_lines);
+    for (int l=0; l<mac->num_lines; l++) include_cache_add(list,mac->text+mac->lines[l].text);
+    n++;
+  }
+  include_cache_add_list(out,n,list);
+  // and the LangStrings it set
+  include_cache_add_list(out,rec->num_langstrings,rec->langstrings);
+  include_cache_add(out,_T("end"));
+
+  FILE *cf=FOPEN(cachefile.c_str(),"wb");
+  if (!cf || fwrite(out.get(),1,(size_t) out.getlen(),cf) != (size_t) out.getlen())
+    warning(_T("!include: can't write the include cache file \"%s\""),cachefile.c_str());
+  if (cf) fclose(cf);
+}
+
+// replays the cache entry if all the file found is still the same, guard
+// is set to the file's include guard, if it has one
+bool CEXEBuild::include_cache_load(const TCHAR *f, const tstring &cachefile, tstring &guard)
+{
+  clock_t start=clock();
+  FILE *cf=FOPEN(cachefile.c_str(),"rb");
+  if (!cf) return false;
+  GrowBuf data;
+  {
+    MANAGE_WITH(cf, fclose);
+    char buf[16384];
+    size_t len;
+    while ((len=fread(buf,1,sizeof(buf),cf)) > 0)
+      data.add(buf,len);
+  }
+  data.resize(data.getlen()/sizeof(TCHAR)*sizeof(TCHAR));
+  data.add(_T(""),sizeof(_T("")));
+
+  include_cache_reader in(data);
+  const TCHAR *s=in.next();
+  if (!s || _tcscmp(s,include_cache_magic) || in.count() != (int) sizeof(TCHAR))
+    return false;
+  int parse_ms=in.count();
+  const TCHAR *guard_name=in.next();
+  int i, j, n;
+
+  for (n=in.count(), i=0; i<n; i++)
+  {
+    // the include directories or the working directory may have changed
+    const TCHAR *spec=in.next();
+    int nf=in.count();
+    if (!spec || nf < 0) return false;
+    std::vector<tstring> files;
+    find_include_files(spec,files);
+    if ((int) files.size() != nf) return false;
+    for (j=0; j<nf; j++)
+    {
+      const TCHAR *path=in.next(), *hash=in.next();
+      if (!hash || get_full_path(files[j]) != path || include_hash_file(path) != hash) return false;
+    }
+  }
+  for (n=in.count(), i=0; i<n; i++)
+  {
+    const TCHAR *name=in.next(), *value=in.next();
+    if (!value) return false;
+    const TCHAR *now=find_define(name);
+    if (!now || _tcscmp(now,value)) return false;
+  }
+  for (n=in.count(), i=0; i<n; i++)
+  {
+    const TCHAR *name=in.next();
+    if (!name || find_define(name)) return false;
+  }
+  for (n=in.count(), i=0; i<n; i++)
+  {
+    const TCHAR *name=in.next(), *flag=in.next();
+    if (!flag || !MacroExists(name) != (*flag == _T('0'))) return false;
+  }
+
+  // make sure all the changes are there before making any of them
+  const include_cache_reader changes=in;
+  for (int pass=0; pass<2; pass++)
+  {
+    in=changes;
+    for (n=in.count(), i=0; i<n; i++)
+    {
+      const TCHAR *name=in.next(), *value=in.next();
+      if (!value) return false;
+      if (pass)
+      {
+        definedlist.del(name);
+        definedlist.add(name,value);
+      }
+    }
+    for (n=in.count(), i=0; i<n; i++)
+    {
+      const TCHAR *name=in.next();
+      if (!name) return false;
+      if (pass) definedlist.del(name);
+    }
+    for (n=in.count(), i=0; i<n; i++)
+    {
+      const TCHAR *name=in.next();
+      if (!name) return false;
+      if (pass) m_macros.del(name);
+    }
+    for (n=in.count(), i=0; i<n; i++)
+    {
+      const TCHAR *name=in.next();
+      GrowBuf params, text;
+      int np=in.count();
+      for (j=0; j<np; j++)
+      {
+        const TCHAR *p=in.next();
+        if (!p) return false;
+        if (pass) include_cache_add(params,p);
+      }
+      int nl=in.count();
+      for (j=0; j<nl; j++)
+      {
+        const TCHAR *l=in.next();
+        if (!l) return false;
+        if (pass) include_cache_add(text,l);
+      }
+      if (!name || np < 0 || nl < 0) return false;
+      if (pass)
+      {
+        m_macros.del(name);
+        m_macros.add(name,params,text);
+      }
+    }
+    // LangString 0 is for the language the one before used
+    LANGID last_lang=last_used_lang;
+    std::set<tstring> langstrings;
+    for (n=in.count(), i=0; i<n; i++)
+    {
+      const TCHAR *name=in.next(), *lang_str=in.next(), *mode=in.next(), *str=in.next();
+      if (!str) return false;
+      LANGID lang=(LANGID) _ttoi(lang_str);
+      if (pass)
+      {
+#ifndef _UNICODE
+        if (*mode == _T('u'))
+          SetUTF8LangString((TCHAR *) name,lang,str);
+        else
+#endif
+          SetLangString((TCHAR *) name,lang,str,*mode == _T('1'));
+        continue;
+      }
+#ifndef _UNICODE
+      if (*mode == _T('u') && !Platform_SupportsUTF8Conversion()) return false;
+#endif
+      // parsing the file warns about LangStrings set already
+      if (!lang) lang=last_lang;
+      last_lang=lang;
+      LANGID used=last_used_lang;
+      LanguageTable *table=GetLangTable(lang,false);
+      last_used_lang=used;
+      int sn;
+      TCHAR key[16];
+      _stprintf(key,_T("%u "),(unsigned int) lang);
+      if ((table && build_langstrings.get(name,&sn) >= 0 && table->lang_strings->isset(sn)) ||
+          !langstrings.insert(key+tstring(name)).second)
+        return false;
+    }
+    s=in.next();
+    if (!s || _tcscmp(s,_T("end"))) return false;
+  }
+
+  if (guard_name) guard=guard_name;
+  int load_ms=(int) ((clock()-start)*1000/CLOCKS_PER_SEC);
+  INFO_MSG(_T("!include: \"%s\" from the include cache, %d ms saved\n"),f,parse_ms-load_ms);
+  return true;
+}
+
+// follows the lines of the file being included while they can still be
+// a single !ifndef GUARD ... !endif block, see includeScript()
+void CEXEBuild::include_guard_line(int which_token, LineParser &line)
+{
+  switch (m_include_guard.state)
+  {
+    case GUARD_FIRST_LINE:
+      if (which_token == TOK_P_IFNDEF && line.getnumtokens() == 2)
+      {
+        m_include_guard.state=GUARD_OPEN;
+        m_include_guard.ifblocks=num_ifblock();
+        m_include_guard.name=line.gettoken_str(1);
+      }
+      else
+        m_include_guard.state=GUARD_NONE;
+      break;
+    case GUARD_OPEN:
+      // before doParse() ends or switches the block
+      if (num_ifblock() == m_include_guard.ifblocks+1)
+      {
+        if (which_token == TOK_P_ENDIF)
+          m_include_guard.state=GUARD_CLOSED;
+        else if (which_token == TOK_P_ELSE)
+          m_include_guard.state=GUARD_NONE;
+      }
+      break;
+    default:
+      // anything after the !endif
+      m_include_guard.state=GUARD_NONE;
+      break;
+  }
+}
+
+// the files !include f includes: the ones matching it in the working
+// directory or else in the first include directory that has any
+void CEXEBuild::find_include_files(const TCHAR *f, std::vector<tstring> &files)
+{
+  TCHAR *fc = my_convert(f);
+
+  tstring dir = get_dir_name(fc);
+  tstring spec = get_file_name(fc);
+  tstring basedir = dir + PLATFORM_PATH_SEPARATOR_STR;
+  if (dir == spec) {
+    // no path, just file name
+    dir = _T(".");
+    basedir = _T("");
+  }
+
+  my_convert_free(fc);
+
+  // search working directory
+  boost::scoped_ptr<dir_reader> dr( new_dir_reader() );
+  dr->read(dir);
+
+  for (dir_reader::iterator files_itr = dr->files().begin();
+       files_itr != dr->files().end();
+       files_itr++)
+  {
+    if (dir_reader::matches(*files_itr, spec))
+      files.push_back(basedir + *files_itr);
+  }
+
+  // search include dirs
+  TCHAR *incdir = include_dirs.get();
+  int incdirs = include_dirs.getnum();
+
+  for (int i = 0; i < incdirs && files.empty(); i++, incdir += _tcslen(incdir) + 1) {
+    tstring curincdir = tstring(incdir) + PLATFORM_PATH_SEPARATOR_STR + dir;
+
+    boost::scoped_ptr<dir_reader> dr( new_dir_reader() );
+    dr->read(curincdir);
+
+    for (dir_reader::iterator incdir_itr = dr->files().begin();
+         incdir_itr != dr->files().end();
+         incdir_itr++)
+    {
+      if (dir_reader::matches(*incdir_itr, spec))
+        files.push_back(tstring(incdir) + PLATFORM_PATH_SEPARATOR_STR + basedir + *incdir_itr);
+    }
+  }
+}
+
 int CEXEBuild::includeScript(TCHAR *f)
 {
   SCRIPT_MSG(_T("!include: \"%s\"\n"),f);
+  tstring fullpath=get_full_path(f);
+
+  // the multiple include optimization, a file that was all inside
+  // !ifndef GUARD ... !endif the last time is skipped while GUARD is defined
+  const TCHAR *guard=include_guards.find(fullpath.c_str());
+  if (guard && find_define(guard))
+  {
+    SCRIPT_MSG(_T("!include: skipped, \"%s\" is defined\n"),guard);
+    return PS_OK;
+  }
+
   BOOL unicode;
   FILE *incfp=FOPENTEXT2(f,"rt",&unicode);
   if (!incfp)
@@ -848,7 +1465,45 @@ int CEXEBuild::includeScript(TCHAR *f)
   TCHAR *oldtimestamp = set_timestamp_predefine(curfilename);
 #endif
 
-  int r=parseScript();
+  // a file included by one being recorded is part of its entry, see
+  // include_record_include()
+  struct include_record *outer_record=m_include_record;
+  tstring cachefile;
+  if ((!outer_record || !outer_record->cacheable) && !include_cache_dir.empty())
+  {
+    tstring key=include_hash_file(f);
+    if (!key.empty())
+    {
+      key+=fullpath;
+      cachefile=include_cache_dir+PLATFORM_PATH_SEPARATOR_STR+
+        include_hash_str(include_hash(include_hash_basis,key.c_str(),key.length()*sizeof(TCHAR)))+_T(".nsc");
+    }
+  }
+
+  const struct include_guard last_guard=m_include_guard;
+  m_include_guard.state=GUARD_FIRST_LINE;
+
+  int r;
+  tstring file_guard;
+  if (!cachefile.empty() && include_cache_load(f,cachefile,file_guard))
+    r=PS_EOF;
+  else
+  {
+    clock_t start=clock();
+    if (!cachefile.empty()) include_record_start();
+    r=parseScript();
+    if (m_include_guard.state == GUARD_CLOSED) file_guard=m_include_guard.name;
+    if (!cachefile.empty())
+    {
+      if (r == PS_EOF || r == PS_OK)
+        include_cache_save(cachefile,(int) ((clock()-start)*1000/CLOCKS_PER_SEC),file_guard);
+      delete m_include_record;
+      m_include_record=outer_record;
+    }
+  }
+  m_include_guard=last_guard;
+  if (!file_guard.empty() && (r == PS_EOF || r == PS_OK))
+    include_guards.add(fullpath.c_str(),file_guard.c_str());
 
 #ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
   // Added by Sunil Kamath 11 June 2003
@@ -880,27 +1535,8 @@ int CEXEBuild::includeScript(TCHAR *f)
 // !ifmacro[n]def based on Anders Kjersem's code
 int CEXEBuild::MacroExists(const TCHAR *macroname)
 {
-  TCHAR *m = (TCHAR *) m_macros.get();
-
-  while (m && *m)
-  {
-    // check if macroname matches
-    if (!_tcsicmp(m, macroname))
-      return 1;
-
-    // skip macro name
-    m += _tcslen(m) + 1;
-
-    // skip params
-    while (*m) m += _tcslen(m) + 1;
-    m++;
-
-    // skip data
-    while (*m) m += _tcslen(m) + 1;
-    if (m - (TCHAR *) m_macros.get() >= m_macros.getlen() - 1) break;
-    m++;
-  }
-  return 0;
+  if (m_include_record) include_record_macro(macroname);
+  return m_macros.find(macroname) != NULL;
 }
 
 int CEXEBuild::LoadLicenseFile(TCHAR *file, TCHAR** pdata, LineParser &line, BOOL* unicode) // caller must free *pdata, even on error result
@@ -945,21 +1581,19 @@ int CEXEBuild::LoadLicenseFile(TCHAR *file, TCHAR** pdata, LineParser &line, BOO
   return PS_OK;
 }
 
-int CEXEBuild::process_oneline(TCHAR *line, const TCHAR *filename, int linenum)
+int CEXEBuild::process_oneline(TCHAR *line, const TCHAR *filename, int linenum, int plain/*=0*/)
 {
   const TCHAR *last_filename=curfilename;
   curfilename=filename;
   int last_linecnt=linecnt;
   linecnt=linenum;
 
-  StringList hist;
-  GrowBuf linedata;
+  TinyGrowBuf linedata;
 
 #ifdef NSIS_SUPPORT_STANDARD_PREDEFINES
   // Added by Sunil Kamath 11 June 2003
   TCHAR *oldfilename = NULL;
   TCHAR *oldtimestamp = NULL;
-  TCHAR *oldline = NULL;
   BOOL is_commandline = !_tcscmp(filename,_T("command line"));
   BOOL is_macro = !_tcsncmp(filename,_T("macro:"),_tcslen(_T("macro:")));
 
@@ -968,11 +1602,12 @@ int CEXEBuild::process_oneline(TCHAR *line, const TCHAR *filename, int linenum)
       oldfilename = set_file_predefine(curfilename);
       oldtimestamp = set_timestamp_predefine(curfilename);
     }
-    oldline = set_line_predefine(linecnt, is_macro);
+    set_line_predefine(linecnt, is_macro);
   }
 #endif
 
-  ps_addtoline(line,linedata,hist);
+  linedata.add(line,plain*sizeof(TCHAR));
+  if (line[plain]) ps_addtoline(line+plain,linedata);
   linedata.add(_T(""),sizeof(_T("")));
   int ret=doParse((TCHAR*)linedata.get());
 
@@ -983,7 +1618,7 @@ int CEXEBuild::process_oneline(TCHAR *line, const TCHAR *filename, int linenum)
       restore_file_predefine(oldfilename);
       restore_timestamp_predefine(oldtimestamp);
     }
-    restore_line_predefine(oldline);
+    restore_line_predefine();
   }
 #endif
 
@@ -1041,6 +1676,9 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
 
   multiple_entries_instruction=0;
 
+  if (m_include_record && !include_cacheable_command(which_token,line))
+    include_not_cacheable();
+
   entry ent={0,};
   switch (which_token)
   {
@@ -1049,28 +1687,12 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
     case TOK_P_MACRO:
       {
         if (!line.gettoken_str(1)[0]) PRINTHELP()
-        TCHAR *t=(TCHAR *)m_macros.get();
-        while (t && *t)
-        {
-          if (!_tcsicmp(t,line.gettoken_str(1))) break;
-          t+=_tcslen(t)+1;
-
-          // advance over parameters
-          while (*t) t+=_tcslen(t)+1;
-          t++;
-
-          // advance over data
-          while (*t) t+=_tcslen(t)+1;
-          if (t-(TCHAR *)m_macros.get() >= m_macros.getlen()-1)
-            break;
-          t++;
-        }
-        if (t && *t)
+        if (MacroExists(line.gettoken_str(1)))
         {
           ERROR_MSG(_T("!macro: macro named \"%s\" already found!\n"),line.gettoken_str(1));
           return PS_ERROR;
         }
-        m_macros.add(line.gettoken_str(1),(_tcslen(line.gettoken_str(1))+1)*sizeof(TCHAR));
+        GrowBuf params, text;
 
         int pc;
         for (pc=2; pc < line.getnumtokens(); pc ++)
@@ -1090,9 +1712,8 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
               return PS_ERROR;
             }
           }
-          m_macros.add(line.gettoken_str(pc),(_tcslen(line.gettoken_str(pc))+1)*sizeof(TCHAR));
+          params.add(line.gettoken_str(pc),(_tcslen(line.gettoken_str(pc))+1)*sizeof(TCHAR));
         }
-        m_macros.add(_T(""),sizeof(_T("")));
 
         for (;;)
         {
@@ -1125,11 +1746,10 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
               return PS_ERROR;
             }
           }
-          if (str[0]) m_macros.add(str,(_tcslen(str)+1)*sizeof(TCHAR));
-          else m_macros.add(_T(" "),sizeof(_T(" ")));
+          text.add(str,(_tcslen(str)+1)*sizeof(TCHAR));
           linecnt++;
         }
-        m_macros.add(_T(""),sizeof(_T("")));
+        m_macros.add(line.gettoken_str(1),params,text);
       }
     return PS_OK;
     case TOK_P_MACROEND:
@@ -1139,35 +1759,17 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       {
         const TCHAR* mname=line.gettoken_str(1);
         if (!mname[0]) PRINTHELP()
-        TCHAR *t=(TCHAR *)m_macros.get(), *mbeg, *mend=0, *mbufb=t;
-        while (t && *t)
+        if (m_macro_entry.find(mname,0)>=0)
         {
-          const bool foundit = !_tcsicmp((mbeg=t),mname);
-          t+=_tcslen(t)+1;
-
-          // advance over parameters
-          while (*t) t+=_tcslen(t)+1;
-          t++;
-
-          // advance over data
-          while (*t) t+=_tcslen(t)+1;
-          if (foundit)
-          {
-            mend=t;
-            break;
-          }
-          if (t-mbufb >= m_macros.getlen()-1)
-            break;
-          t++;
+          ERROR_MSG(_T("!macroundef: \"%s\" is being inserted!\n"),mname);
+          return PS_ERROR;
         }
-        if (!mend)
+        if (m_include_record) include_record_macro(mname);
+        if (m_macros.del(mname))
         {
           ERROR_MSG(_T("!macroundef: \"%s\" does not exist!\n"),mname);
           return PS_ERROR;
         }
-        const unsigned int mcb=mend-mbeg, mbufcb=m_macros.getlen();
-        memmove(mbeg,mend+1,mbufcb-(mcb+(mbeg-mbufb)));
-        m_macros.resize(mbufcb-(mcb+1));
 
         SCRIPT_MSG(_T("!macroundef: %s\n"),mname);
       }
@@ -1175,52 +1777,35 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
     case TOK_P_INSERTMACRO:
       {
         if (!line.gettoken_str(1)[0]) PRINTHELP()
-        TCHAR *t=(TCHAR *)m_macros.get();
-        TCHAR *m=t;
-        while (t && *t)
-        {
-          if (!_tcsicmp(t,line.gettoken_str(1))) break;
-          t+=_tcslen(t)+1;
-
-          // advance over parms
-          while (*t) t+=_tcslen(t)+1;
-          t++;
-
-          // advance over data
-          while (*t) t+=_tcslen(t)+1;
-          if (t-(TCHAR *)m_macros.get() >= m_macros.getlen()-1)
-            break;
-          t++;
-        }
+        struct macro *mac=m_macros.find(line.gettoken_str(1));
         SCRIPT_MSG(_T("!insertmacro: %s\n"),line.gettoken_str(1));
-        if (!t || !*t)
+        if (!mac)
         {
           ERROR_MSG(_T("!insertmacro: macro named \"%s\" not found!\n"),line.gettoken_str(1));
           return PS_ERROR;
         }
-        t+=_tcslen(t)+1;
-
-
-        GrowBuf l_define_names;
-        DefineList l_define_saves;
+        // the cache can't replay the lines of a macro the file didn't add
+        if (m_include_record && include_record_macro(line.gettoken_str(1)))
+          include_not_cacheable();
+        // the lines may add macros, which moves mac but not its buffers, and
+        // it can't be deleted while it's inserted
+        TCHAR *params=mac->params, *t=params;
+        TCHAR *text=mac->text;
+        struct macro_line *lines=mac->lines;
+        int num_lines=mac->num_lines;
+
+        // the parameters hide the defines named like them until the end
+        GrowBuf l_define_saves;
         int npr=0;
         // advance over parms
         while (*t)
         {
-          TCHAR *v=definedlist.find(t);
-          if (v)
-          {
-            l_define_saves.add(t,v);
-            definedlist.del(t);
-          }
-          l_define_names.add(t,(_tcslen(t)+1)*sizeof(TCHAR));
-          definedlist.add(t,line.gettoken_str(npr+2));
+          struct define *saved=definedlist.push(t,line.gettoken_str(npr+2));
+          l_define_saves.add(&saved,sizeof(saved));
 
           npr++;
           t+=_tcslen(t)+1;
         }
-        l_define_names.add(_T(""),sizeof(_T("")));
-        t++;
         if (npr != line.getnumtokens()-2)
         {
           ERROR_MSG(_T("!insertmacro: macro \"%s\" requires %d parameter(s), passed %d!\n"),
@@ -1240,45 +1825,26 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
         wsprintf(str,_T("macro:%s"),line.gettoken_str(1));
         const TCHAR* oldmacroname=m_currentmacroname;
         m_currentmacroname=line.gettoken_str(1);
-        definedlist.del(_T("__MACRO__"));
-        definedlist.add(_T("__MACRO__"),m_currentmacroname);
-        while (*t)
+        for (lp=1; lp<=num_lines; lp++)
         {
-          lp++;
-          if (_tcscmp(t,_T(" ")))
+          TCHAR *l=text+lines[lp-1].text;
+          if (l[0])
           {
-            int ret=process_oneline(t,str,lp);
+            int ret=process_oneline(l,str,lp,lines[lp-1].plain);
             if (ret != PS_OK)
             {
               ERROR_MSG(_T("Error in macro %s on macroline %d\n"),line.gettoken_str(1),lp);
               return ret;
             }
           }
-          {
-            // fix t if process_oneline changed m_macros
-            TCHAR *nm=(TCHAR *)m_macros.get();
-            if (nm != m)
-            {
-              t += nm - m;
-              m = nm;
-            }
-          }
-          t+=_tcslen(t)+1;
         }
         m_macro_entry.delbypos(npos);
         {
-          TCHAR *p=(TCHAR*)l_define_names.get();
-          while (*p)
-          {
-            definedlist.del(p);
-            TCHAR *v;
-            if ((v=l_define_saves.find(p))) definedlist.add(p,v);
-            p+=_tcslen(p)+1;
-          }
+          struct define **saved=(struct define **)l_define_saves.get();
+          for (TCHAR *p=params; *p; p+=_tcslen(p)+1)
+            definedlist.pop(p,*saved++);
         }
-        definedlist.del(_T("__MACRO__"));
         m_currentmacroname = oldmacroname;
-        if (oldmacroname) definedlist.add(_T("__MACRO__"),oldmacroname);
         SCRIPT_MSG(_T("!insertmacro: end of %s\n"),line.gettoken_str(1));
       }
     return PS_OK;
@@ -1749,6 +2315,7 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
         ERROR_MSG(_T("Error: can't set LangString \"%s\"!\n"), name);
         return PS_ERROR;
       }
+      if (m_include_record) include_record_langstring(name, lang, str);
       // BUGBUG: Does not display UTF-8 properly.
       SCRIPT_MSG(_T("LangString: \"%s\" %d \"%s\"\n"), name, lang, str);
     }
@@ -2232,6 +2799,11 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
     return PS_ERROR;
 #endif//NSIS_CONFIG_SILENT_SUPPORT
     case TOK_OUTFILE:
+      if (build_datavolumes.is_open())
+      {
+        ERROR_MSG(_T("Error: OutFile: can't change the output file after SetDataFile stream started writing data files\n"));
+        return PS_ERROR;
+      }
       _tcsnccpy(build_output_filename,line.gettoken_str(1),1024-1);
       SCRIPT_MSG(_T("OutFile: \"%s\"\n"),build_output_filename);
     return PS_OK;
@@ -2910,8 +3482,12 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
         }
         else if (!_tcsicmp(line.gettoken_str(a),_T("/SOLID")))
         {
-//          build_compress_whole = true; // added by yew : disable compress whole
-			warning_fl(_T("ignore the /SOLID switch"));
+          if (build_data_file == 3)
+          {
+            ERROR_MSG(_T("Error: SetCompressor /SOLID can't be used with SetDataFile stream\n"));
+            return PS_ERROR;
+          }
+          build_compress_whole = true;
           a++;
         }
         else PRINTHELP();
@@ -3010,7 +3586,7 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       {
         line.eattoken();
         define=line.gettoken_str(1);
-        if (dupemode==1 && definedlist.find(define))return PS_OK;
+        if (dupemode==1 && find_define(define))return PS_OK;
       }
 
 
@@ -3124,6 +3700,7 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       }
 
       if (dupemode==2)definedlist.del(define);
+      else if (dupemode==0 && m_include_record) find_define(define); // it matters if it's there
       if (definedlist.add(define,value))
       {
         ERROR_MSG(_T("!define: \"%s\" already defined!\n"),define);
@@ -3133,6 +3710,7 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
     }
     return PS_OK;
     case TOK_P_UNDEF:
+      if (m_include_record) find_define(line.gettoken_str(1)); // it matters if it's there
       if (definedlist.del(line.gettoken_str(1)))
       {
         ERROR_MSG(_T("!undef: \"%s\" not defined!\n"),line.gettoken_str(1));
@@ -3230,76 +3808,18 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
           PRINTHELP();
         }
         
-        TCHAR *fc = my_convert(f);
-        int included = 0;
-
-        tstring dir = get_dir_name(fc);
-        tstring spec = get_file_name(fc);
-        tstring basedir = dir + PLATFORM_PATH_SEPARATOR_STR;
-        if (dir == spec) {
-          // no path, just file name
-          dir = _T(".");
-          basedir = _T("");
-        }
-
-        my_convert_free(fc);
+        std::vector<tstring> incfiles;
+        find_include_files(f,incfiles);
+        if (m_include_record) include_record_include(f,incfiles);
 
-        // search working directory
-        boost::scoped_ptr<dir_reader> dr( new_dir_reader() );
-        dr->read(dir);
-
-        for (dir_reader::iterator files_itr = dr->files().begin();
-             files_itr != dr->files().end();
-             files_itr++)
-        {
-          if (!dir_reader::matches(*files_itr, spec))
-            continue;
-
-          tstring incfile = basedir + *files_itr;
-
-          if (includeScript((TCHAR *) incfile.c_str()) != PS_OK) {
+        for (size_t i = 0; i < incfiles.size(); i++) {
+          if (includeScript((TCHAR *) incfiles[i].c_str()) != PS_OK) {
             return PS_ERROR;
           }
-
-          included++;
-        }
-
-        if (included)
-            return PS_OK;
-
-        // search include dirs
-        TCHAR *incdir = include_dirs.get();
-        int incdirs = include_dirs.getnum();
-
-        for (int i = 0; i < incdirs; i++, incdir += _tcslen(incdir) + 1) {
-          tstring curincdir = tstring(incdir) + PLATFORM_PATH_SEPARATOR_STR + dir;
-
-          boost::scoped_ptr<dir_reader> dr( new_dir_reader() );
-          dr->read(curincdir);
-
-          for (dir_reader::iterator incdir_itr = dr->files().begin();
-               incdir_itr != dr->files().end();
-               incdir_itr++)
-          {
-            if (!dir_reader::matches(*incdir_itr, spec))
-              continue;
-
-            tstring incfile = tstring(incdir) + PLATFORM_PATH_SEPARATOR_STR + basedir + *incdir_itr;
-
-            if (includeScript((TCHAR *) incfile.c_str()) != PS_OK) {
-              return PS_ERROR;
-            }
-
-            included++;
-          }
-
-          if (included)
-            return PS_OK;
-
         }
 
         // nothing found
-        if (!included)
+        if (incfiles.empty())
         {
           if(required) {
           ERROR_MSG(_T("!include: could not find: \"%s\"\n"),f);
@@ -3804,11 +4324,29 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       SCRIPT_MSG(_T("SetCompress: %s\n"),line.gettoken_str(1));
     return PS_OK;
 	case TOK_SETDATAFILE:
-		build_data_file=line.gettoken_enum(1,_T("off\0auto\0force\0"));
-		if (build_data_file==-1) PRINTHELP()
+	{
+		int k=line.gettoken_enum(1,_T("off\0auto\0force\0stream\0"));
+		if (k==-1) PRINTHELP()
+		if (k != build_data_file && (build_datavolumes.is_open() || (k==3 && build_datablock.getlen())))
+		{
+			ERROR_MSG(_T("Error: SetDataFile stream must be used before any data is added\n"));
+			return PS_ERROR;
+		}
+		if (k==3 && build_compress_whole)
+		{
+			ERROR_MSG(_T("Error: SetDataFile stream can't be used with SetCompressor /SOLID\n"));
+			return PS_ERROR;
+		}
+		build_data_file=k;
 		SCRIPT_MSG(_T("SetDataFile: %s\n"),line.gettoken_str(1));
-		return PS_OK;
+	}
+	return PS_OK;
     case TOK_FILESIZE:
+      if (build_datavolumes.is_open())
+      {
+        ERROR_MSG(_T("Error: FileSize: can't change the data file size after SetDataFile stream started writing data files\n"));
+        return PS_ERROR;
+      }
       build_file_length=line.gettoken_int(1);
       if (build_file_length<0)
       {
@@ -3817,6 +4355,14 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       }
       SCRIPT_MSG(_T("FileSize: %smb (%I64d bytes),0 means no limit\n"),line.gettoken_str(1),(__int64)build_file_length * (1<<20));
     return PS_OK;
+    case TOK_SETTOC:
+      {
+        int k=line.gettoken_enum(1,_T("off\0on\0"));
+        if (k==-1) PRINTHELP()
+        build_write_toc=!!k;
+        SCRIPT_MSG(_T("SetTOC: %s\n"),line.gettoken_str(1));
+      }
+    return PS_OK;
     case TOK_DBOPTIMIZE:
       build_optimize_datablock=line.gettoken_enum(1,_T("off\0on\0"));
       if (build_optimize_datablock==-1) PRINTHELP()
@@ -3860,9 +4406,22 @@ int CEXEBuild::doCommand(int which_token, LineParser &line)
       build_compress_dict_size <<= 20;
     }
     return PS_OK;
+    case TOK_SETCOMPRESSORBLOCKSIZE:
+    {
+      if (build_compressor_set && build_compress_whole)
+        warning_fl(_T("SetCompressorBlockSize: data already compressed in compress whole mode. Effectively ignored."));
+
+      int s;
+      int block_size=line.gettoken_int(1,&s);
+      if (!s || block_size < 1 || block_size > 1024) PRINTHELP();
+      SCRIPT_MSG(_T("SetCompressorBlockSize: %d mb\n"), block_size);
+      build_compress_block_size = block_size << 20;
+    }
+    return PS_OK;
 #else
     case TOK_SETCOMPRESSIONLEVEL:
     case TOK_SETCOMPRESSORDICTSIZE:
+    case TOK_SETCOMPRESSORBLOCKSIZE:
       ERROR_MSG(_T("Error: %s specified, NSIS_CONFIG_COMPRESSION_SUPPORT not defined.\n"),  line.gettoken_str(0));
     return PS_ERROR;
 #endif//NSIS_CONFIG_COMPRESSION_SUPPORT
@@ -6590,6 +7149,19 @@ int CEXEBuild::add_file(const tstring& dir, const tstring& file, int attrib, con
   TCHAR buf[1024];
   __int64 last_build_datablock_used=getcurdbsize();
   entry ent={0,};
+  toc_entry toc={0,};
+  if (generatecode || build_write_toc)
+  {
+    const TCHAR *i=filename;
+    TCHAR *o=buf;
+    while (*i)
+    {
+      const TCHAR c=*i++;
+      *o++=c;
+      if (c == _T('$')) *o++=_T('$');
+    }
+    *o=0;
+  }
   if (generatecode)
   {
     ent.which=EW_EXTRACTFILE;
@@ -6607,20 +7179,11 @@ int CEXEBuild::add_file(const tstring& dir, const tstring& file, int attrib, con
     }
     else
     {
-      const TCHAR *i=filename;
-      TCHAR *o=buf;
-      while (*i)
-      {
-        const TCHAR c=*i++;
-        *o++=c;
-        if (c == _T('$')) *o++=_T('$');
-      }
-      *o=0;
       ent.offsets[1]=add_string(buf);
     }
   }
 
-  __int64 db_offset = add_db_data(&mmap);
+  __int64 db_offset = add_db_data(&mmap, &toc);
   ent.offsets[2]= LODWORD(db_offset);
   ent.offsets[6]= HIDWORD(db_offset);
 
@@ -6702,6 +7265,14 @@ int CEXEBuild::add_file(const tstring& dir, const tstring& file, int attrib, con
     ent.offsets[5] = DefineInnerLangString(build_allowskipfiles ? NLF_FILE_ERROR : NLF_FILE_ERROR_NOIGNORE);
   }
 
+  if (build_write_toc)
+  {
+    toc.offset=db_offset;
+    toc.name_ptr=generatecode?ent.offsets[1]:add_string(buf);
+    toc.entry=generatecode?cur_entries->getlen()/sizeof(entry):-1;
+    cur_toc->add(&toc,sizeof(toc));
+  }
+
   if (generatecode)
   {
     int a=add_entry(&ent);
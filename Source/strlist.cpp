@@ -17,6 +17,7 @@
  */
 
 #include "strlist.h"
+#include <algorithm>
 
 MLStringList::MLStringList()
 {
@@ -29,44 +30,12 @@ MLStringList::MLStringList()
 #ifdef _UNICODE
 char* convert_processed_string_to_ansi(char *out, const TCHAR *in, WORD codepage); // defined in build.cpp
 
-// use 2 for case sensitive end-of-string matches too
-int MLStringList::findAnsi(const char *str, int case_sensitive) const // returns -1 if not found
-{
-  const char *s=(const char*) m_grAnsi.get();
-  int ml=getcount();
-  int offs=0;
-
-  size_t str_slen = strlen(str);
-  size_t offs_slen;
-
-  while (offs < ml)
-  {
-    // Check if the whole string matches str.
-    if ((case_sensitive && !strcmp(s+offs,str)) ||
-        (!case_sensitive && !stricmp(s+offs,str)))
-    {
-      return offs;
-    }
-
-    offs_slen = strlen(s+offs);
-
-    // Check if just the end of the string matches str.
-    if (case_sensitive==2 &&
-        str_slen < offs_slen &&  // check for end of string
-        !strcmp(s + offs + offs_slen - str_slen,str))
-    {
-      return offs + offs_slen - str_slen;
-    }
-    offs += offs_slen + 1;
-  }
-  return -1;
-}
 #endif
 
 int MLStringList::add(const TCHAR *str, WORD codepage /*= CP_ACP*/, bool processed, bool build_unicode)
 {
 #ifndef _UNICODE
-  int a=find(str,2);
+  int a=m_index.find(get(),getcount(),str);
   if (a >= 0)
       return a;
   int len = _tcslen(str)+1;
@@ -74,7 +43,7 @@ int MLStringList::add(const TCHAR *str, WORD codepage /*= CP_ACP*/, bool process
 #else
   if (build_unicode)
   {
-    int a=find(str,2);
+    int a=m_index.find(get(),getcount(),str);
     if (a >= 0)
       return a;
   }
@@ -88,7 +57,7 @@ int MLStringList::add(const TCHAR *str, WORD codepage /*= CP_ACP*/, bool process
     cbMultiByte = WideCharToMultiByte(codepage, 0, str, len, ansiBuf, len*2, NULL, NULL);
   if (!build_unicode)
   {
-    int a=findAnsi(ansiBuf,2);
+    int a=m_indexAnsi.find(getAnsi(),getcount(),ansiBuf);
     if (a >= 0)
     {
       delete[] ansiBuf;
@@ -195,38 +164,102 @@ int StringList::getnum() const
 }
 
 
-// ==========
-// DefineList
-// ==========
+// ========
+// NameTrie
+// ========
 
-/** 
- * Since the SortedStringList base class handles the memory for .name values,
- * this destructor handles all the .value values in struct define.
- */
-DefineList::~DefineList()
+NameTrie::NameTrie()
 {
-  struct define *s=(struct define*) m_gr.get();
-  int num=m_gr.getlen()/sizeof(struct define);
+  struct trie_node root;
+  memset(root.next,0,sizeof(root.next));
+  root.value=-1;
+  m_nodes.add(&root,sizeof(root));
+}
 
-  for (int i=0; i<num; i++) {
-    free(s[i].value);
+// '.', '_', digits then letters, -1 for anything else
+int NameTrie::slot(TCHAR c)
+{
+  if (c == _T('.')) return 0;
+  if (c == _T('_')) return 1;
+  if (c >= _T('0') && c <= _T('9')) return 2 + c - _T('0');
+  if (c >= _T('A') && c <= _T('Z')) return 12 + c - _T('A');
+  if (c >= _T('a') && c <= _T('z')) return 12 + c - _T('a');
+  return -1;
+}
+
+void NameTrie::add(const TCHAR *name, int value)
+{
+  const TCHAR *p;
+  int node=0;
+
+  for (p=name; *p; p++)
+    if (slot(*p) < 0) return;
+
+  for (p=name; *p; p++)
+  {
+    int next=((struct trie_node *) m_nodes.get())[node].next[slot(*p)];
+    if (!next)
+    {
+      struct trie_node n;
+      memset(n.next,0,sizeof(n.next));
+      n.value=-1;
+      next=m_nodes.add(&n,sizeof(n))/sizeof(n);
+      ((struct trie_node *) m_nodes.get())[node].next[slot(*p)]=next;
+    }
+    node=next;
   }
+
+  struct trie_node *n=(struct trie_node *) m_nodes.get()+node;
+  if (n->value < 0) n->value=value;
 }
 
-int DefineList::add(const TCHAR *name, const TCHAR *value/*=_T("")*/)
+int NameTrie::longest(const TCHAR *str, int *len) const
 {
-  int pos=SortedStringList<struct define>::add(name);
-  if (pos == -1)
+  const struct trie_node *nodes=(const struct trie_node *) m_nodes.get();
+  int node=0;
+  int value=-1;
+
+  for (const TCHAR *p=str; ; p++)
   {
-    return 1;
+    if (nodes[node].value >= 0)
+    {
+      value=nodes[node].value;
+      *len=p-str;
+    }
+    int s=slot(*p);
+    if (s < 0 || !nodes[node].next[s]) break;
+    node=nodes[node].next[s];
   }
+  return value;
+}
 
-  TCHAR **newvalue=&(((struct define*) m_gr.get())[pos].value);
-  size_t size_in_bytes = (_tcslen(value) + 1) * sizeof(TCHAR);
+// ==========
+// DefineList
+// ==========
 
-  *newvalue=(TCHAR*)malloc(size_in_bytes);
+static unsigned int define_hash(const TCHAR *name)
+{
+  // FNV-1a of the name in lower case, as _tcsicmp() compares it
+  unsigned int h=2166136261u;
+  for (; *name; name++)
+  {
+#ifdef _UNICODE
+    h^=(unsigned int) _totlower(*name);
+#else
+    h^=(unsigned int) _totlower((unsigned char) *name);
+#endif
+    h*=16777619u;
+  }
+  return h;
+}
+
+static struct define *define_alloc(const TCHAR *name, const TCHAR *value, unsigned int hash)
+{
+  size_t name_len=_tcslen(name)+1, value_len=_tcslen(value)+1;
+  size_t size_in_bytes=sizeof(struct define)+(name_len+value_len)*sizeof(TCHAR);
+  struct define *d=(struct define*) malloc(size_in_bytes);
 
-  if (!(*newvalue))
+  if (!d)
   {
     extern int g_display_errors;
     extern void quit();
@@ -236,50 +269,299 @@ int DefineList::add(const TCHAR *name, const TCHAR *value/*=_T("")*/)
     }
     quit();
   }
-  _tcscpy(*newvalue,value);
+  d->name=(TCHAR*) (d+1);
+  d->value=d->name+name_len;
+  d->hash=hash;
+  memcpy(d->name,name,name_len*sizeof(TCHAR));
+  memcpy(d->value,value,value_len*sizeof(TCHAR));
+  return d;
+}
+
+DefineList::DefineList() : m_slots(0), m_size(0), m_num(0), m_sorted(0), m_sorted_valid(false)
+{
+}
+
+DefineList::~DefineList()
+{
+  for (int i=0; i<m_size; i++) {
+    free(m_slots[i]);
+  }
+  free(m_slots);
+  free(m_sorted);
+}
+
+// returns the slot of name, or the empty slot it would go in
+int DefineList::lookup(const TCHAR *name, unsigned int hash)
+{
+  int mask=m_size-1;
+  int i=hash&mask;
+  while (m_slots[i])
+  {
+    if (m_slots[i]->hash==hash && !_tcsicmp(m_slots[i]->name,name))
+      break;
+    i=(i+1)&mask;
+  }
+  return i;
+}
+
+void DefineList::insert(struct define *d)
+{
+  // no more than half full, so lookups stay short
+  if ((m_num+1)*2 > m_size)
+  {
+    struct define **old=m_slots;
+    int old_size=m_size;
+
+    m_size=m_size ? m_size*2 : 32;
+    m_slots=(struct define**) calloc(m_size,sizeof(struct define*));
+    if (!m_slots)
+    {
+      extern int g_display_errors;
+      extern void quit();
+      if (g_display_errors)
+      {
+        PrintColorFmtMsg_ERR(_T("\nInternal compiler error #12345: GrowBuf realloc/malloc(%lu) failed.\n"), (unsigned long) (m_size*sizeof(struct define*)));
+      }
+      quit();
+    }
+    for (int i=0; i<old_size; i++)
+      if (old[i]) m_slots[lookup(old[i]->name,old[i]->hash)]=old[i];
+    free(old);
+  }
+
+  m_slots[lookup(d->name,d->hash)]=d;
+  m_num++;
+  m_sorted_valid=false;
+}
+
+// takes the define in slot out of the table and returns it
+struct define *DefineList::remove(int slot)
+{
+  struct define *d=m_slots[slot];
+  int mask=m_size-1;
+  int j=slot;
+
+  // move back the defines that follow, so none is left behind an empty slot
+  for (;;)
+  {
+    j=(j+1)&mask;
+    if (!m_slots[j]) break;
+    int k=m_slots[j]->hash&mask; // where it would rather be
+    if (slot<=j ? (k<=slot || k>j) : (k<=slot && k>j))
+    {
+      m_slots[slot]=m_slots[j];
+      slot=j;
+    }
+  }
+  m_slots[slot]=0;
+  m_num--;
+  m_sorted_valid=false;
+  return d;
+}
+
+int DefineList::add(const TCHAR *name, const TCHAR *value/*=_T("")*/)
+{
+  unsigned int hash=define_hash(name);
+  if (m_size && m_slots[lookup(name,hash)])
+  {
+    return 1;
+  }
+
+  insert(define_alloc(name,value,hash));
   return 0;
 }
 
 TCHAR *DefineList::find(const TCHAR *name)
 {
-  int v=SortedStringList<struct define>::find(name);
-  if (v==-1)
+  if (!m_num)
   {
     return NULL;
   }
-  return ((struct define*) m_gr.get())[v].value;
+  struct define *d=m_slots[lookup(name,define_hash(name))];
+  return d ? d->value : NULL;
 }
 
 // returns 0 on success, 1 otherwise
 int DefineList::del(const TCHAR *str)
 {
-  int pos=SortedStringList<struct define>::find(str);
-  if (pos==-1) return 1;
+  if (!m_num) return 1;
 
-  struct define *db=(struct define *) m_gr.get();
-  free(db[pos].value);
-  delbypos(pos);
+  int slot=lookup(str,define_hash(str));
+  if (!m_slots[slot]) return 1;
+
+  free(remove(slot));
 
   return 0;
 }
 
+struct define *DefineList::push(const TCHAR *name, const TCHAR *value)
+{
+  unsigned int hash=define_hash(name);
+  struct define *saved=0;
+
+  if (m_num)
+  {
+    int slot=lookup(name,hash);
+    if (m_slots[slot]) saved=remove(slot);
+  }
+  insert(define_alloc(name,value,hash));
+  return saved;
+}
+
+void DefineList::pop(const TCHAR *name, struct define *saved)
+{
+  del(name);
+  if (saved) insert(saved);
+}
+
 int DefineList::getnum()
 {
-  return m_gr.getlen()/sizeof(define);
+  return m_num;
 }
 
-TCHAR *DefineList::getname(int num)
+static bool define_less(const struct define *a, const struct define *b)
+{
+  return _tcsicmp(a->name,b->name) < 0;
+}
+
+struct define *DefineList::sorted(int num)
 {
   if ((unsigned int)getnum() <= (unsigned int)num)
     return 0;
-  return ((struct define*) m_gr.get())[num].name;
+  if (!m_sorted_valid)
+  {
+    struct define **p=(struct define**) realloc(m_sorted,m_num*sizeof(struct define*));
+    if (!p)
+      return 0;
+    m_sorted=p;
+    for (int i=0; i<m_size; i++)
+      if (m_slots[i]) *p++=m_slots[i];
+    std::sort(m_sorted,m_sorted+m_num,define_less);
+    m_sorted_valid=true;
+  }
+  return m_sorted[num];
+}
+
+TCHAR *DefineList::getname(int num)
+{
+  struct define *d=sorted(num);
+  return d ? d->name : 0;
 }
 
 TCHAR *DefineList::getvalue(int num)
 {
-  if ((unsigned int)getnum() <= (unsigned int)num)
-    return 0;
-  return ((struct define*) m_gr.get())[num].value;
+  struct define *d=sorted(num);
+  return d ? d->value : 0;
+}
+
+// =========
+// MacroList
+// =========
+
+static void *macro_alloc(size_t size_in_bytes)
+{
+  void *p=malloc(size_in_bytes ? size_in_bytes : 1);
+  if (!p)
+  {
+    extern int g_display_errors;
+    extern void quit();
+    if (g_display_errors)
+    {
+      PrintColorFmtMsg_ERR(_T("\nInternal compiler error #12345: GrowBuf realloc/malloc(%lu) failed.\n"), (unsigned long) size_in_bytes);
+    }
+    quit();
+  }
+  return p;
+}
+
+static void macro_free(struct macro *m)
+{
+  free(m->params);
+  free(m->text);
+  free(m->lines);
+}
+
+MacroList::~MacroList()
+{
+  struct macro *s=(struct macro*) m_gr.get();
+  int num=m_gr.getlen()/sizeof(struct macro);
+
+  for (int i=0; i<num; i++) {
+    macro_free(&s[i]);
+  }
+}
+
+int MacroList::add(const TCHAR *name, const GrowBuf &params, const GrowBuf &text)
+{
+  int pos=SortedStringList<struct macro>::add(name);
+  if (pos == -1)
+  {
+    return 1;
+  }
+
+  int params_len=(int) params.getlen(), text_len=(int) text.getlen();
+  TCHAR *p=(TCHAR*) macro_alloc(params_len+sizeof(TCHAR));
+  TCHAR *t=(TCHAR*) macro_alloc(text_len);
+  memcpy(p,params.get(),params_len);
+  p[params_len/sizeof(TCHAR)]=0;
+  memcpy(t,text.get(),text_len);
+
+  int num_lines=0, i;
+  for (i=0; i<text_len/(int)sizeof(TCHAR); i++)
+    if (!t[i]) num_lines++;
+
+  struct macro_line *lines=(struct macro_line*) macro_alloc(num_lines*sizeof(struct macro_line));
+  int offs=0;
+  for (i=0; i<num_lines; i++)
+  {
+    // only a $ starts anything ps_addtoline() replaces
+    TCHAR *d=_tcschr(t+offs,_T('$'));
+    int len=(int) _tcslen(t+offs);
+    lines[i].text=offs;
+    lines[i].plain=d ? (int) (d-(t+offs)) : len;
+    offs+=len+1;
+  }
+
+  struct macro *m=&((struct macro*) m_gr.get())[pos];
+  m->params=p;
+  m->text=t;
+  m->lines=lines;
+  m->num_lines=num_lines;
+  m->serial=++m_serial;
+  return 0;
+}
+
+struct macro *MacroList::find(const TCHAR *name)
+{
+  int v=SortedStringList<struct macro>::find(name);
+  if (v==-1)
+  {
+    return NULL;
+  }
+  return &((struct macro*) m_gr.get())[v];
+}
+
+// returns 0 on success, 1 otherwise
+int MacroList::del(const TCHAR *str)
+{
+  int pos=SortedStringList<struct macro>::find(str);
+  if (pos==-1) return 1;
+
+  macro_free(&((struct macro *) m_gr.get())[pos]);
+  delbypos(pos);
+
+  return 0;
+}
+
+int MacroList::getnum() const
+{
+  return (int) (m_gr.getlen()/sizeof(struct macro));
+}
+
+struct macro *MacroList::get(int num)
+{
+  if (num < 0 || num >= getnum()) return NULL;
+  return &((struct macro*) m_gr.get())[num];
 }
 
 // ==============
@@ -117,6 +117,147 @@ protected:
   GrowBuf m_gr;
 };
 
+/**
+ * Indexes the strings of a StringList buffer, and every end of them, by
+ * hash.  find() gives the same offset StringList::find(str, 2) does without
+ * going through all of the strings.  Only the ends no earlier string has
+ * are added, so strings that share their ends with others don't take much.
+ */
+template <class T>
+class SuffixIndex
+{
+  private: // don't copy instances
+    SuffixIndex(const SuffixIndex&);
+    void operator=(const SuffixIndex&);
+
+  public:
+    SuffixIndex() : m_slots(0), m_size(0), m_num(0), m_indexed(0) {}
+    ~SuffixIndex() { free(m_slots); }
+
+    /**
+     * Finds str in buf, count Ts of null terminated strings.  The strings
+     * added to buf since the last call are indexed first, so buf may only
+     * grow in between.
+     *
+     * @return the offset of the first string that is str, or of the end of
+     * the first one that ends with it.  -1 if not found.
+     */
+    int find(const T *buf, int count, const T *str)
+    {
+      while (m_indexed < count)
+        m_indexed = index(buf, m_indexed) + 1;
+      if (!m_size) return -1;
+
+      unsigned int hash = 2166136261u;
+      for (int i = length(str); i--; )
+        hash = next_hash(hash, str[i]);
+      return m_slots[lookup(buf, str, hash)].pos - 1;
+    }
+
+  private:
+    struct slot {
+      unsigned int hash;
+      int pos; // + 1, 0 if the slot is empty
+    };
+
+    static int length(const T *str)
+    {
+      const T *p = str;
+      while (*p) p++;
+      return p - str;
+    }
+
+    // FNV-1a from the last character back, so the hash of every end of a
+    // string comes from the hash of the one a character shorter
+    static unsigned int next_hash(unsigned int hash, T c)
+    {
+      return (hash ^ (unsigned int) c) * 16777619u;
+    }
+
+    int lookup(const T *buf, const T *str, unsigned int hash) const
+    {
+      int mask = m_size - 1;
+      int i = hash & mask;
+      while (m_slots[i].pos)
+      {
+        if (m_slots[i].hash == hash)
+        {
+          const T *a = buf + m_slots[i].pos - 1, *b = str;
+          while (*a == *b && *a) a++, b++;
+          if (*a == *b) break;
+        }
+        i = (i + 1) & mask;
+      }
+      return i;
+    }
+
+    void insert(unsigned int hash, int pos)
+    {
+      // no more than half full, so lookups stay short
+      if ((m_num + 1) * 2 > m_size)
+      {
+        struct slot *old = m_slots;
+        int old_size = m_size;
+
+        m_size = m_size ? m_size * 2 : 1024;
+        m_slots = (struct slot *) calloc(m_size, sizeof(struct slot));
+        if (!m_slots)
+        {
+          extern int g_display_errors;
+          extern void quit();
+          if (g_display_errors)
+          {
+            PrintColorFmtMsg_ERR(_T("\nInternal compiler error #12345: GrowBuf realloc/malloc(%lu) failed.\n"), (unsigned long) (m_size*sizeof(struct slot)));
+          }
+          quit();
+        }
+        for (int i = 0; i < old_size; i++)
+          if (old[i].pos) place(old[i]);
+        free(old);
+      }
+
+      struct slot s = { hash, pos + 1 };
+      place(s);
+      m_num++;
+    }
+
+    // puts s in the first empty slot from where its hash points
+    void place(const struct slot &s)
+    {
+      int mask = m_size - 1;
+      int i = s.hash & mask;
+      while (m_slots[i].pos) i = (i + 1) & mask;
+      m_slots[i] = s;
+    }
+
+    // indexes the ends of the string at pos from the longest one until
+    // one is in already, as the ones shorter than it are then too.
+    // returns the offset of its terminator.
+    int index(const T *buf, int pos)
+    {
+      int len = length(buf + pos);
+      m_hashes.resize((len + 1) * sizeof(unsigned int));
+      unsigned int *hash = (unsigned int *) m_hashes.get();
+
+      hash[len] = 2166136261u;
+      for (int i = len; i--; )
+        hash[i] = next_hash(hash[i + 1], buf[pos + i]);
+      for (int i = 0; i <= len; i++)
+      {
+        if (m_size && m_slots[lookup(buf, buf + pos + i, hash[i])].pos)
+          break;
+        insert(hash[i], pos + i);
+      }
+      return pos + len;
+    }
+
+    struct slot *m_slots; // a power of 2 of them
+    int m_size;
+    int m_num;
+    int m_indexed; // Ts of the buffer in the index
+    TinyGrowBuf m_hashes; // of the ends of the string being indexed
+};
+
 /**
  * Similar to StringList with case_sensitive=2, but stores strings as both Unicode AND ANSI (codepaged)
  */
@@ -136,9 +277,12 @@ public:
   const TCHAR *getTchar() const     { return (const TCHAR*) m_gr.get(); }
 #ifdef _UNICODE
   const char *getAnsi() const       { return (const char*) m_grAnsi.get(); }
-  int findAnsi(const char *str, int case_sensitive) const;
+#endif
 private:
+  SuffixIndex<TCHAR> m_index;
+#ifdef _UNICODE
   GrowBuf m_grAnsi;
+  SuffixIndex<char> m_indexAnsi; // strings the same offsets as in m_gr
 #endif
 };
 
@@ -430,18 +574,66 @@ class SortedStringListND // no delete - can be placed in GrowBuf
 };
 
 /**
- * Structure stored by DefineList.
+ * A node of NameTrie.
+ */
+struct trie_node {
+  int next[38]; // node of the name one character longer, 0 if none
+  int value;    // of the name that ends here, -1 if none
+};
+
+/**
+ * NameTrie finds the longest name a string starts with in one pass over its
+ * characters, case insensitively.  Names can only have the characters of
+ * variable names: letters, digits, '.' and '_'.
+ */
+class NameTrie
+{
+  private: // don't copy instances
+    NameTrie(const NameTrie&);
+    void operator=(const NameTrie&);
+
+  public:
+    NameTrie();
+
+	 /**
+	  * Adds a name.  A name that is already in keeps the value it has, and
+	  * names with other characters are left out.
+	  *
+	  * @param value What longest() returns for the name, >= 0.
+	  */
+    void add(const TCHAR *name, int value);
+
+	 /**
+	  * Finds the longest name str starts with.
+	  *
+	  * @param len Set to the length of the name found.
+	  *
+	  * @return The value of the name, -1 if str doesn't start with any.
+	  */
+    int longest(const TCHAR *str, int *len) const;
+
+  private:
+    static int slot(TCHAR c);
+
+    TinyGrowBuf m_nodes; // struct trie_node, the root first
+};
+
+/**
+ * Structure stored by DefineList.  The name and the value are stored right
+ * after it, in the same allocation.
  */
 struct define {
   TCHAR *name;		// key
   TCHAR *value;	// value stored
+  unsigned int hash; // of the name, case insensitive
 };
 
 /**
- * DefineList is a specialized version of a SortedStringList
- * which is like a string to string mapping class.
+ * DefineList is a string to string mapping class, case insensitive.  The
+ * defines are kept in an open addressing hash table, so adding, finding and
+ * deleting one doesn't depend on how many there are.
  */
-class DefineList : public SortedStringList<struct define>
+class DefineList
 {
   private: // don't copy instances
     DefineList(const DefineList&);
@@ -449,7 +641,7 @@ class DefineList : public SortedStringList<struct define>
 
   public:
 	 /* Empty default constructor */
-    DefineList() {} // VC6 complains otherwise
+    DefineList();
     virtual ~DefineList();
 
 	 /**
@@ -485,23 +677,125 @@ class DefineList : public SortedStringList<struct define>
     int del(const TCHAR *str);
 
 	 /**
-	  * This function returns the number of define structs in the sorted array.
+	  * Defines name as value for a while, for the parameters of a macro.
+	  * The define it hides, if any, is taken out of the list as it is and
+	  * returned, to be passed to pop() when name goes out of scope.
+	  */
+    struct define *push(const TCHAR *name, const TCHAR *value);
+
+	 /**
+	  * Deletes name, if defined, and puts back the define push() returned.
+	  */
+    void pop(const TCHAR *name, struct define *saved);
+
+	 /**
+	  * This function returns the number of define structs in the list.
 	  */
     int getnum();
 
 	 /**
-	  * Get the .name string of the (num)th define struct in the sorted array.
+	  * Get the .name string of the (num)th define struct, sorted by name.
 	  *
 	  * @return Returns 0 if not found, otherwise the pointer to the .name.
 	  */
     TCHAR *getname(int num);
 
 	 /**
-	  * Get the .value string of the (num)th define struct in the sorted array.
+	  * Get the .value string of the (num)th define struct, sorted by name.
 	  *
 	  * @return Returns 0 if not found, otherwise the pointer to the .value.
 	  */
     TCHAR *getvalue(int num);
+
+  private:
+    int lookup(const TCHAR *name, unsigned int hash);
+    void insert(struct define *d);
+    struct define *remove(int slot);
+    struct define *sorted(int num);
+
+    struct define **m_slots; // NULL or a define, a power of 2 of them
+    int m_size;
+    int m_num;
+    struct define **m_sorted; // built by getname() and getvalue()
+    bool m_sorted_valid;
+};
+
+/**
+ * A line of a macro, as stored by MacroList.
+ */
+struct macro_line {
+  int text;  // TCHAR offset of the line in macro.text
+  int plain; // TCHARs at the start of the line ps_addtoline() copies as they are
+};
+
+/**
+ * Structure stored by MacroList.
+ */
+struct macro {
+  TCHAR *name;   // key
+  TCHAR *params; // the parameter names, each NUL terminated, an empty one last
+  TCHAR *text;   // the lines, each NUL terminated
+  struct macro_line *lines;
+  int num_lines;
+  int serial;    // tells the macro apart from one added again under its name
+};
+
+/**
+ * MacroList is a specialized version of a SortedStringList that keeps the
+ * macros of a script by name, so !insertmacro finds them by binary search.
+ * Every line of a macro is split once where ps_addtoline() would start
+ * replacing things, so lines that use no defines are inserted as they are.
+ */
+class MacroList : public SortedStringList<struct macro>
+{
+  private: // don't copy instances
+    MacroList(const MacroList&);
+    void operator=(const MacroList&);
+
+  public:
+	 /* Empty default constructor */
+    MacroList() : m_serial(0) {}
+    virtual ~MacroList();
+
+	 /**
+     * Add a macro, case insensitively.
+     *
+     * @param params The parameter names, each NUL terminated.
+     *
+     * @param text The lines, each NUL terminated.
+     *
+     * @return Returns 0 if successful, 1 if already exists.  Errors cause
+	  * general program exit with error logging.
+	  */
+    int add(const TCHAR *name, const GrowBuf &params, const GrowBuf &text);
+
+	 /**
+	  * This function returns the macro named name.  The struct moves when
+	  * macros are added or deleted, its buffers don't.
+	  *
+	  * @return The macro or NULL if not found.
+	  */
+    struct macro *find(const TCHAR *name);
+
+	 /**
+	  * This function deletes the macro named str.
+	  *
+	  * @return Returns 0 on success, 1 otherwise
+	  */
+    int del(const TCHAR *str);
+
+	 /**
+	  * This function returns the number of macros in the list.
+	  */
+    int getnum() const;
+
+	 /**
+	  * Get the (num)th macro, sorted by name.
+	  */
+    struct macro *get(int num);
+
+  private:
+    int m_serial;
 };
 
 /**
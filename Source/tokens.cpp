@@ -19,6 +19,7 @@
 #include "Platform.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
 
 #include "build.h"
 #include "tokens.h"
@@ -187,10 +188,12 @@ static tokenType tokenlist[TOK__LAST] =
 {TOK_SETCTLCOLORS,_T("SetCtlColors"),2,2,_T("hwnd [/BRANDING] [text_color] [transparent|bg_color]"),TP_CODE},
 {TOK_SETBRANDINGIMAGE,_T("SetBrandingImage"),1,2,_T("[/IMGID=image_item_id_in_dialog] [/RESIZETOFIT] bitmap.bmp"),TP_CODE},
 {TOK_SETCOMPRESS,_T("SetCompress"),1,0,_T("(off|auto|force)"),TP_ALL},
-{TOK_SETDATAFILE,_T("SetDataFile"),1,0,_T("(off|auto|force)"),TP_ALL},
+{TOK_SETDATAFILE,_T("SetDataFile"),1,0,_T("(off|auto|force|stream)"),TP_ALL},
 {TOK_FILESIZE,_T("FileSize"),1,0,_T("single_file_max_size_mb"),TP_ALL},
+{TOK_SETTOC,_T("SetTOC"),1,0,_T("(off|on)"),TP_ALL},
 {TOK_SETCOMPRESSOR,_T("SetCompressor"),1,2,_T("[/FINAL] [/SOLID] (zlib|bzip2|lzma)"),TP_GLOBAL},
 {TOK_SETCOMPRESSORDICTSIZE,_T("SetCompressorDictSize"),1,0,_T("dict_size_mb"),TP_ALL},
+{TOK_SETCOMPRESSORBLOCKSIZE,_T("SetCompressorBlockSize"),1,0,_T("block_size_mb"),TP_ALL},
 {TOK_SETCOMPRESSIONLEVEL,_T("SetCompressionLevel"),1,0,_T("level_0-9"),TP_ALL},
 {TOK_SETDATESAVE,_T("SetDateSave"),1,0,_T("(off|on)"),TP_ALL},
 {TOK_SETDETAILSVIEW,_T("SetDetailsView"),1,0,_T("(hide|show)"),TP_CODE},
@@ -319,26 +322,55 @@ void CEXEBuild::print_help(TCHAR *commandname)
 
 }
 
+// every line of a script, macros included, looks up its command, so
+// tokenlist is searched through a case insensitive sorted index of it
+static int tokenindex[TOK__LAST];
+static int tokenindex_num = -1;
+
+static bool tokenindex_less(int a, int b)
+{
+  return _tcsicmp(tokenlist[a].name, tokenlist[b].name) < 0;
+}
+
+static bool tokenindex_less_name(int a, const TCHAR *name)
+{
+  return _tcsicmp(tokenlist[a].name, name) < 0;
+}
+
+// returns the position of the first token named s in tokenlist, or -1
+static int find_token(const TCHAR *s)
+{
+  if (tokenindex_num < 0)
+  {
+    int n = 0;
+    for (int x = 0; x < TOK__LAST; x ++)
+      if (tokenlist[x].name)
+        tokenindex[n++] = x;
+    // stable, so a name listed twice still finds its first entry
+    std::stable_sort(tokenindex, tokenindex + n, tokenindex_less);
+    tokenindex_num = n;
+  }
+
+  int *p = std::lower_bound(tokenindex, tokenindex + tokenindex_num, s, tokenindex_less_name);
+  if (p == tokenindex + tokenindex_num || _tcsicmp(tokenlist[*p].name, s))
+    return -1;
+  return *p;
+}
+
 bool CEXEBuild::is_valid_token(TCHAR *s)
 {
-  for (int x = 0; x < TOK__LAST; x ++)
-    if (!_tcsicmp(tokenlist[x].name,s)) 
-      return true;
-  return false;
+  return find_token(s) >= 0;
 }
 
 int CEXEBuild::get_commandtoken(TCHAR *s, int *np, int *op, int *pos)
 {
-  int x;
-  for (x = 0; x < TOK__LAST; x ++)
-    if (!_tcsicmp(tokenlist[x].name,s)) 
-    {
-      *np=tokenlist[x].num_parms;
-      *op=tokenlist[x].opt_parms;
-      *pos=x;
-      return tokenlist[x].id;
-    }
-  return -1;
+  int x = find_token(s);
+  if (x < 0)
+    return -1;
+  *np=tokenlist[x].num_parms;
+  *op=tokenlist[x].opt_parms;
+  *pos=x;
+  return tokenlist[x].id;
 }
 
 int CEXEBuild::GetCurrentTokenPlace()
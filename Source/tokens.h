@@ -90,10 +90,12 @@ enum
   TOK_DBOPTIMIZE,
   TOK_SETCOMPRESSOR,
   TOK_SETCOMPRESSORDICTSIZE,
+  TOK_SETCOMPRESSORBLOCKSIZE,
   TOK_SETCOMPRESSIONLEVEL,
   TOK_FILEBUFSIZE,
   TOK_SETDATAFILE,
   TOK_FILESIZE,
+  TOK_SETTOC,
   
   // system "preprocessor"ish tokens
   TOK_P_IF,